@@ -0,0 +1,112 @@
+#!/bin/bash
+#
+# End-to-end benchmark: sends a file from server to client through impair
+# under each scenario below, for each congestion control, and prints the
+# completion time, goodput and retransmission ratio of every run. Fails if
+# any received.data differs from what was sent.
+#
+# Knobs, from the environment:
+#   BENCH_SIZE      bytes to transfer (default 8 MiB)
+#   BENCH_CC        congestion controls to try (default "reno cubic bbr")
+#   BENCH_ONLY      only run scenarios whose name matches this regex
+#   BENCH_PORT      server port; impair listens on the next one (default 47000)
+#   BENCH_TIMEOUT   seconds before a run counts as failed (default 120)
+#
+# Usually run with `make bench`.
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+SIZE=${BENCH_SIZE:-8388608}
+CCS=${BENCH_CC:-reno cubic bbr}
+ONLY=${BENCH_ONLY:-.}
+PORT=${BENCH_PORT:-47000}
+TIMEOUT=${BENCH_TIMEOUT:-120}
+
+# name              impair arguments
+SCENARIOS=(
+    "clean              "
+    "rtt-20ms           -d 10"
+    "jitter             -d 10 -j 5"
+    "loss-1%            -d 5 -l 0.01"
+    "loss-5%            -d 5 -l 0.05"
+    "burst-loss         -d 5 -l 0.02 -b 3"
+    "reorder-5%         -d 5 -r 0.05"
+    "duplicate-5%       -d 5 -D 0.05"
+    "bottleneck-20MB/s  -d 10 -w 20000000 -q 200"
+    "lossy-bottleneck   -d 10 -w 20000000 -q 200 -l 0.01"
+    "everything         -d 10 -j 2 -w 20000000 -q 200 -l 0.01 -r 0.02 -D 0.01"
+)
+
+for bin in server client impair; do
+    if [ ! -x "$ROOT/$bin" ]; then
+        echo "$ROOT/$bin is missing; run make first" >&2
+        exit 1
+    fi
+done
+
+WORK=$(mktemp -d)
+trap 'kill $server_pid $impair_pid 2>/dev/null; rm -rf "$WORK"' EXIT
+server_pid=
+impair_pid=
+head -c "$SIZE" /dev/urandom > "$WORK/source.data"
+
+# Prints the value of counter $2 in the metrics dump $1
+counter() {
+    grep -o "\"$2\": [0-9]*" "$1" | head -1 | grep -o '[0-9]*$'
+}
+
+failures=0
+printf "%-20s %-6s %9s %12s %8s %s\n" scenario cc "time (s)" "goodput MB/s" "rtx %" result
+for cc in $CCS; do
+    for scenario in "${SCENARIOS[@]}"; do
+        read -r name args <<< "$scenario"
+        if ! [[ $name =~ $ONLY ]]; then
+            continue
+        fi
+        run="$WORK/${name//\//-}-$cc"
+        mkdir -p "$run"
+        "$ROOT/server" -c "$cc" -l off -j "$run/server.json" "$PORT" \
+            "$WORK/source.data" 2> "$run/server.log" &
+        server_pid=$!
+        # shellcheck disable=SC2086
+        "$ROOT/impair" $args $((PORT + 1)) 127.0.0.1 "$PORT" 2> "$run/impair.log" &
+        impair_pid=$!
+        sleep 0.2
+        start=$(date +%s.%N)
+        (cd "$run" && timeout "$TIMEOUT" "$ROOT/client" -l off -j client.json \
+            127.0.0.1 $((PORT + 1)) > client.log 2>&1)
+        status=$?
+        end=$(date +%s.%N)
+        kill "$server_pid" "$impair_pid" 2>/dev/null
+        wait "$server_pid" "$impair_pid" 2>/dev/null
+        server_pid=
+        impair_pid=
+
+        result=ok
+        if [ $status -ne 0 ]; then
+            result="FAILED (client exited with $status)"
+        elif ! cmp -s "$WORK/source.data" "$run/received.data"; then
+            result="FAILED (received.data differs)"
+        fi
+        sent=$(counter "$run/server.json" segments_sent)
+        resent=$(counter "$run/server.json" segments_retransmitted)
+        awk -v name="$name" -v cc="$cc" -v start="$start" -v end="$end" \
+            -v size="$SIZE" -v sent="${sent:-0}" -v resent="${resent:-0}" \
+            -v result="$result" 'BEGIN {
+                secs = end - start
+                printf "%-20s %-6s %9.2f %12.2f %8.2f %s\n", name, cc, secs,
+                       size / secs / 1e6, (sent > 0 ? 100 * resent / sent : 0),
+                       result
+            }'
+        if [ "$result" != ok ]; then
+            failures=$((failures + 1))
+            cp -r "$run" "$ROOT/bench-failed-$(basename "$run")"
+        fi
+    done
+done
+
+if [ $failures -gt 0 ]; then
+    echo "$failures run(s) failed; logs are in $ROOT/bench-failed-*" >&2
+    exit 1
+fi
@@ -0,0 +1,349 @@
+#include "Batch.h"
+
+#include <algorithm>                    // for max, min
+#include <cerrno>                       // for errno, EINTR, EIO, etc
+#include <chrono>                       // for duration_cast, nanoseconds
+#include <cstring>                      // for memcmp, memcpy, memset
+#include <ostream>                      // for operator<<, ostream
+
+#include <netinet/udp.h>                // for SOL_UDP, UDP_SEGMENT, UDP_GRO
+#include <time.h>                       // for clock_gettime, CLOCK_MONOTONIC
+#ifdef SO_TXTIME
+#include <linux/net_tstamp.h>           // for sock_txtime
+#endif
+
+/*
+ * Implementations
+ */
+std::ostream& operator<<(std::ostream& os, const BatchStats& s)
+{
+    os << s.datagrams << " datagrams in " << s.calls << " calls ("
+       << s.per_call() << " per call), " << s.saved() << " syscalls saved";
+    return os;
+}
+
+SendBatch::SendBatch(size_t capacity) :
+    heads_(capacity), iovs_(2 * capacity), msgs_(capacity), txtimes_(capacity),
+    runs_(capacity), run_lens_(capacity), gso_sizes_(capacity), count_(0),
+    txtime_(false), gso_(false)
+{
+}
+
+bool SendBatch::enable_txtime(Socket& sock)
+{
+#ifdef SO_TXTIME
+    // fq only takes departure times on the monotonic clock
+    sock_txtime cfg;
+    std::memset(&cfg, 0, sizeof(cfg));
+    cfg.clockid = CLOCK_MONOTONIC;
+    txtime_ = sock.setsockopt(SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg)) == 0;
+#else
+    (void)sock;
+    errno = ENOPROTOOPT;
+#endif
+    return txtime_;
+}
+
+bool SendBatch::enable_gso(Socket& sock)
+{
+#ifdef UDP_SEGMENT
+    // Setting a segment size of 0 leaves each send() a single datagram
+    // unless it says otherwise, which is what we want; this is just to see
+    // whether the kernel knows the option at all
+    int size = 0;
+    gso_ = sock.setsockopt(SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0;
+#else
+    (void)sock;
+    errno = ENOPROTOOPT;
+#endif
+    return gso_;
+}
+
+void SendBatch::add(const Packet& p, const char* payload, size_t payload_len,
+                    const sockaddr* addr, socklen_t addr_len,
+                    PacketWrapper::time_point departure)
+{
+    Packet& head = heads_[count_];
+    std::memcpy(&head.headers, &p.headers, Packet::HEADER_SZ);
+    std::memcpy(head.data, p.data, p.headers.opt_len);
+    head.to_network();
+
+    iovec* iov = &iovs_[2 * count_];
+    iov[0].iov_base = (void*)&head;
+    iov[0].iov_len = Packet::HEADER_SZ + p.headers.opt_len;
+    iov[1].iov_base = (void*)payload;
+    iov[1].iov_len = payload_len;
+
+    msghdr& msg = msgs_[count_].msg_hdr;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)addr;
+    msg.msg_namelen = addr_len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = payload_len > 0 ? 2 : 1;
+#ifdef SO_TXTIME
+    if (txtime_ && departure != PacketWrapper::time_point())
+    {
+        // Our clock isn't necessarily the monotonic one, so go by how far
+        // in the future departure is
+        using namespace std::chrono;
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        int64_t delay = duration_cast<nanoseconds>(departure - now()).count();
+        uint64_t when = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec +
+                        (delay > 0 ? delay : 0);
+        msg.msg_control = txtimes_[count_].buf;
+        msg.msg_controllen = sizeof(txtimes_[count_].buf);
+        cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(when));
+        std::memcpy(CMSG_DATA(cmsg), &when, sizeof(when));
+    }
+#else
+    (void)departure;
+#endif
+    count_++;
+}
+
+size_t SendBatch::flush(Socket& sock)
+{
+    size_t sent = 0;
+    bool failed = false;
+    if (gso_)
+    {
+        sent = flush_runs(sock, failed);
+    }
+    while (!failed && sent < count_)
+    {
+        int ret = sock.sendmmsg(&msgs_[sent], count_ - sent, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        stats_.calls++;
+        stats_.datagrams += ret;
+        sent += ret;
+    }
+    count_ = 0;
+    return sent;
+}
+
+/**
+ * flush() with GSO: sends msgs_ merged into as few runs as they go in
+ *
+ * @param failed set if sending stopped for any reason but the device not
+ * taking GSO, in which case errno says why
+ *
+ * @return how many datagrams were sent
+ */
+size_t SendBatch::flush_runs(Socket& sock, bool& failed)
+{
+#ifdef UDP_SEGMENT
+    size_t runs = 0;
+    for (size_t i = 0; i < count_; runs++)
+    {
+        size_t n = 1;
+        size_t bytes = datagram_len(i);
+        while (i + n < count_ && n < MAX_GSO_SEGMENTS && same_run(i, i + n) &&
+               bytes + datagram_len(i + n) <= MAX_GSO_BYTES)
+        {
+            bytes += datagram_len(i + n);
+            n++;
+        }
+        msghdr& run = runs_[runs].msg_hdr;
+        run = msgs_[i].msg_hdr;
+        run_lens_[runs] = n;
+        if (n > 1)
+        {
+            // add() gave every datagram two iovecs, the second empty if it
+            // has no payload, so the run's are already side by side
+            uint16_t size = datagram_len(i);
+            run.msg_iovlen = 2 * n;
+            run.msg_control = gso_sizes_[runs].buf;
+            run.msg_controllen = sizeof(gso_sizes_[runs].buf);
+            cmsghdr* cmsg = CMSG_FIRSTHDR(&run);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+            std::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+        }
+        i += n;
+    }
+
+    size_t done = 0;
+    size_t sent = 0;
+    while (done < runs)
+    {
+        int ret = sock.sendmmsg(&runs_[done], runs - done, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            // The device (or its driver) can't segment, or the segments are
+            // bigger than it takes; send the rest one datagram at a time
+            if (run_lens_[done] > 1 && (errno == EIO || errno == EINVAL))
+            {
+                gso_ = false;
+            }
+            else
+            {
+                failed = true;
+            }
+            break;
+        }
+        stats_.calls++;
+        for (size_t j = done; j < done + ret; j++)
+        {
+            sent += run_lens_[j];
+        }
+        done += ret;
+    }
+    stats_.datagrams += sent;
+    return sent;
+#else
+    (void)sock;
+    (void)failed;
+    gso_ = false;
+    return 0;
+#endif
+}
+
+/**
+ * @return how long the i-th queued datagram is
+ */
+size_t SendBatch::datagram_len(size_t i) const
+{
+    return iovs_[2 * i].iov_len + iovs_[2 * i + 1].iov_len;
+}
+
+/**
+ * @return whether the i-th queued datagram can follow the ones from first
+ * on in the same GSO run: every segment but the last must be the same size,
+ * and they must all be going to the same place at no particular time
+ */
+bool SendBatch::same_run(size_t first, size_t i) const
+{
+    const msghdr& a = msgs_[first].msg_hdr;
+    const msghdr& b = msgs_[i].msg_hdr;
+    if (a.msg_controllen != 0 || b.msg_controllen != 0 ||
+            datagram_len(i - 1) != datagram_len(first) ||
+            datagram_len(i) > datagram_len(first))
+    {
+        return false;
+    }
+    return a.msg_namelen == b.msg_namelen &&
+           (a.msg_name == b.msg_name ||
+            std::memcmp(a.msg_name, b.msg_name, a.msg_namelen) == 0);
+}
+
+RecvBatch::RecvBatch(size_t capacity, size_t mss) :
+    slot_size_(Packet::datagram_size(mss)), slots_(capacity * slot_size_),
+    packets_(capacity), addrs_(capacity), iovs_(capacity), msgs_(capacity),
+    gro_(false)
+{
+    datagrams_.reserve(capacity);
+}
+
+bool RecvBatch::enable_gro(Socket& sock)
+{
+#ifdef UDP_GRO
+    int on = 1;
+    gro_ = sock.setsockopt(SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+    if (gro_)
+    {
+        // A coalesced run can be as long as any UDP datagram
+        slot_size_ = UINT16_MAX;
+        slots_.resize(msgs_.size() * slot_size_);
+        gro_sizes_.resize(msgs_.size());
+    }
+#else
+    (void)sock;
+    errno = ENOPROTOOPT;
+#endif
+    return gro_;
+}
+
+int RecvBatch::recv(Socket& sock, int flags)
+{
+    for (size_t i = 0; i < msgs_.size(); i++)
+    {
+        iovs_[i].iov_base = (void*)&slots_[i * slot_size_];
+        iovs_[i].iov_len = slot_size_;
+        msghdr& msg = msgs_[i].msg_hdr;
+        std::memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addrs_[i];
+        msg.msg_namelen = sizeof(addrs_[i]);
+        msg.msg_iov = &iovs_[i];
+        msg.msg_iovlen = 1;
+        if (gro_)
+        {
+            msg.msg_control = gro_sizes_[i].buf;
+            msg.msg_controllen = sizeof(gro_sizes_[i].buf);
+        }
+    }
+    int ret = sock.recvmmsg(msgs_.data(), msgs_.size(), flags);
+    if (ret <= 0)
+    {
+        return ret;
+    }
+    // Split up whatever GRO coalesced; every datagram in a run but the last
+    // is the size the kernel says
+    datagrams_.clear();
+    for (int i = 0; i < ret; i++)
+    {
+        size_t len = msgs_[i].msg_len;
+        size_t size = gro_ ? gro_size(msgs_[i].msg_hdr) : 0;
+        if (size == 0)
+        {
+            size = std::max(len, (size_t)1);
+        }
+        size_t offset = 0;
+        do
+        {
+            datagrams_.push_back({ i * slot_size_ + offset,
+                                   std::min(size, len - offset), (size_t)i });
+            offset += size;
+        } while (offset < len);
+    }
+    if (packets_.size() < datagrams_.size())
+    {
+        packets_.resize(datagrams_.size());
+    }
+    for (size_t i = 0; i < datagrams_.size(); i++)
+    {
+        std::memcpy(&packets_[i], &slots_[datagrams_[i].offset],
+                    std::min(datagrams_[i].len, sizeof(Packet)));
+    }
+    stats_.calls++;
+    stats_.datagrams += datagrams_.size();
+    return datagrams_.size();
+}
+
+/**
+ * @return the segment size of a run msg brought, or 0 if it's just the one
+ * datagram
+ */
+size_t RecvBatch::gro_size(msghdr& msg)
+{
+#ifdef UDP_GRO
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+         cmsg = CMSG_NXTHDR(&msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            int size;
+            std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size > 0 ? size : 0;
+        }
+    }
+#else
+    (void)msg;
+#endif
+    return 0;
+}
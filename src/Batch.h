@@ -0,0 +1,226 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "Packet.h"                     // for Packet, PacketWrapper
+#include "Socket.h"                     // for Socket
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint16_t, uint64_t, etc
+#include <iosfwd>                       // for ostream
+#include <vector>                       // for vector
+
+#include <sys/socket.h>                 // for mmsghdr, sockaddr_storage
+#include <sys/uio.h>                    // for iovec
+
+/**
+ * Counts how many datagrams went through how many system calls, so we can
+ * see what batching saves
+ */
+struct BatchStats
+{
+    BatchStats() : calls(0), datagrams(0) {}
+    uint64_t calls;
+    uint64_t datagrams;
+    // system calls we would have made sending/receiving one at a time, minus
+    // the ones we actually made
+    uint64_t saved() const { return datagrams > calls ? datagrams - calls : 0; }
+    double per_call() const { return calls > 0 ? (double)datagrams / calls : 0; }
+};
+
+std::ostream& operator<<(std::ostream& os, const BatchStats& s);
+
+/**
+ * Queues outgoing datagrams and sends them all with one sendmmsg().
+ *
+ * Each queued packet's header and options are copied (and converted to
+ * network order) into the batch, while its payload is sent straight from
+ * wherever the caller keeps it, so the payload must stay put until flush().
+ */
+class SendBatch
+{
+public:
+    explicit SendBatch(size_t capacity);
+
+    SendBatch(const SendBatch&) = delete;
+    SendBatch& operator=(const SendBatch&) = delete;
+
+    /**
+     * Turns on SO_TXTIME for sock, so datagrams added with a departure
+     * time are held by the kernel's fq qdisc until then rather than sent
+     * right away
+     *
+     * @return false if the kernel doesn't support it
+     */
+    bool enable_txtime(Socket& sock);
+    bool txtime() const { return txtime_; }
+
+    /**
+     * Turns on UDP generic segmentation offload for sock: from then on,
+     * flush() hands each run of consecutive same-sized datagrams to the
+     * same address to the kernel as one buffer, which it splits back into
+     * datagrams as late as it can (on the NIC, if that supports it). Runs
+     * sent with a departure time still go one datagram at a time.
+     *
+     * If the first run the device can't segment fails, GSO turns itself off
+     * again and that flush() and every later one sends datagram by datagram.
+     *
+     * @return false if the kernel doesn't support it
+     */
+    bool enable_gso(Socket& sock);
+    bool gso() const { return gso_; }
+
+    bool empty() const { return count_ == 0; }
+    bool full() const { return count_ == msgs_.size(); }
+    size_t size() const { return count_; }
+
+    /**
+     * Queues p (in host order) with payload_len bytes of payload. addr may be
+     * nullptr on a connected socket. departure is when the datagram should
+     * leave, if txtime() is on; otherwise it leaves on flush().
+     */
+    void add(const Packet& p, const char* payload, size_t payload_len,
+             const sockaddr* addr = nullptr, socklen_t addr_len = 0,
+             PacketWrapper::time_point departure = PacketWrapper::time_point());
+
+    /**
+     * Sends everything queued and empties the batch
+     *
+     * @return how many datagrams were sent; these are always the first ones
+     * queued. If that's fewer than were queued, errno says why.
+     */
+    size_t flush(Socket& sock);
+
+    // Datagrams, however many of them went down in one buffer
+    const BatchStats& stats() const { return stats_; }
+
+    // Most datagrams and bytes the kernel takes in one GSO buffer
+    static const size_t MAX_GSO_SEGMENTS = 64;
+    static const size_t MAX_GSO_BYTES = UINT16_MAX - Packet::IP_UDP_SZ;
+
+private:
+    size_t flush_runs(Socket& sock, bool& failed);
+    size_t datagram_len(size_t i) const;
+    bool same_run(size_t first, size_t i) const;
+
+    // Room for one SCM_TXTIME control message, suitably aligned
+    union TxTime
+    {
+        char buf[CMSG_SPACE(sizeof(uint64_t))];
+        cmsghdr align;
+    };
+    // and one UDP_SEGMENT one
+    union GsoSize
+    {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        cmsghdr align;
+    };
+
+    std::vector<Packet> heads_;
+    std::vector<iovec> iovs_;
+    std::vector<mmsghdr> msgs_;
+    std::vector<TxTime> txtimes_;
+    // With GSO, msgs_ merged into runs, and how many datagrams each holds
+    std::vector<mmsghdr> runs_;
+    std::vector<size_t> run_lens_;
+    std::vector<GsoSize> gso_sizes_;
+    size_t count_;
+    bool txtime_;
+    bool gso_;
+    BatchStats stats_;
+};
+
+/**
+ * Receives up to a batch's worth of datagrams with one recvmmsg().
+ *
+ * Each datagram lands whole in a slot sized for the largest one a segment of
+ * mss bytes makes; its header and options are then copied out into a
+ * Packet, and its payload stays in the slot.
+ *
+ * With enable_gro(), a slot may instead hold a run of datagrams the kernel
+ * coalesced; recv() splits these back up, so callers still see one
+ * datagram at a time.
+ */
+class RecvBatch
+{
+public:
+    /**
+     * @param mss the longest payload to make room for; 0 for a side that
+     * only ever receives acks
+     */
+    explicit RecvBatch(size_t capacity, size_t mss = 0);
+
+    RecvBatch(const RecvBatch&) = delete;
+    RecvBatch& operator=(const RecvBatch&) = delete;
+
+    /**
+     * @param flags passed to recvmmsg(), e.g. MSG_DONTWAIT or MSG_WAITFORONE
+     *
+     * @return how many datagrams were received, or -1 with errno set
+     */
+    int recv(Socket& sock, int flags);
+
+    /**
+     * Turns on UDP generic receive offload for sock, so the kernel may hand
+     * over a run of datagrams from one sender in one slot, and makes every
+     * slot big enough for the largest such run
+     *
+     * @return false if the kernel doesn't support it
+     */
+    bool enable_gro(Socket& sock);
+    bool gro() const { return gro_; }
+
+    // Most messages one recv() takes; with GRO, these can hold more
+    // datagrams than this between them
+    size_t capacity() const { return msgs_.size(); }
+
+    // The i-th datagram from the last recv(), exactly as it came off the wire
+    Packet& packet(size_t i) { return packets_[i]; }
+    size_t length(size_t i) const { return datagrams_[i].len; }
+    // its payload, once packet(i) is known to be valid()
+    const char* payload(size_t i) const
+    {
+        return &slots_[datagrams_[i].offset] + Packet::HEADER_SZ +
+               packets_[i].headers.opt_len;
+    }
+    const sockaddr_storage& addr(size_t i) const
+    {
+        return addrs_[datagrams_[i].msg];
+    }
+    socklen_t addr_len(size_t i) const
+    {
+        return msgs_[datagrams_[i].msg].msg_hdr.msg_namelen;
+    }
+
+    // Datagrams, however many of them came up in one slot
+    const BatchStats& stats() const { return stats_; }
+
+private:
+    static size_t gro_size(msghdr& msg);
+
+    // Where in slots_ one datagram is, and which message brought it
+    struct Datagram
+    {
+        size_t offset;
+        size_t len;
+        size_t msg;
+    };
+    // Room for one UDP_GRO control message, suitably aligned
+    union GroSize
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        cmsghdr align;
+    };
+
+    size_t slot_size_;
+    std::vector<char> slots_;
+    std::vector<Datagram> datagrams_;
+    std::vector<Packet> packets_;
+    std::vector<sockaddr_storage> addrs_;
+    std::vector<iovec> iovs_;
+    std::vector<mmsghdr> msgs_;
+    std::vector<GroSize> gro_sizes_;
+    bool gro_;
+    BatchStats stats_;
+};
+
+#endif
@@ -0,0 +1,289 @@
+#include "Checksum.h"
+
+#include <cstring>                      // for memcpy
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>                  // for _mm_crc32_u64, _mm_crc32_u8
+#endif
+
+/*
+ * Static Variables
+ */
+// The byte-at-a-time tables for the fallback: table[k][b] is the CRC
+// register after b followed by k zero bytes
+struct Crc32cTables
+{
+    Crc32cTables();
+    uint32_t table[8][256];
+};
+
+// CRC32C's polynomial, bit-reversed as the crc32 instruction uses it
+static const uint32_t POLY = 0x82f63b78;
+#if defined(__x86_64__)
+// The crc32 instruction takes 3 cycles but can start one every cycle, so
+// crc32c_hw() runs three lanes of this many bytes side by side
+static const size_t LANE = 256;
+#endif
+
+/*
+ * Function Declarations
+ */
+static uint32_t crc32c_sw(uint32_t crc, const char* p, size_t len);
+#if defined(__x86_64__)
+static uint32_t crc32c_hw(uint32_t crc, const char* p, size_t len);
+#endif
+static uint32_t (*pick_crc32c())(uint32_t, const char*, size_t);
+static uint32_t gf2_times(const uint32_t* mat, uint32_t vec);
+static void gf2_shift_matrix(uint32_t* mat, uint64_t len);
+
+/*
+ * Implementations
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len)
+{
+    // Decided once, the first time through
+    static uint32_t (*const impl)(uint32_t, const char*, size_t) = pick_crc32c();
+    return ~impl(~crc, (const char*)data, len);
+}
+
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b)
+{
+    uint32_t mat[32];
+    gf2_shift_matrix(mat, len_b);
+    return gf2_times(mat, crc_a) ^ crc_b;
+}
+
+Crc32cCombiner::Crc32cCombiner(uint64_t len_b)
+{
+    uint32_t mat[32];
+    gf2_shift_matrix(mat, len_b);
+    for (int k = 0; k < 4; k++)
+    {
+        for (uint32_t b = 0; b < 256; b++)
+        {
+            table_[k][b] = gf2_times(mat, b << (8 * k));
+        }
+    }
+}
+
+FileDigest::FileDigest(uint32_t next_seq, size_t mss, size_t window) :
+    mss_(mss), combine_(mss), head_(0), next_seq_(next_seq), value_(0)
+{
+    size_t slots = 1;
+    while (slots * mss < window + mss)
+    {
+        slots <<= 1;
+    }
+    slots_.resize(slots);
+    mask_ = slots - 1;
+}
+
+void FileDigest::add(uint32_t seq, uint32_t crc, size_t len)
+{
+    uint32_t offset = seq - next_seq_;
+    size_t distance = offset / mss_;
+    if (offset % mss_ != 0 || distance > mask_ || len == 0 || len > mss_)
+    {
+        return;
+    }
+    Slot& slot = slots_[(head_ + distance) & mask_];
+    slot.crc = crc;
+    slot.len = len;
+}
+
+void FileDigest::advance(uint32_t next_seq)
+{
+    while (next_seq_ != next_seq)
+    {
+        Slot& slot = slots_[head_];
+        if (slot.len == 0)
+        {
+            return;
+        }
+        value_ = slot.len == mss_ ? combine_(value_, slot.crc)
+                                  : crc32c_combine(value_, slot.crc, slot.len);
+        next_seq_ += slot.len;
+        slot.len = 0;
+        head_ = (head_ + 1) & mask_;
+    }
+}
+
+Crc32cTables::Crc32cTables()
+{
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        uint32_t crc = b;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[0][b] = crc;
+    }
+    for (uint32_t b = 0; b < 256; b++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            uint32_t prev = table[k - 1][b];
+            table[k][b] = (prev >> 8) ^ table[0][prev & 0xff];
+        }
+    }
+}
+
+/**
+ * Slicing-by-8: eight bytes per step through eight tables
+ */
+static uint32_t crc32c_sw(uint32_t crc, const char* p, size_t len)
+{
+    // Built on first use, so a checksum taken during static initialization
+    // elsewhere still gets them
+    static const Crc32cTables tables;
+    const unsigned char* s = (const unsigned char*)p;
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        std::memcpy(&lo, s, sizeof(lo));
+        std::memcpy(&hi, s + 4, sizeof(hi));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        lo = __builtin_bswap32(lo);
+        hi = __builtin_bswap32(hi);
+#endif
+        lo ^= crc;
+        crc = tables.table[7][lo & 0xff] ^ tables.table[6][(lo >> 8) & 0xff] ^
+              tables.table[5][(lo >> 16) & 0xff] ^ tables.table[4][lo >> 24] ^
+              tables.table[3][hi & 0xff] ^ tables.table[2][(hi >> 8) & 0xff] ^
+              tables.table[1][(hi >> 16) & 0xff] ^ tables.table[0][hi >> 24];
+        s += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+    {
+        crc = (crc >> 8) ^ tables.table[0][(crc ^ *s++) & 0xff];
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+/**
+ * The SSE4.2 crc32 instruction, eight bytes at a time
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const char* p, size_t len)
+{
+    static const Crc32cCombiner shift_lane(LANE);
+    static const Crc32cCombiner shift_two_lanes(2 * LANE);
+    uint64_t crc64 = crc;
+    // Each lane's CRC starts from zero, except the first's, which carries
+    // on from what came before; shifting it and the second's past the
+    // lanes that follow them and XORing gives the CRC of all three
+    while (len >= 3 * LANE)
+    {
+        uint64_t a = crc64, b = 0, c = 0;
+        for (size_t i = 0; i < LANE; i += 8)
+        {
+            uint64_t words[3];
+            std::memcpy(&words[0], p + i, sizeof(uint64_t));
+            std::memcpy(&words[1], p + LANE + i, sizeof(uint64_t));
+            std::memcpy(&words[2], p + 2 * LANE + i, sizeof(uint64_t));
+            a = _mm_crc32_u64(a, words[0]);
+            b = _mm_crc32_u64(b, words[1]);
+            c = _mm_crc32_u64(c, words[2]);
+        }
+        crc64 = shift_two_lanes.shift(a) ^ shift_lane.shift(b) ^ c;
+        p += 3 * LANE;
+        len -= 3 * LANE;
+    }
+    while (len >= 8)
+    {
+        uint64_t word;
+        std::memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += 8;
+        len -= 8;
+    }
+    crc = crc64;
+    while (len-- > 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+/**
+ * @return the fastest implementation this CPU runs
+ */
+static uint32_t (*pick_crc32c())(uint32_t, const char*, size_t)
+{
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        return crc32c_hw;
+    }
+#endif
+    return crc32c_sw;
+}
+
+/**
+ * Multiplies the 32x32 bit matrix mat (one column per element) by vec
+ */
+static uint32_t gf2_times(const uint32_t* mat, uint32_t vec)
+{
+    uint32_t sum = 0;
+    for (; vec != 0; vec >>= 1, mat++)
+    {
+        if (vec & 1)
+        {
+            sum ^= *mat;
+        }
+    }
+    return sum;
+}
+
+/**
+ * Fills mat with the operator that runs a CRC register past len zero bytes,
+ * by squaring the one for a single zero bit, as zlib's crc32_combine() does
+ */
+static void gf2_shift_matrix(uint32_t* mat, uint64_t len)
+{
+    // power starts as one zero bit and is squared up to each bit of len
+    // bytes; mat gathers the powers len is made of
+    uint32_t power[32], square[32];
+    power[0] = POLY;
+    for (int n = 1; n < 32; n++)
+    {
+        power[n] = 1u << (n - 1);
+    }
+    for (int n = 0; n < 32; n++)
+    {
+        mat[n] = 1u << n;
+    }
+    // Three squarings make it one zero byte
+    for (int i = 0; i < 3; i++)
+    {
+        for (int n = 0; n < 32; n++)
+        {
+            square[n] = gf2_times(power, power[n]);
+        }
+        std::memcpy(power, square, sizeof(power));
+    }
+    while (len != 0)
+    {
+        if (len & 1)
+        {
+            for (int n = 0; n < 32; n++)
+            {
+                square[n] = gf2_times(power, mat[n]);
+            }
+            std::memcpy(mat, square, sizeof(square));
+        }
+        len >>= 1;
+        if (len != 0)
+        {
+            for (int n = 0; n < 32; n++)
+            {
+                square[n] = gf2_times(power, power[n]);
+            }
+            std::memcpy(power, square, sizeof(power));
+        }
+    }
+}
@@ -0,0 +1,102 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t
+#include <vector>                       // for vector
+
+/**
+ * CRC32C (the Castagnoli polynomial, as in iSCSI and ext4) of len bytes,
+ * continuing from crc, the CRC of whatever came before (0 for nothing).
+ * Uses the SSE4.2 crc32 instruction when the CPU has it, and a table
+ * otherwise.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t len);
+
+/**
+ * The CRC32C of A followed by B, from crc_a, the CRC of A, and crc_b, the
+ * CRC of B, which is len_b bytes long
+ */
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, uint64_t len_b);
+
+/**
+ * crc32c_combine() for a B that is always the same length, with most of the
+ * work done once: each combine is then four table lookups
+ */
+class Crc32cCombiner
+{
+public:
+    explicit Crc32cCombiner(uint64_t len_b);
+
+    uint32_t operator()(uint32_t crc_a, uint32_t crc_b) const
+    {
+        return shift(crc_a) ^ crc_b;
+    }
+
+    /**
+     * What a CRC register holding crc holds after len_b zero bytes
+     */
+    uint32_t shift(uint32_t crc) const
+    {
+        return table_[0][crc & 0xff] ^ table_[1][(crc >> 8) & 0xff] ^
+               table_[2][(crc >> 16) & 0xff] ^ table_[3][crc >> 24];
+    }
+
+private:
+    // Running a CRC past len_b zero bytes is linear, so it is the XOR of
+    // what it does to each byte of the CRC: table_[k][b] for b in byte k
+    uint32_t table_[4][256];
+};
+
+/**
+ * The CRC32C of a file received in segments in any order, from the CRCs
+ * of the segments. Each one's CRC is held until the ones before it have
+ * arrived, then combined into the digest.
+ *
+ * Like ReorderBuffer, it relies on every segment but the last being mss
+ * bytes, so a segment's slot is its distance from next_seq() in segments.
+ */
+class FileDigest
+{
+public:
+    /**
+     * @param next_seq the sequence number of the first byte of the file
+     * @param mss the size of every segment but the last
+     * @param window how far past next_seq a segment may start
+     */
+    FileDigest(uint32_t next_seq, size_t mss, size_t window);
+
+    /**
+     * Records the CRC of a segment we have, in or out of order; ones that
+     * are already in the digest or out of the window are ignored
+     */
+    void add(uint32_t seq, uint32_t crc, size_t len);
+
+    /**
+     * Combines every segment before next_seq into the digest, in order;
+     * all of them must have been add()ed
+     */
+    void advance(uint32_t next_seq);
+
+    // the first byte not in the digest yet
+    uint32_t next_seq() const { return next_seq_; }
+    // the CRC32C of everything up to next_seq()
+    uint32_t value() const { return value_; }
+
+private:
+    struct Slot
+    {
+        uint32_t crc;
+        uint32_t len;       // 0 if we don't have it yet
+    };
+
+    size_t mss_;
+    Crc32cCombiner combine_;
+    std::vector<Slot> slots_;
+    size_t mask_;
+    size_t head_;           // the slot of next_seq_
+    uint32_t next_seq_;
+    uint32_t value_;
+};
+
+#endif
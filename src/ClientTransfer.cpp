@@ -0,0 +1,865 @@
+#include "ClientTransfer.h"
+
+#include "Batch.h"                      // for RecvBatch, SendBatch
+#include "Checksum.h"                   // for FileDigest, crc32c
+#include "Fec.h"                        // for FecDecoder
+#include "FileWriter.h"                 // for OrderedWriter, PositionalWriter
+#include "Metrics.h"                    // for Counter, Gauge, Histogram
+#include "Packet.h"
+#include "Resume.h"                     // for ResumeRecord
+#include "Trace.h"                      // for Trace, TRACE_SEND_ACK
+
+#include <algorithm>                    // for max, min
+#include <cerrno>                       // for errno
+#include <cstring>                      // for memcpy, strerror
+#include <iostream>                     // for cerr
+#include <memory>                       // for unique_ptr
+#include <stdexcept>                    // for runtime_error
+
+#include <endian.h>                     // for be64toh, htobe32, htobe64
+#include <sys/socket.h>                 // for SOL_SOCKET, SO_RCVTIMEO
+#include <sys/time.h>                   // for timeval
+
+/*
+ * Static Variables
+ */
+// how long to wait after sending FIN-ACK for final ACK
+static timeval close_timeout = { .tv_sec = 1, .tv_usec = 0 };
+// most datagrams received or acked per system call
+static const size_t BATCH_SZ = 64;
+
+// What the transfer did, for Metrics snapshots
+static struct
+{
+    Counter segments_received{"segments_received"};
+    Counter bytes_received{"bytes_received"};
+    // segments we had already, or that fell outside the window
+    Counter duplicate_segments{"duplicate_segments"};
+    Counter out_of_order_segments{"out_of_order_segments"};
+    Counter acks_sent{"acks_sent"};
+    Counter delayed_acks{"delayed_acks"};
+    // acks resent because nothing came for an RTO
+    Counter ack_timeouts{"ack_timeouts"};
+    Counter parity_received{"parity_received"};
+    // segments rebuilt from parity rather than waited for
+    Counter fec_repairs{"fec_repairs"};
+    // segments whose payload didn't match their checksum, dropped as lost
+    Counter corrupt_segments{"corrupt_segments"};
+    // segments held past the cumulative ack
+    Gauge reorder_held{"reorder_held"};
+    Histogram rtt{"rtt", "us"};
+    Histogram goodput{"goodput", "bytes/s"};
+} metrics;
+
+/*
+ * Implementations
+ */
+Client::Client(Socket& sock, const ClientOptions& options, unsigned stream) :
+    sock_(sock), options_(options), window_(options.window), wscale_(0),
+    conn_id_(0), sack_ok_(false), ts_ok_(false), mss_ok_(false),
+    mss_(Packet::MIN_MSS), fec_ok_(false), checksum_ok_(false),
+    compress_ok_(false), resume_ok_(false), fingerprint_(0), part_{0, 0},
+    resume_at_(0), ticket_ok_(false), ticket_(0), fast_ok_(false), written_(0),
+    stream_(stream), streams_(1), ack_(0), seq_(0),
+    file_size_(FileWriter::UNKNOWN_SIZE)
+{
+}
+
+// ack and seq are passed between the two steps so each knows where the
+// previous one left off
+bool Client::connect()
+{
+    return establish_connection(ack_, seq_, file_size_);
+}
+
+bool Client::receive()
+{
+    return receive_file(ack_, seq_, file_size_);
+}
+
+/**
+ * @param ref ack_out is set to the acknowledgment number after handshake
+ * @param ref seq_out is set to the sequence number after handshake
+ * @param ref file_size_out is set to the size of the file the server is
+ * sending, or FileWriter::UNKNOWN_SIZE if it didn't say
+ *
+ * @return true on success, false otherwise
+ */
+bool Client::establish_connection(uint32_t& ack_out, uint32_t& seq_out,
+                                  uint64_t& file_size_out)
+{
+    Packet out;
+    Packet in;
+    out.headers.syn = true;
+    conn_id_ = out.headers.conn_id = get_conn_id();
+    // Generate the initial sequence number randomly
+    out.headers.seq_number = get_isn();
+    // The window in a SYN is never scaled; the option tells the server how to
+    // scale the ones in our acks
+    out.headers.window_sz = std::min(window_, (uint32_t)UINT16_MAX);
+    uint8_t our_wscale = window_shift(window_);
+    // No segment can be larger than our window
+    size_t our_mss = std::min(std::min(options_.mss, (size_t)window_),
+                              (size_t)Packet::MAX_MSS);
+    our_mss = std::max(our_mss, (size_t)Packet::MIN_MSS);
+    // What we knew of the path last time beats the default while waiting
+    // for the first SYN-ACK
+    rtt_.seed(options_.srtt);
+    // Karn's rule: only time the handshake if we sent one SYN
+    int syns = 0;
+    auto syn_time = now();
+    while (true)
+    {
+        // Rebuild the options every time so the timestamp is fresh
+        out.headers.opt_len = 0;
+        out.add_option(Packet::OPT_WSCALE, &our_wscale, 1);
+        out.add_option(Packet::OPT_SACK_PERMITTED, nullptr, 0);
+        out.add_timestamp(timestamp(), 0);
+        if (!options_.congestion.empty())
+        {
+            out.add_option(Packet::OPT_CONGESTION, options_.congestion.data(),
+                           std::min(options_.congestion.size(), (size_t)UINT8_MAX));
+        }
+        if (options_.streams > 1)
+        {
+            uint8_t streams[2] = { (uint8_t)stream_, (uint8_t)options_.streams };
+            out.add_option(Packet::OPT_STREAMS, streams, sizeof(streams));
+        }
+        if (our_mss > Packet::MIN_MSS)
+        {
+            out.add_mss(our_mss);
+        }
+        if (options_.fec > 0)
+        {
+            uint8_t fec[2] = { (uint8_t)options_.fec,
+                               (uint8_t)FecDecoder::MAX_BLOCK };
+            out.add_option(Packet::OPT_FEC, fec, sizeof(fec));
+        }
+        out.add_option(Packet::OPT_CHECKSUM, nullptr, 0);
+        if (options_.compress)
+        {
+            uint8_t method = Packet::COMPRESS_DEFLATE;
+            out.add_option(Packet::OPT_COMPRESS, &method, sizeof(method));
+        }
+        if (options_.resume)
+        {
+            out.add_option(Packet::OPT_RESUME, nullptr, 0);
+        }
+        else if (options_.fast_open)
+        {
+            uint32_t ticket = htonl(options_.ticket);
+            out.add_option(Packet::OPT_TICKET, &ticket,
+                           options_.have_ticket ? sizeof(ticket) : 0);
+        }
+        // Set the timeout appropriately
+        timeval timeout = to_timeval(rtt_.rto());
+        sock_.setsockopt(SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        syns++;
+        syn_time = now();
+        out.to_network();
+        // Send the initial SYN packet
+        if (sock_.send((void*)&out, out.size(false), 0) < 0)
+        {
+            std::cerr << "send(): " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        out.to_host();
+        // Try to receive a response. Probes are padded past the end of a
+        // Packet; MSG_TRUNC drops the padding and still says how long they
+        // were.
+        int ret = sock_.recv((void*)&in, sizeof(in), MSG_TRUNC);
+        if (ret >= 0 && !in.valid(ret))
+        {
+            continue;
+        }
+        in.to_host();
+        if (ret < 0)
+        {
+            // recv returns EAGAIN if we timed out
+            if (errno == EAGAIN)
+            {
+                rtt_.backoff();
+                continue;
+            }
+            // ICMP message meaning server doesn't exist -- but not guaranteed
+            // we can't count on ICMP being right, so we just try again
+            else if (errno == ECONNREFUSED)
+            {
+                continue;
+            }
+            // Some other error
+            std::cerr << "recvfrom(): " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        // We expect a SYN-ACK back, where the ack number is our seq + 1
+        if (!in.headers.syn || !in.headers.ack || in.headers.conn_id != conn_id_ ||
+                in.headers.ack_number != add_seq(out.headers.seq_number, 1))
+        {
+            continue;
+        }
+        break;
+    }
+    // Scaling is only on if the server also sent the option
+    if (in.find_option(Packet::OPT_WSCALE, 1))
+    {
+        wscale_ = our_wscale;
+    }
+    else
+    {
+        window_ = std::min(window_, (uint32_t)UINT16_MAX);
+    }
+    sack_ok_ = in.find_option(Packet::OPT_SACK_PERMITTED, 0) != nullptr;
+    uint32_t ts_recent = 0, tsecr = 0;
+    ts_ok_ = in.get_timestamp(ts_recent, tsecr);
+    if (ts_ok_ && tsecr != 0)
+    {
+        rtt_.sample(since_timestamp(tsecr), now());
+    }
+    else if (syns == 1)
+    {
+        auto t = now();
+        rtt_.sample(std::chrono::duration_cast<RttEstimator::duration>(
+                t - syn_time), t);
+    }
+    file_size_out = FileWriter::UNKNOWN_SIZE;
+    if (const uint8_t* opt = in.find_option(Packet::OPT_FILE_SIZE, sizeof(uint64_t)))
+    {
+        uint64_t file_size;
+        std::memcpy(&file_size, opt, sizeof(file_size));
+        file_size_out = be64toh(file_size);
+    }
+    // The server echoes our index and says how many streams it agreed to;
+    // an older one won't, and just sends the whole file
+    streams_ = 1;
+    if (const uint8_t* opt = in.find_option(Packet::OPT_STREAMS, 2))
+    {
+        streams_ = opt[0] == stream_ ? opt[1] : 0;
+    }
+    if (streams_ == 0 || (streams_ > 1 && file_size_out == FileWriter::UNKNOWN_SIZE) ||
+            (stream_ > 0 && streams_ != options_.streams))
+    {
+        std::cerr << "The server refused stream " << stream_ + 1 << std::endl;
+        return false;
+    }
+    // A server that probes sends its largest probe first, so this is the
+    // largest one the path carried, unless it reordered them
+    uint16_t mss = in.get_mss();
+    mss_ok_ = mss != 0;
+    fec_ok_ = options_.fec > 0 && in.find_option(Packet::OPT_FEC, 2) != nullptr;
+    checksum_ok_ = in.find_option(Packet::OPT_CHECKSUM, 0) != nullptr;
+    const uint8_t* method = in.find_option(Packet::OPT_COMPRESS, 1);
+    compress_ok_ = method != nullptr && *method == Packet::COMPRESS_DEFLATE;
+    mss_ = std::min(std::max((size_t)mss, (size_t)Packet::MIN_MSS), our_mss);
+    if (options_.resume && !start_resume(in, file_size_out))
+    {
+        return false;
+    }
+    // The server echoes our ticket if it is sending the file already, and
+    // gives us a new one if ours is no good
+    if (const uint8_t* opt = in.find_option(Packet::OPT_TICKET, sizeof(uint32_t)))
+    {
+        std::memcpy(&ticket_, opt, sizeof(ticket_));
+        ticket_ = ntohl(ticket_);
+        ticket_ok_ = true;
+        fast_ok_ = options_.have_ticket && ticket_ == options_.ticket;
+    }
+    if (fast_ok_)
+    {
+        std::cerr << "Fast open: the file follows the SYN-ACK" << std::endl;
+    }
+    seq_out = add_seq(in.headers.ack_number, 1);
+    // The server's sequence numbers count from the start of our part even
+    // when we resume, so what we have is acked from the start
+    ack_out = add_seq(in.headers.seq_number, 1 + (uint32_t)(resume_at_ - part_.start));
+    // Opened fast, our acks of the data are all the server needs
+    if (!fast_ok_)
+    {
+        send_handshake_ack(in);
+    }
+    return true;
+}
+
+/**
+ * Looks up how far we got with our part of the file last time, if the
+ * server can resume and syn_ack says it has the same file; send_handshake_ack()
+ * then tells it where to start
+ *
+ * @return false if the record can't be used at all
+ */
+bool Client::start_resume(const Packet& syn_ack, uint64_t file_size)
+{
+    const uint8_t* opt = syn_ack.find_option(Packet::OPT_RESUME, sizeof(uint32_t));
+    if (opt == nullptr || file_size == FileWriter::UNKNOWN_SIZE)
+    {
+        std::cerr << "The server can't resume; starting over" << std::endl;
+        return true;
+    }
+    std::memcpy(&fingerprint_, opt, sizeof(fingerprint_));
+    fingerprint_ = ntohl(fingerprint_);
+    part_ = streams_ > 1 ? stream_range(file_size, stream_, streams_)
+                         : ByteRange{0, file_size};
+    try
+    {
+        record_.reset(new ResumeRecord(options_.output, stream_));
+        resume_at_ = record_->start(file_size, fingerprint_, streams_, part_);
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    // Acks from that far in look just like the handshake's to the server,
+    // which then wouldn't know to skip anything; a block less will do
+    if (resume_at_ > part_.start && (uint32_t)(resume_at_ - part_.start) == 0)
+    {
+        resume_at_ -= Packet::MIN_MSS;
+    }
+    if (resume_at_ > part_.start)
+    {
+        std::cerr << "Resuming";
+        if (streams_ > 1)
+        {
+            std::cerr << " stream " << stream_ + 1;
+        }
+        std::cerr << " at byte " << resume_at_ << std::endl;
+    }
+    resume_ok_ = true;
+    return true;
+}
+
+/**
+ * Sends the last part of the handshake, answering syn_ack (in host order):
+ * it also tells a server that probed which segment size we settled on
+ */
+void Client::send_handshake_ack(const Packet& syn_ack)
+{
+    Packet out;
+    out.headers.ack = true;
+    out.headers.conn_id = conn_id_;
+    out.headers.seq_number = syn_ack.headers.ack_number;
+    out.headers.ack_number = add_seq(syn_ack.headers.seq_number, 1);
+    out.headers.window_sz = advertised_window();
+    uint32_t tsval = 0, tsecr = 0;
+    if (ts_ok_ && syn_ack.get_timestamp(tsval, tsecr))
+    {
+        out.add_timestamp(timestamp(), tsval);
+    }
+    if (mss_ok_)
+    {
+        out.add_mss(mss_);
+    }
+    if (resume_ok_)
+    {
+        uint8_t value[12];
+        uint32_t fingerprint = htonl(fingerprint_);
+        uint64_t offset = htobe64(resume_at_);
+        std::memcpy(value, &fingerprint, sizeof(fingerprint));
+        std::memcpy(value + sizeof(fingerprint), &offset, sizeof(offset));
+        out.add_option(Packet::OPT_RESUME, value, sizeof(value));
+    }
+    out.to_network();
+    sock_.send((void*)&out, out.size(false), 0);
+}
+
+/**
+ * @param ack the client's current acknowledgment number
+ * @param seq the client's current sequence number
+ * @param file_size the file's size from the handshake, or
+ * FileWriter::UNKNOWN_SIZE
+ *
+ * @return true on success, false otherwise
+ */
+bool Client::receive_file(uint32_t ack, uint32_t seq, uint64_t file_size)
+{
+    // I switch to std::chrono times here rather than timeval because it's
+    // friendlier for doing comparisons and math
+    auto send_time = now(); // now() is a function returning the current time
+    timeval cur_timeout = { .tv_sec = 0, .tv_usec = 0 };
+    // Either writes the file in order, holding out of order packets in a
+    // buffer allocated up front for our whole advertised window, or (with -p)
+    // writes every packet straight to its place in the file. A compressed
+    // stream has to be inflated in order, so it always goes through the
+    // buffer (and -p doesn't widen its window). Resuming writes what is
+    // left of our part in place.
+    std::unique_ptr<FileWriter> outfile;
+    DecompressingWriter* inflater = nullptr;
+    try
+    {
+        ByteRange part = { 0, file_size };
+        if (streams_ > 1)
+        {
+            part = stream_range(file_size, stream_, streams_);
+        }
+        else if (compress_ok_ || resume_ok_)
+        {
+            PositionalWriter::allocate(options_.output.c_str(), file_size,
+                                       resume_ok_);
+        }
+        if (resume_ok_)
+        {
+            part.start = resume_at_;
+        }
+        if (compress_ok_)
+        {
+            inflater = new DecompressingWriter(options_.output.c_str(), ack,
+                                               window_, mss_, part);
+            outfile.reset(inflater);
+        }
+        else if (streams_ > 1 || resume_ok_)
+        {
+            outfile.reset(new PositionalWriter(options_.output.c_str(), ack,
+                                               window_, mss_, part));
+        }
+        else if (options_.positional)
+        {
+            outfile.reset(new PositionalWriter(options_.output.c_str(), ack,
+                                               window_, mss_, file_size));
+        }
+        else
+        {
+            outfile.reset(new OrderedWriter(options_.output.c_str(), ack, window_,
+                                            mss_));
+        }
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << e.what() << std::endl;
+        return false;
+    }
+    // Data comes in and acks go out a batch at a time
+    RecvBatch batch_in(BATCH_SZ, mss_);
+    SendBatch batch_out(BATCH_SZ);
+    if (options_.gro && !batch_in.enable_gro(sock_))
+    {
+        std::cerr << "UDP_GRO: " << std::strerror(errno)
+                  << "; receiving one datagram at a time" << std::endl;
+    }
+    Packet out;
+    out.headers.conn_id = conn_id_;
+    bool retransmit = false;
+    SackBlock blocks[Packet::MAX_SACK_BLOCKS];
+    // the last timestamp of ours the server echoed
+    uint32_t last_tsecr = 0;
+    // In-order segments we haven't acked yet, the timestamp to echo for them
+    // (the oldest's, so the delay counts towards the server's RTT and not
+    // against its RTO) and when the delayed ack for them is due
+    unsigned unacked = 0;
+    uint32_t unacked_tsval = 0;
+    auto ack_due = now();
+    // the last ack reported SACK blocks, so there are holes left to fill
+    bool holes = false;
+    uint64_t data_packets = 0;
+    uint64_t acks_sent = 0;
+    auto start_time = now();
+    // Rebuilds lost segments from the server's parity, if it sends any
+    std::unique_ptr<FecDecoder> fec;
+    if (fec_ok_)
+    {
+        fec.reset(new FecDecoder(ack, mss_));
+    }
+    uint64_t repairs = 0;
+    // The CRC32C of everything written so far, for checking against the one
+    // the server's FIN carries; a compressed stream's is the inflater's
+    std::unique_ptr<FileDigest> digest;
+    if (checksum_ok_ && !inflater)
+    {
+        digest.reset(new FileDigest(ack, mss_, window_));
+    }
+    uint64_t corrupt = 0;
+    uint64_t stream_bytes = 0;
+    // False if a segment doesn't match the checksum it came with, in which
+    // case it's dropped as if it had been lost; crc gets its payload's
+    // CRC32C
+    auto verify = [&](const Packet& in, const char* payload, uint32_t& crc)
+    {
+        if (!checksum_ok_)
+        {
+            return true;
+        }
+        crc = crc32c(0, payload, in.headers.data_len);
+        if (in.check_segment(crc))
+        {
+            return true;
+        }
+        metrics.corrupt_segments.add();
+        corrupt++;
+        return false;
+    };
+    // Queues an acknowledgment for everything we have received so far.
+    // recent is the packet that prompted it, which leads the SACK blocks, and
+    // tsval is its timestamp to echo (0 for none)
+    auto queue_ack = [&](uint32_t recent, uint32_t tsval)
+    {
+        out.headers.ack = true;
+        out.headers.ack_number = ack;
+        out.headers.window_sz = advertised_window();
+        out.headers.opt_len = 0;
+        if (ts_ok_)
+        {
+            out.add_timestamp(timestamp(), tsval);
+        }
+        size_t n = outfile->held_ranges(recent, blocks, Packet::MAX_SACK_BLOCKS);
+        holes = n > 0;
+        if (sack_ok_)
+        {
+            out.add_sack(blocks, n);
+        }
+        // Tell the server how many segments parity saved it resending, if
+        // the SACK blocks left room
+        if (fec && repairs > 0)
+        {
+            uint32_t count = htobe32(repairs);
+            out.add_option(Packet::OPT_FEC, &count, sizeof(count));
+        }
+        // This covers everything waiting for a delayed ack
+        unacked = 0;
+        acks_sent++;
+        metrics.acks_sent.add();
+        Trace::record(TRACE_SEND_ACK, retransmit ? TRACE_RETRANSMIT : 0, conn_id_,
+                      ack);
+        if (batch_out.full())
+        {
+            batch_out.flush(sock_);
+        }
+        batch_out.add(out, nullptr, 0);
+    };
+    // Hands a data segment to the writer and acks it as it calls for; tsval
+    // is its timestamp to echo (0 for none). False if the file couldn't be
+    // written.
+    auto take_segment = [&](uint32_t seq, const char* data, size_t len,
+                            uint32_t crc, uint32_t tsval)
+    {
+        // Anything but the packet we expected gets a duplicate ack. The
+        // writer drops duplicates and packets from outside our window
+        bool in_order = seq == ack;
+        if (!in_order)
+        {
+            metrics.out_of_order_segments.add();
+        }
+        if (digest)
+        {
+            digest->add(seq, crc, len);
+        }
+        try
+        {
+            if (!outfile->write(seq, data, len))
+            {
+                metrics.duplicate_segments.add();
+            }
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+        // What this let us write out, in order; a compressed stream's bytes
+        // only count once they are inflated into the file
+        uint32_t advanced = outfile->next_seq() - ack;
+        stream_bytes += advanced;
+        written_ = inflater ? inflater->raw_bytes() : written_ + advanced;
+        ack = outfile->next_seq();
+        if (record_)
+        {
+            record_->advance(resume_at_ + written_);
+        }
+        if (digest)
+        {
+            digest->advance(ack);
+        }
+        metrics.reorder_held.set(outfile->held());
+        // Ack at once if this showed or filled a hole, or while one is left,
+        // so the server can recover quickly (as TCP does); the SACK blocks
+        // lead with this packet, so each gets its own ack
+        bool filled = ack != add_seq(seq, len);
+        if (!in_order || filled || holes)
+        {
+            retransmit = !in_order;
+            queue_ack(seq, tsval);
+            return true;
+        }
+        if (unacked++ == 0)
+        {
+            unacked_tsval = tsval;
+            ack_due = now() + options_.ack_delay;
+        }
+        return true;
+    };
+    while (true)
+    {
+        if (!batch_out.empty())
+        {
+            // Send the acknowledgments for the last batch of packets, all in
+            // one go
+            send_time = now();
+            batch_out.flush(sock_);
+        }
+        // The timeout is RTO - (current time - send time)
+        // i.e., RTO - (time already elapsed since we sent the packet)
+        // using std::chrono allows us to do subtraction like this, then we
+        // store the result back in a timeval for setsockopt to use. A zero
+        // timeval would mean no timeout at all, so wait at least 1us. A
+        // delayed ack may be due sooner.
+        auto wait_until = send_time + rtt_.rto();
+        if (unacked > 0)
+        {
+            wait_until = std::min(wait_until, ack_due);
+        }
+        cur_timeout = to_timeval(std::max(
+                std::chrono::duration_cast<RttEstimator::duration>(
+                    wait_until - now()),
+                RttEstimator::duration(1)));
+        sock_.setsockopt(SOL_SOCKET, SO_RCVTIMEO, &cur_timeout, sizeof(cur_timeout));
+        // Wait for at least one packet, then take every other one that's
+        // already queued too
+        int n = batch_in.recv(sock_, MSG_WAITFORONE);
+        if (n < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                if (unacked > 0 && now() >= ack_due)
+                {
+                    // The delayed ack timer went off
+                    metrics.delayed_acks.add();
+                    retransmit = false;
+                    queue_ack(ack, unacked_tsval);
+                    continue;
+                }
+                // Nothing came; ack again in case our last ack was lost,
+                // and wait longer next time
+                rtt_.backoff();
+                metrics.ack_timeouts.add();
+                retransmit = true;
+                queue_ack(ack, 0);
+                continue;
+            }
+            std::cerr << "recvmmsg(): " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            Packet& in = batch_in.packet(i);
+            size_t bytes_read = batch_in.length(i);
+            if (!in.valid(bytes_read))
+            {
+                continue;
+            }
+            in.to_host();
+            // The server shares one socket between all its clients, so make
+            // sure this is really for us
+            if (in.headers.conn_id != conn_id_)
+            {
+                continue;
+            }
+            // The server is still probing because our handshake ACK was lost;
+            // answer the probe of the size we settled on. The smaller probes
+            // that trail every round are ignored. When resuming, our acks
+            // don't stand in for a lost handshake ACK, so answer any SYN-ACK.
+            // Opened fast, there was no handshake ACK to lose.
+            if (in.headers.syn)
+            {
+                if (!fast_ok_ && (mss_ok_ ? in.get_mss() == mss_ : resume_ok_))
+                {
+                    send_handshake_ack(in);
+                }
+                continue;
+            }
+            // If we get a FIN packet, get ready to close the connection
+            if (in.headers.fin)
+            {
+                batch_out.flush(sock_);
+                try
+                {
+                    outfile->finish();
+                }
+                catch (const std::runtime_error& e)
+                {
+                    std::cerr << e.what() << std::endl;
+                    return false;
+                }
+                double secs = std::chrono::duration<double>(now() - start_time).count();
+                if (secs > 0)
+                {
+                    metrics.goodput.record(written_ / secs);
+                }
+                std::cerr << "sendmmsg(): " << batch_out.stats() << '\n'
+                          << "recvmmsg(): " << batch_in.stats() << '\n'
+                          << "acks: " << acks_sent << " for " << data_packets
+                          << " data packets ("
+                          << (data_packets > 0 ? (double)acks_sent / data_packets : 0)
+                          << " per packet)\n";
+                if (fec)
+                {
+                    std::cerr << "fec: " << repairs
+                              << " segments rebuilt from parity\n";
+                }
+                // Everything has been written once the FIN comes, so the
+                // digest covers the whole file (or our stream's part of it)
+                if (inflater)
+                {
+                    std::cerr << "inflated " << stream_bytes << " -> "
+                              << written_ << " bytes\n";
+                }
+                bool intact = true;
+                uint32_t expected;
+                if (checksum_ok_ && in.get_checksum(expected))
+                {
+                    uint32_t crc = inflater ? inflater->crc() : digest->value();
+                    intact = crc == expected &&
+                             (inflater ? inflater->complete()
+                                       : digest->next_seq() == ack);
+                    std::cerr << "crc32c: " << std::hex << crc << std::dec
+                              << (intact ? "" : " (MISMATCH)") << ", "
+                              << corrupt << " corrupt segments dropped\n";
+                }
+                std::cerr << "rtt: " << rtt_ << std::endl;
+                if (record_)
+                {
+                    record_->finish(intact && resume_at_ + written_ == part_.end);
+                }
+                if (!close_connection(add_seq(in.headers.seq_number, 1), seq))
+                {
+                    return false;
+                }
+                if (!intact)
+                {
+                    std::cerr << "The file doesn't match the server's checksum"
+                              << std::endl;
+                }
+                return intact;
+            }
+            // Don't trust a data_len that runs past the end of the datagram
+            if (in.size() > bytes_read)
+            {
+                continue;
+            }
+            // A parity segment may rebuild the one segment its block is
+            // missing, which then goes in as if it had just arrived
+            uint8_t count;
+            uint16_t lengths;
+            uint32_t crc = 0;
+            if (fec && in.get_parity(count, lengths))
+            {
+                metrics.parity_received.add();
+                if (!verify(in, batch_in.payload(i), crc))
+                {
+                    continue;
+                }
+                uint32_t tsval = 0, tsecr = 0;
+                in.get_timestamp(tsval, tsecr);
+                uint32_t seq;
+                size_t len;
+                const char* data = fec->repair(in.headers.seq_number, count,
+                        lengths, batch_in.payload(i), in.headers.data_len,
+                        seq, len);
+                if (data != nullptr && seq_leq(ack, seq))
+                {
+                    metrics.fec_repairs.add();
+                    repairs++;
+                    // Nothing vouches for a rebuilt segment but the digest
+                    // it goes into
+                    if (digest)
+                    {
+                        crc = crc32c(0, data, len);
+                    }
+                    if (!take_segment(seq, data, len, crc, tsval))
+                    {
+                        return false;
+                    }
+                }
+                continue;
+            }
+            if (!verify(in, batch_in.payload(i), crc))
+            {
+                continue;
+            }
+            Trace::record(TRACE_RECV_DATA, 0, conn_id_, in.headers.seq_number);
+            data_packets++;
+            metrics.segments_received.add();
+            metrics.bytes_received.add(in.headers.data_len);
+            // A burst of data all echoes the same ack of ours, so only the
+            // first packet of it times the round trip
+            uint32_t tsval = 0, tsecr = 0;
+            if (ts_ok_ && in.get_timestamp(tsval, tsecr) && tsecr != 0 &&
+                    tsecr != last_tsecr)
+            {
+                auto sample = since_timestamp(tsecr);
+                rtt_.sample(sample, now());
+                metrics.rtt.record(sample.count());
+                last_tsecr = tsecr;
+            }
+            if (fec)
+            {
+                fec->add(in.headers.seq_number, batch_in.payload(i),
+                         in.headers.data_len);
+            }
+            if (!take_segment(in.headers.seq_number, batch_in.payload(i),
+                              in.headers.data_len, crc, tsval))
+            {
+                return false;
+            }
+        }
+        // One ack covers every in-order segment of the batch, once enough
+        // are waiting; otherwise the delayed ack timer will send it
+        if (unacked >= options_.ack_every)
+        {
+            retransmit = false;
+            queue_ack(ack, unacked_tsval);
+        }
+    }
+    return true;
+}
+
+/**
+ * @param ack the client's current acknowledgment number
+ * @param seq the client's current sequence number
+ *
+ * @return true on success, false otherwise
+ */
+bool Client::close_connection(uint32_t ack, uint32_t seq)
+{
+    Packet in, out;
+    out.headers.fin = out.headers.ack = true;
+    out.headers.conn_id = conn_id_;
+    out.headers.ack_number = ack;
+    out.headers.seq_number = seq;
+    out.headers.window_sz = advertised_window();
+    while (true)
+    {
+        out.to_network();
+        // Write the FIN-ACK
+        if (sock_.send((void*)&out, out.size(false), 0) < 0)
+        {
+            std::cerr << "send(): " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        out.to_host();
+        // Wait up to close_timeout seconds for an ACK from the server
+        sock_.setsockopt(SOL_SOCKET, SO_RCVTIMEO, &close_timeout, sizeof(close_timeout));
+        ssize_t bytes_read = sock_.recv((void*)&in, sizeof(in), 0);
+        in.to_host();
+        if (bytes_read < 0)
+        {
+            if (errno == EAGAIN)
+            {
+                // Timeout is okay--the server's ACK probably didn't make it
+                return true;
+            }
+            std::cerr << "recv(): " << std::strerror(errno) << std::endl;
+            return false;
+        }
+        else if (!in.valid(bytes_read) || !in.headers.ack ||
+                in.headers.ack_number != add_seq(seq, 1))
+        {
+            continue;
+        }
+        return true;
+    }
+}
+
+/**
+ * @return our receive window in the units the server expects in window_sz
+ */
+uint16_t Client::advertised_window() const
+{
+    return std::min(window_ >> wscale_, (uint32_t)UINT16_MAX);
+}
@@ -0,0 +1,167 @@
+#ifndef CLIENT_TRANSFER_H
+#define CLIENT_TRANSFER_H
+
+#include "Packet.h"                     // for Packet, ByteRange
+#include "Resume.h"                     // for ResumeRecord
+#include "RttEstimator.h"               // for RttEstimator
+#include "Socket.h"                     // for Socket
+
+#include <chrono>                       // for microseconds
+#include <cstdint>                      // for uint8_t, uint16_t, uint32_t
+#include <memory>                       // for unique_ptr
+#include <string>                       // for string
+
+/**
+ * How a Client receives; client.cpp sets these from the command line
+ */
+struct ClientOptions
+{
+    ClientOptions() :
+        window(4 * 1024 * 1024), positional(false), ack_every(2),
+        ack_delay(2000), streams(1), mss(Packet::MAX_MSS), gro(false), fec(0),
+        compress(false), resume(false), fast_open(false), have_ticket(false),
+        ticket(0), srtt(0), output("received.data") {}
+    // how many bytes we let the server have in flight
+    uint32_t window;
+    // write each segment at its offset in the file as it arrives
+    bool positional;
+    // ack once this many in-order segments are waiting for one,
+    unsigned ack_every;
+    // or once the oldest of them has waited this long
+    std::chrono::microseconds ack_delay;
+    // congestion control to ask the server for, or empty for its default
+    std::string congestion;
+    // how many connections to split the file across, if the server agrees
+    unsigned streams;
+    // the largest segment to take, if the path carries it; Packet::MIN_MSS
+    // or less keeps the server from probing
+    size_t mss;
+    // let the kernel hand over runs of segments at once, with UDP GRO
+    bool gro;
+    // ask for a parity segment after every this many data segments at
+    // most, or 0 for none; the server sends fewer while little is lost
+    unsigned fec;
+    // ask for the file deflated, which the server only does where it pays
+    bool compress;
+    // pick up where the last transfer into output left off, if it was of
+    // the same file, and keep a ResumeRecord so the next one can
+    bool resume;
+    // ask for a ticket (OPT_TICKET), or, if have_ticket, present this one
+    // so the server may send the file without waiting for our handshake
+    // ACK; never with resume
+    bool fast_open;
+    bool have_ticket;
+    uint32_t ticket;
+    // the round trip time to the server last time, or 0 if not known,
+    // which sets how long we wait for the first SYN-ACK
+    std::chrono::microseconds srtt;
+    // where to write the file
+    std::string output;
+};
+
+/**
+ * One transfer from the server: the handshake, receiving the file and
+ * closing. Everything goes through sock, which must already be connected
+ * to the server, and blocks in it; this is what used to be client.cpp's
+ * functions and their static variables.
+ *
+ * A file split across streams takes one Client per stream, each on its own
+ * socket. The first one asks for options.streams and learns how many the
+ * server granted; the others are then created with options.streams set to
+ * that and their index, and each receives its part of the file into the
+ * same output, which PositionalWriter::allocate() must have set up.
+ */
+class Client
+{
+public:
+    Client(Socket& sock, const ClientOptions& options, unsigned stream = 0);
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    /**
+     * Connects, receives the file and closes the connection
+     *
+     * @return true on success, false otherwise
+     */
+    bool run() { return connect() && receive(); }
+
+    /**
+     * The handshake
+     *
+     * @return true on success, false otherwise
+     */
+    bool connect();
+
+    /**
+     * After connect(), receives the file (or this stream's part of it) and
+     * closes the connection
+     *
+     * @return true on success, false otherwise
+     */
+    bool receive();
+
+    // how many streams the server agreed to, after connect()
+    unsigned streams() const { return streams_; }
+    // from the handshake, or FileWriter::UNKNOWN_SIZE if the server didn't say
+    uint64_t file_size() const { return file_size_; }
+    // the segment size the handshake settled on, after connect()
+    uint32_t mss() const { return mss_; }
+    // bytes of the file written out in order so far
+    uint64_t bytes_received() const { return written_; }
+    // picking up where an earlier transfer left off, after connect(); the
+    // output file then has to be kept as it is
+    bool resuming() const { return resume_ok_; }
+    // the server's ticket for next time, after connect(), if ticket_ok()
+    bool ticket_ok() const { return ticket_ok_; }
+    uint32_t ticket() const { return ticket_; }
+    // the server took our ticket and sent the file without waiting for the
+    // handshake ACK, after connect()
+    bool opened_fast() const { return fast_ok_; }
+    const RttEstimator& rtt() const { return rtt_; }
+
+private:
+    bool establish_connection(uint32_t& ack_out, uint32_t& seq_out,
+                              uint64_t& file_size_out);
+    bool start_resume(const Packet& syn_ack, uint64_t file_size);
+    bool receive_file(uint32_t ack, uint32_t seq, uint64_t file_size);
+    bool close_connection(uint32_t ack, uint32_t seq);
+    void send_handshake_ack(const Packet& syn_ack);
+    uint16_t advertised_window() const;
+
+    Socket& sock_;
+    ClientOptions options_;
+    uint32_t window_;       // options_.window, unless the server can't scale
+    uint8_t wscale_;        // how far our advertised window_sz is shifted,
+                            // as negotiated in the handshake
+    // picked randomly for each transfer so the server can tell our
+    // connections apart; every packet we send carries it
+    uint16_t conn_id_;
+    bool sack_ok_;          // the server agreed to SACK blocks in our acks
+    bool ts_ok_;            // the server agreed to timestamps on every packet
+    bool mss_ok_;           // the server probed for a larger segment size,
+    uint32_t mss_;          // and this is the largest probe that reached us
+    bool fec_ok_;           // the server agreed to send parity segments
+    bool checksum_ok_;      // the server agreed to checksum every segment
+    bool compress_ok_;      // the server sends the file compressed
+    bool resume_ok_;        // the server can resume (OPT_RESUME),
+    uint32_t fingerprint_;  // and this is the version of the file it has
+    std::unique_ptr<ResumeRecord> record_;
+    ByteRange part_;        // our part of the file,
+    uint64_t resume_at_;    // and where in it this transfer starts
+    bool ticket_ok_;        // the server gave us a ticket (OPT_TICKET),
+    uint32_t ticket_;       // this one,
+    bool fast_ok_;          // and it is ours, so the file is already coming
+    // our round trip time estimate, which sets how long we wait for the
+    // server before resending a SYN or acking again
+    RttEstimator rtt_;
+    uint64_t written_;
+    unsigned stream_;       // our index among the streams,
+    unsigned streams_;      // of which there are this many
+    // where the handshake left off, for receive_file()
+    uint32_t ack_;
+    uint32_t seq_;
+    uint64_t file_size_;
+};
+
+#endif
@@ -0,0 +1,257 @@
+#include "Compress.h"
+
+#include "Checksum.h"                   // for crc32c
+
+#include <algorithm>                    // for min
+#include <cerrno>                       // for errno
+#include <chrono>                       // for steady_clock, duration
+#include <cstring>                      // for memcpy, strerror
+#include <stdexcept>                    // for runtime_error
+#include <string>                       // for string, operator+
+
+#include <sys/mman.h>                   // for mmap, munmap, madvise
+#include <unistd.h>                     // for sysconf
+
+/*
+ * Static Variables
+ */
+// deflate's fastest level: the point is to save sending time, not bytes
+static const int DEFLATE_LEVEL = 1;
+// raw deflate, with no zlib header or checksum, and its largest window
+static const int WINDOW_BITS = -15;
+
+/*
+ * Function Declarations
+ */
+static void put_be32(char* p, uint32_t value);
+static uint32_t get_be32(const char* p);
+
+/*
+ * Implementations
+ */
+Compressor::Compressor(const char* data, uint64_t size) :
+    in_(data), in_size_(size), in_pos_(0), out_(nullptr), out_cap_(0),
+    out_size_(0), released_(0), crc_(0), skip_(0), backoff_(1),
+    compressed_blocks_(0), stored_blocks_(0), deflated_bytes_(0),
+    deflate_secs_(0)
+{
+    std::memset(&zs_, 0, sizeof(zs_));
+    if (deflateInit2(&zs_, DEFLATE_LEVEL, Z_DEFLATED, WINDOW_BITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        throw std::runtime_error("deflateInit2() failed");
+    }
+    if (size == 0)
+    {
+        return;
+    }
+    // No block comes out longer than it went in, plus its header. Pages are
+    // only used as they are written, and release() gives them back.
+    uint64_t blocks = (size + COMPRESS_BLOCK - 1) / COMPRESS_BLOCK;
+    out_cap_ = size + blocks * COMPRESS_HEADER_SZ;
+    void* addr = mmap(nullptr, out_cap_, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+    {
+        int err = errno;
+        deflateEnd(&zs_);
+        throw std::runtime_error(std::string("mmap(): ") + std::strerror(err));
+    }
+    out_ = (char*)addr;
+}
+
+Compressor::~Compressor()
+{
+    deflateEnd(&zs_);
+    if (out_ != nullptr)
+    {
+        munmap(out_, out_cap_);
+    }
+}
+
+void Compressor::produce(uint64_t want, double rate)
+{
+    while (out_size_ < want && in_pos_ < in_size_)
+    {
+        size_t len = std::min((uint64_t)COMPRESS_BLOCK, in_size_ - in_pos_);
+        const char* in = in_ + in_pos_;
+        char* out = out_ + out_size_;
+        crc_ = crc32c(crc_, in, len);
+        size_t stored = len;
+        if (skip_ > 0)
+        {
+            skip_--;
+        }
+        else
+        {
+            // Deflate's time is real CPU time, whatever clock now() reads
+            auto start = std::chrono::steady_clock::now();
+            size_t deflated = deflate_block(in, len, out + COMPRESS_HEADER_SZ,
+                                            len - len / 8);
+            double secs = std::chrono::duration<double>(
+                    std::chrono::steady_clock::now() - start).count();
+            deflated_bytes_ += len;
+            deflate_secs_ += secs;
+            if (deflated > 0 && (rate <= 0 || secs * rate < len - deflated))
+            {
+                stored = deflated;
+                backoff_ = 1;
+            }
+            else
+            {
+                skip_ = backoff_;
+                backoff_ = std::min(2 * backoff_, (size_t)MAX_SKIP);
+            }
+        }
+        if (stored == len)
+        {
+            std::memcpy(out + COMPRESS_HEADER_SZ, in, len);
+            stored_blocks_++;
+        }
+        else
+        {
+            compressed_blocks_++;
+        }
+        put_be32(out, stored);
+        put_be32(out + 4, len);
+        out_size_ += COMPRESS_HEADER_SZ + stored;
+        in_pos_ += len;
+    }
+}
+
+void Compressor::release(uint64_t offset)
+{
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t end = std::min(offset, out_size_) / page * page;
+    if (end > released_)
+    {
+        madvise(out_ + released_, end - released_, MADV_DONTNEED);
+        released_ = end;
+    }
+}
+
+/**
+ * Deflates len bytes from in into the room bytes at out
+ *
+ * @return the deflated length, or 0 if it didn't fit
+ */
+size_t Compressor::deflate_block(const char* in, size_t len, char* out,
+                                 size_t room)
+{
+    deflateReset(&zs_);
+    zs_.next_in = (Bytef*)in;
+    zs_.avail_in = len;
+    zs_.next_out = (Bytef*)out;
+    zs_.avail_out = room;
+    if (deflate(&zs_, Z_FINISH) != Z_STREAM_END)
+    {
+        return 0;
+    }
+    return room - zs_.avail_out;
+}
+
+Decompressor::Decompressor(Sink sink) :
+    sink_(sink), block_(COMPRESS_HEADER_SZ + COMPRESS_BLOCK), have_(0),
+    need_(COMPRESS_HEADER_SZ), raw_(COMPRESS_BLOCK), crc_(0), raw_bytes_(0)
+{
+    std::memset(&zs_, 0, sizeof(zs_));
+    if (inflateInit2(&zs_, WINDOW_BITS) != Z_OK)
+    {
+        throw std::runtime_error("inflateInit2() failed");
+    }
+}
+
+Decompressor::~Decompressor()
+{
+    inflateEnd(&zs_);
+}
+
+void Decompressor::feed(const char* data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = std::min(len, need_ - have_);
+        std::memcpy(&block_[have_], data, n);
+        have_ += n;
+        data += n;
+        len -= n;
+        if (have_ < need_)
+        {
+            break;
+        }
+        if (need_ == COMPRESS_HEADER_SZ)
+        {
+            uint32_t stored = get_be32(&block_[0]);
+            uint32_t raw = get_be32(&block_[4]);
+            if (raw == 0 || raw > COMPRESS_BLOCK || stored == 0 || stored > raw)
+            {
+                throw std::runtime_error("Malformed compressed block");
+            }
+            need_ += stored;
+            continue;
+        }
+        finish_block();
+        have_ = 0;
+        need_ = COMPRESS_HEADER_SZ;
+    }
+}
+
+/**
+ * Inflates the block that has just been fed in full, unless it is stored,
+ * and hands it to the sink
+ */
+void Decompressor::finish_block()
+{
+    size_t stored = need_ - COMPRESS_HEADER_SZ;
+    size_t raw = get_be32(&block_[4]);
+    const char* out = &block_[COMPRESS_HEADER_SZ];
+    if (stored < raw)
+    {
+        inflateReset(&zs_);
+        zs_.next_in = (Bytef*)&block_[COMPRESS_HEADER_SZ];
+        zs_.avail_in = stored;
+        zs_.next_out = (Bytef*)raw_.data();
+        zs_.avail_out = raw;
+        if (inflate(&zs_, Z_FINISH) != Z_STREAM_END || zs_.avail_out != 0)
+        {
+            throw std::runtime_error("Corrupt compressed block");
+        }
+        out = raw_.data();
+    }
+    crc_ = crc32c(crc_, out, raw);
+    raw_bytes_ += raw;
+    sink_(out, raw);
+}
+
+std::ostream& operator<<(std::ostream& os, const Compressor& c)
+{
+    os << "deflated " << c.compressed_blocks() << "/"
+       << c.compressed_blocks() + c.stored_blocks() << " blocks, "
+       << c.raw_bytes() << " -> " << c.size() << " bytes";
+    if (c.speed() > 0)
+    {
+        os << " at " << c.speed() / 1e6 << " MB/s";
+    }
+    return os;
+}
+
+/**
+ * Writes value to the 4 bytes at p, most significant first
+ */
+static void put_be32(char* p, uint32_t value)
+{
+    p[0] = (char)(value >> 24);
+    p[1] = (char)(value >> 16);
+    p[2] = (char)(value >> 8);
+    p[3] = (char)value;
+}
+
+/**
+ * @return the 4 bytes at p, most significant first
+ */
+static uint32_t get_be32(const char* p)
+{
+    const unsigned char* u = (const unsigned char*)p;
+    return (uint32_t)u[0] << 24 | (uint32_t)u[1] << 16 | (uint32_t)u[2] << 8 |
+           u[3];
+}
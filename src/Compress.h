@@ -0,0 +1,145 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t, uint64_t
+#include <functional>                   // for function
+#include <ostream>                      // for ostream
+#include <vector>                       // for vector
+
+#include <zlib.h>                       // for z_stream
+
+/*
+ * The compressed stream (OPT_COMPRESS) is the file cut into blocks of up to
+ * BLOCK bytes, each deflated on its own so a block only ever needs its own
+ * bytes to be inflated. Every block is a header of two big-endian 32-bit
+ * lengths, the bytes that follow and the bytes they inflate to, then the
+ * data; a block whose two lengths are equal is stored as it is.
+ */
+static const size_t COMPRESS_BLOCK = 64 * 1024;
+static const size_t COMPRESS_HEADER_SZ = 8;
+
+/**
+ * The server's side: turns a connection's part of the mapped file into the
+ * compressed stream a block at a time, as the send window reaches it.
+ *
+ * A block is only sent deflated if that pays: if it shrinks by an eighth
+ * and, at the rate the connection is sending, the bytes it saves would take
+ * longer to send than deflating it took. After a block that doesn't pay,
+ * the next ones are stored without trying, twice as many each time in a
+ * row (up to MAX_SKIP), so incompressible data costs next to nothing.
+ */
+class Compressor
+{
+public:
+    // Blocks stored without trying after a run of ones that didn't pay
+    static const size_t MAX_SKIP = 64;
+
+    /**
+     * Throws std::runtime_error if zlib or the output buffer can't be set up
+     *
+     * @param data, size the bytes to compress
+     */
+    Compressor(const char* data, uint64_t size);
+    ~Compressor();
+
+    Compressor(const Compressor&) = delete;
+    Compressor& operator=(const Compressor&) = delete;
+
+    /**
+     * Compresses blocks until at least want bytes of the stream exist or
+     * the input runs out
+     *
+     * @param rate the connection's sending rate in bytes per second, or 0
+     * if it isn't known
+     */
+    void produce(uint64_t want, double rate);
+
+    /**
+     * Gives back the memory of the stream before offset, which won't be
+     * read again
+     */
+    void release(uint64_t offset);
+
+    // the stream so far; it never moves
+    const char* data() const { return out_; }
+    uint64_t size() const { return out_size_; }
+    // the whole input is in the stream
+    bool done() const { return in_pos_ == in_size_; }
+    // the CRC32C of the input so far
+    uint32_t crc() const { return crc_; }
+    uint64_t raw_bytes() const { return in_pos_; }
+    uint64_t compressed_blocks() const { return compressed_blocks_; }
+    uint64_t stored_blocks() const { return stored_blocks_; }
+    // how fast deflate has gone, in input bytes per second
+    double speed() const
+    {
+        return deflate_secs_ > 0 ? deflated_bytes_ / deflate_secs_ : 0;
+    }
+
+private:
+    size_t deflate_block(const char* in, size_t len, char* out, size_t room);
+
+    z_stream zs_;
+    const char* in_;
+    uint64_t in_size_;
+    uint64_t in_pos_;
+    char* out_;
+    uint64_t out_cap_;
+    uint64_t out_size_;
+    uint64_t released_;     // bytes at the front given back already
+    uint32_t crc_;
+    size_t skip_;           // blocks left to store without trying
+    size_t backoff_;        // how many to skip after the next that doesn't pay
+    uint64_t compressed_blocks_;
+    uint64_t stored_blocks_;
+    uint64_t deflated_bytes_;
+    double deflate_secs_;
+};
+
+/**
+ * The client's side: takes the compressed stream in order, in pieces of any
+ * size, and hands each block's inflated bytes to a sink as it completes
+ */
+class Decompressor
+{
+public:
+    using Sink = std::function<void(const char* data, size_t len)>;
+
+    /**
+     * Throws std::runtime_error if zlib can't be set up
+     */
+    explicit Decompressor(Sink sink);
+    ~Decompressor();
+
+    Decompressor(const Decompressor&) = delete;
+    Decompressor& operator=(const Decompressor&) = delete;
+
+    /**
+     * Takes the next len bytes of the stream. Throws std::runtime_error if
+     * they don't make sense.
+     */
+    void feed(const char* data, size_t len);
+
+    // no block is partly fed
+    bool idle() const { return have_ == 0; }
+    // the CRC32C of everything handed to the sink
+    uint32_t crc() const { return crc_; }
+    uint64_t raw_bytes() const { return raw_bytes_; }
+
+private:
+    void finish_block();
+
+    z_stream zs_;
+    Sink sink_;
+    std::vector<char> block_; // the block being fed, header and all
+    size_t have_;           // bytes of it fed so far
+    size_t need_;           // bytes it has, once the header is in
+    std::vector<char> raw_;
+    uint32_t crc_;
+    uint64_t raw_bytes_;
+};
+
+std::ostream& operator<<(std::ostream& os, const Compressor& c);
+
+#endif
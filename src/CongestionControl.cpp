@@ -0,0 +1,465 @@
+#include "CongestionControl.h"
+
+#include <algorithm>                    // for max, min
+#include <cmath>                        // for cbrt, pow, round
+
+/*
+ * Static Variables
+ */
+// what every connection starts with, in segments: one, and the old magic
+// 30720 bytes' worth
+static const uint32_t INITIAL_CWND = 1;
+static const uint32_t INITIAL_SSTHRESH = 30;
+// no controller goes below this many segments
+static const uint32_t MIN_CWND = 1;
+
+// CUBIC's scaling constant and multiplicative decrease factor (RFC 8312)
+static const double CUBIC_C = 0.4;
+static const double CUBIC_BETA = 0.7;
+
+// 2/ln(2): the smallest gain that still doubles the sending rate every round
+static const double BBR_HIGH_GAIN = 2.885;
+// PROBE_BW's pacing gains, one per min_rtt: probe up, drain what that
+// queued, then cruise
+static const double BBR_GAIN_CYCLE[] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 };
+static const size_t BBR_CYCLE_LEN = sizeof(BBR_GAIN_CYCLE) / sizeof(BBR_GAIN_CYCLE[0]);
+// how long a min_rtt measurement stays good, and how long PROBE_RTT lasts
+static const std::chrono::seconds BBR_MIN_RTT_WINDOW(10);
+static const std::chrono::milliseconds BBR_PROBE_RTT_TIME(200);
+// BBR keeps at least this many segments in flight so acks keep coming
+static const uint32_t BBR_MIN_CWND = 4;
+
+/*
+ * Implementations
+ */
+std::unique_ptr<CongestionControl> CongestionControl::create(const std::string& name,
+                                                             uint32_t mss)
+{
+    std::unique_ptr<CongestionControl> cc;
+    if (name == "reno")
+    {
+        cc.reset(new Reno(mss));
+    }
+    else if (name == "cubic")
+    {
+        cc.reset(new Cubic(mss));
+    }
+    else if (name == "bbr")
+    {
+        cc.reset(new Bbr(mss));
+    }
+    return cc;
+}
+
+Reno::Reno(uint32_t mss) :
+    CongestionControl(mss), current_mode_(Mode::SS), cwnd_(INITIAL_CWND * mss),
+    ssthresh_(INITIAL_SSTHRESH * mss)
+{
+}
+
+void Reno::on_ack(const AckSample& ack)
+{
+    // Growth counts the bytes acked rather than the acks (RFC 3465), so a
+    // receiver that acks every other segment doesn't halve it
+    if (ack.acked == 0)
+    {
+        return;
+    }
+    switch (current_mode_)
+    {
+        case Mode::SS:
+        {
+            cwnd_ += ack.acked;
+            break;
+        }
+        case Mode::CA:
+        {
+            cwnd_ += std::max(1,
+                    (int)std::round(mss_ * (double)ack.acked / cwnd_));
+            break;
+        }
+        case Mode::FR:
+        {
+            // Without SACK the connection inflates the window itself
+            break;
+        }
+    }
+    if (cwnd_ >= ssthresh_ && current_mode_ == Mode::SS)
+    {
+        current_mode_ = Mode::CA;
+    }
+}
+
+void Reno::on_loss(time_point)
+{
+    ssthresh_ = std::max(mss_, cwnd_ / 2);
+    cwnd_ = ssthresh_;
+    current_mode_ = Mode::FR;
+}
+
+void Reno::on_recovery_end(time_point)
+{
+    cwnd_ = ssthresh_;
+    current_mode_ = Mode::CA;
+}
+
+void Reno::on_timeout(time_point)
+{
+    ssthresh_ = std::max(mss_, cwnd_ / 2);
+    cwnd_ = mss_;
+    current_mode_ = Mode::SS;
+}
+
+void Reno::set_limit(uint32_t bytes)
+{
+    cwnd_ = std::max(std::min(cwnd_, bytes), MIN_CWND * mss_);
+}
+
+void Reno::restore(uint32_t cwnd, uint32_t ssthresh)
+{
+    cwnd_ = std::max(cwnd, MIN_CWND * mss_);
+    if (ssthresh > 0)
+    {
+        ssthresh_ = std::max(ssthresh, mss_);
+    }
+    current_mode_ = cwnd_ < ssthresh_ ? Mode::SS : Mode::CA;
+}
+
+Cubic::Cubic(uint32_t mss) :
+    CongestionControl(mss), cwnd_(INITIAL_CWND * mss), ssthresh_(UINT32_MAX),
+    in_recovery_(false),
+    in_epoch_(false), k_(0), origin_(0), w_max_(0), w_est_(0), min_rtt_(0)
+{
+    // Unlike Reno there's no arbitrary first ssthresh: slow start runs until
+    // the first loss (or the receive window) says where the pipe ends
+}
+
+void Cubic::on_ack(const AckSample& ack)
+{
+    if (in_recovery_)
+    {
+        return;
+    }
+    if (cwnd_ < ssthresh_)
+    {
+        cwnd_ += ack.acked;
+        return;
+    }
+    if (!in_epoch_)
+    {
+        in_epoch_ = true;
+        epoch_start_ = ack.time;
+        w_est_ = cwnd_;
+        if (cwnd_ < w_max_)
+        {
+            k_ = std::cbrt((w_max_ - cwnd_) / mss_ / CUBIC_C);
+            origin_ = w_max_;
+        }
+        else
+        {
+            k_ = 0;
+            origin_ = cwnd_;
+        }
+    }
+    // Where the cubic says cwnd should be one RTT from now, growing by at most
+    // half of cwnd per RTT
+    double t = std::chrono::duration<double>(ack.time - epoch_start_ + min_rtt_).count();
+    double target = origin_ + CUBIC_C * std::pow(t - k_, 3) * mss_;
+    target = std::min(target, 1.5 * cwnd_);
+    // Never grow slower than Reno would
+    w_est_ += 3 * (1 - CUBIC_BETA) / (1 + CUBIC_BETA) * mss_ *
+              ack.acked / cwnd_;
+    target = std::max(target, w_est_);
+    if (target > cwnd_)
+    {
+        cwnd_ += (target - cwnd_) * ack.acked / cwnd_;
+    }
+}
+
+void Cubic::on_rtt(duration rtt, time_point)
+{
+    if (min_rtt_.count() == 0 || rtt < min_rtt_)
+    {
+        min_rtt_ = rtt;
+    }
+}
+
+/**
+ * The multiplicative decrease, remembering where the loss happened
+ */
+void Cubic::reduce()
+{
+    in_epoch_ = false;
+    // Fast convergence: if we lost before getting back to the last plateau,
+    // another flow probably joined, so give up some more
+    w_max_ = cwnd_ < w_max_ ? cwnd_ * (1 + CUBIC_BETA) / 2 : cwnd_;
+    ssthresh_ = std::max((uint32_t)(cwnd_ * CUBIC_BETA), 2 * MIN_CWND * mss_);
+}
+
+void Cubic::on_loss(time_point)
+{
+    reduce();
+    cwnd_ = ssthresh_;
+    in_recovery_ = true;
+}
+
+void Cubic::on_recovery_end(time_point)
+{
+    cwnd_ = ssthresh_;
+    in_recovery_ = false;
+}
+
+void Cubic::on_timeout(time_point)
+{
+    reduce();
+    cwnd_ = MIN_CWND * mss_;
+    in_recovery_ = false;
+}
+
+void Cubic::set_limit(uint32_t bytes)
+{
+    cwnd_ = std::max(std::min(cwnd_, (double)bytes), (double)MIN_CWND * mss_);
+    ssthresh_ = std::min(ssthresh_, bytes);
+}
+
+void Cubic::restore(uint32_t cwnd, uint32_t ssthresh)
+{
+    cwnd_ = std::max(cwnd, MIN_CWND * mss_);
+    if (ssthresh > 0)
+    {
+        ssthresh_ = std::max(ssthresh, mss_);
+    }
+}
+
+Bbr::Bbr(uint32_t mss) :
+    CongestionControl(mss), state_(State::STARTUP), cwnd_(BBR_MIN_CWND * mss),
+    limit_(UINT32_MAX),
+    pacing_gain_(BBR_HIGH_GAIN), cwnd_gain_(BBR_HIGH_GAIN), cycle_index_(0),
+    bw_(), round_(0), next_round_delivered_(0), round_start_(false),
+    full_bw_(0), full_bw_rounds_(0), filled_pipe_(false), min_rtt_(0),
+    min_rtt_stamp_(now()), prior_cwnd_(0), in_flight_(0), in_recovery_(false)
+{
+}
+
+void Bbr::on_ack(const AckSample& ack)
+{
+    in_flight_ = ack.in_flight;
+    update_round(ack);
+    update_state(ack);
+    if (state_ == State::PROBE_RTT)
+    {
+        cwnd_ = std::min(cwnd_, BBR_MIN_CWND * mss_);
+    }
+    else
+    {
+        // Head for the bandwidth-delay product; until the pipe is known to be
+        // full, just grow with every byte delivered like slow start
+        uint32_t target = bdp(cwnd_gain_);
+        if (filled_pipe_)
+        {
+            cwnd_ = std::min(cwnd_ + ack.acked, target);
+        }
+        else if (cwnd_ < target || btl_bw() == 0)
+        {
+            cwnd_ += ack.acked;
+        }
+        // In recovery, send at most one segment for each one that leaves
+        // the network, for all of it rather than just the first round as BBR
+        // does: without pacing, bursts at twice the BDP overflow shallow
+        // queues, and this keeps that from turning into a retransmission storm
+        if (in_recovery_)
+        {
+            cwnd_ = std::min(cwnd_, in_flight_ + ack.acked);
+        }
+    }
+    cwnd_ = std::max(std::min(cwnd_, limit_), BBR_MIN_CWND * mss_);
+}
+
+/**
+ * A round ends when something sent after the previous one ended is acked;
+ * each round gets its own slot in the bandwidth filter
+ */
+void Bbr::update_round(const AckSample& ack)
+{
+    round_start_ = false;
+    if (ack.acked > 0 && ack.prior_delivered >= next_round_delivered_)
+    {
+        next_round_delivered_ = ack.delivered;
+        round_++;
+        round_start_ = true;
+        bw_[round_ % BW_ROUNDS] = 0;
+    }
+    double& slot = bw_[round_ % BW_ROUNDS];
+    slot = std::max(slot, ack.delivery_rate);
+}
+
+void Bbr::update_state(const AckSample& ack)
+{
+    time_point t = ack.time;
+    switch (state_)
+    {
+        case State::STARTUP:
+        {
+            // Full once three rounds in a row failed to grow bandwidth 25%
+            if (round_start_)
+            {
+                if (btl_bw() >= full_bw_ * 1.25)
+                {
+                    full_bw_ = btl_bw();
+                    full_bw_rounds_ = 0;
+                }
+                else if (++full_bw_rounds_ >= 3)
+                {
+                    filled_pipe_ = true;
+                    enter(State::DRAIN, t);
+                }
+            }
+            break;
+        }
+        case State::DRAIN:
+        {
+            if (in_flight_ <= bdp(1))
+            {
+                enter(State::PROBE_BW, t);
+            }
+            break;
+        }
+        case State::PROBE_BW:
+        {
+            // Each gain lasts a min_rtt; the draining phase ends early once
+            // the queue is gone
+            bool elapsed = t - cycle_start_ > min_rtt_;
+            if (elapsed || (pacing_gain_ < 1 && in_flight_ <= bdp(1)))
+            {
+                cycle_index_ = (cycle_index_ + 1) % BBR_CYCLE_LEN;
+                pacing_gain_ = BBR_GAIN_CYCLE[cycle_index_];
+                cycle_start_ = t;
+            }
+            break;
+        }
+        case State::PROBE_RTT:
+        {
+            if (t >= probe_rtt_done_)
+            {
+                cwnd_ = std::max(cwnd_, prior_cwnd_);
+                enter(filled_pipe_ ? State::PROBE_BW : State::STARTUP, t);
+            }
+            break;
+        }
+    }
+}
+
+void Bbr::enter(State state, time_point t)
+{
+    state_ = state;
+    switch (state)
+    {
+        case State::STARTUP:
+            pacing_gain_ = cwnd_gain_ = BBR_HIGH_GAIN;
+            break;
+        case State::DRAIN:
+            pacing_gain_ = 1 / BBR_HIGH_GAIN;
+            cwnd_gain_ = BBR_HIGH_GAIN;
+            break;
+        case State::PROBE_BW:
+            cwnd_gain_ = 2;
+            cycle_index_ = 0;
+            pacing_gain_ = BBR_GAIN_CYCLE[cycle_index_];
+            cycle_start_ = t;
+            break;
+        case State::PROBE_RTT:
+            pacing_gain_ = cwnd_gain_ = 1;
+            probe_rtt_done_ = t + BBR_PROBE_RTT_TIME;
+            break;
+    }
+}
+
+void Bbr::on_rtt(duration rtt, time_point t)
+{
+    bool expired = t - min_rtt_stamp_ > BBR_MIN_RTT_WINDOW;
+    if (min_rtt_.count() == 0 || rtt <= min_rtt_ || expired)
+    {
+        min_rtt_ = rtt;
+        min_rtt_stamp_ = t;
+    }
+    // Nothing has beaten the old minimum for a while; the path may have
+    // changed, or we may have kept a queue standing the whole time, so
+    // drain it and look again
+    if (expired && state_ != State::PROBE_RTT)
+    {
+        prior_cwnd_ = cwnd_;
+        enter(State::PROBE_RTT, t);
+    }
+}
+
+void Bbr::on_loss(time_point)
+{
+    prior_cwnd_ = cwnd_;
+    cwnd_ = std::max(in_flight_, BBR_MIN_CWND * mss_);
+    in_recovery_ = true;
+}
+
+void Bbr::on_recovery_end(time_point)
+{
+    cwnd_ = std::max(cwnd_, prior_cwnd_);
+    in_recovery_ = false;
+}
+
+void Bbr::on_timeout(time_point)
+{
+    // The model still holds; only what's in flight is unknown
+    prior_cwnd_ = cwnd_;
+    cwnd_ = BBR_MIN_CWND * mss_;
+    in_recovery_ = false;
+}
+
+void Bbr::set_limit(uint32_t bytes)
+{
+    limit_ = bytes;
+    cwnd_ = std::max(std::min(cwnd_, limit_), MIN_CWND * mss_);
+}
+
+void Bbr::restore(uint32_t cwnd, uint32_t)
+{
+    // There is no model of the path yet, so STARTUP still has to find its
+    // bandwidth; it just starts with more in flight
+    cwnd_ = std::max(std::min(cwnd, limit_), BBR_MIN_CWND * mss_);
+}
+
+double Bbr::pacing_rate() const
+{
+    double bw = btl_bw();
+    if (bw > 0)
+    {
+        return pacing_gain_ * bw;
+    }
+    if (min_rtt_.count() > 0)
+    {
+        return pacing_gain_ * cwnd_ / std::chrono::duration<double>(min_rtt_).count();
+    }
+    return 0;
+}
+
+/**
+ * The bottleneck bandwidth estimate in bytes per second: the best delivery
+ * rate of the last BW_ROUNDS rounds
+ */
+double Bbr::btl_bw() const
+{
+    return *std::max_element(bw_, bw_ + BW_ROUNDS);
+}
+
+/**
+ * gain times the bandwidth-delay product, in bytes
+ */
+uint32_t Bbr::bdp(double gain) const
+{
+    double bw = btl_bw();
+    if (bw == 0 || min_rtt_.count() == 0)
+    {
+        return cwnd_;
+    }
+    double bytes = gain * bw * std::chrono::duration<double>(min_rtt_).count();
+    // A few segments on top keep acks flowing however small the BDP is
+    return std::min((double)UINT32_MAX, bytes + 3 * mss_);
+}
@@ -0,0 +1,234 @@
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include "Packet.h"                     // for PacketWrapper, Packet
+
+#include <chrono>                       // for microseconds
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t, uint64_t
+#include <memory>                       // for unique_ptr
+#include <string>                       // for string
+
+/**
+ * What an ack told the sender, as far as congestion control cares
+ */
+struct AckSample
+{
+    using time_point = PacketWrapper::time_point;
+
+    time_point time;
+    // bytes the ack newly delivered, cumulatively or by SACK
+    uint32_t acked;
+    // true if it didn't move the cumulative ack forward
+    bool duplicate;
+    // bytes sent and neither acked, SACKed nor given up as lost, after it
+    uint32_t in_flight;
+    // total bytes delivered over the connection, after it
+    uint64_t delivered;
+    // delivered as of when the newest segment it covers was sent
+    uint64_t prior_delivered;
+    // bytes per second delivered over the newest segment's flight, or 0
+    double delivery_rate;
+};
+
+/**
+ * A congestion control algorithm.
+ *
+ * The connection does loss detection and recovery and tells the controller
+ * what happened; the controller decides how much may be in flight and how
+ * fast to send it.
+ */
+class CongestionControl
+{
+public:
+    using time_point = PacketWrapper::time_point;
+    using duration = std::chrono::microseconds;
+
+    virtual ~CongestionControl() {}
+
+    /**
+     * @return a controller by name ("reno", "cubic" or "bbr") that counts
+     * its window in segments of mss bytes, or nullptr if there is no such one
+     */
+    static std::unique_ptr<CongestionControl> create(const std::string& name,
+            uint32_t mss = Packet::MIN_MSS);
+
+    virtual const char* name() const = 0;
+    uint32_t mss() const { return mss_; }
+
+    // Every ack, including duplicates
+    virtual void on_ack(const AckSample& ack) = 0;
+    // Every round trip time measurement
+    virtual void on_rtt(duration rtt, time_point t) = 0;
+    // The connection found lost segments and started fast recovery
+    virtual void on_loss(time_point t) = 0;
+    // Everything outstanding when fast recovery started has been acked
+    virtual void on_recovery_end(time_point t) = 0;
+    // A retransmission timer ran out
+    virtual void on_timeout(time_point t) = 0;
+
+    /**
+     * Caps cwnd at what the receiver and the send window can take
+     */
+    virtual void set_limit(uint32_t bytes) = 0;
+
+    /**
+     * Starts from cwnd and ssthresh (0 for none), as an earlier connection
+     * over the same path left them, instead of from the initial window
+     */
+    virtual void restore(uint32_t cwnd, uint32_t ssthresh) = 0;
+
+    // bytes allowed in flight
+    virtual uint32_t cwnd() const = 0;
+    // the slow start threshold, or 0 if the algorithm has none
+    virtual uint32_t ssthresh() const = 0;
+    // bytes per second to pace at, or 0 to let the sender decide
+    virtual double pacing_rate() const = 0;
+
+protected:
+    explicit CongestionControl(uint32_t mss) : mss_(mss) {}
+
+    // the connection's segment size, which initial and minimum windows and
+    // per-segment growth are counted in
+    const uint32_t mss_;
+};
+
+/**
+ * The original Reno logic: slow start, congestion avoidance and fast
+ * recovery
+ */
+class Reno : public CongestionControl
+{
+public:
+    explicit Reno(uint32_t mss = Packet::MIN_MSS);
+
+    const char* name() const override { return "reno"; }
+    void on_ack(const AckSample& ack) override;
+    void on_rtt(duration, time_point) override {}
+    void on_loss(time_point t) override;
+    void on_recovery_end(time_point t) override;
+    void on_timeout(time_point t) override;
+    void set_limit(uint32_t bytes) override;
+    void restore(uint32_t cwnd, uint32_t ssthresh) override;
+    uint32_t cwnd() const override { return cwnd_; }
+    uint32_t ssthresh() const override { return ssthresh_; }
+    double pacing_rate() const override { return 0; }
+
+private:
+    enum class Mode {
+        SS, // slow start
+        CA, // congestion avoidance
+        FR  // fast recovery
+    };
+
+    Mode current_mode_;
+    uint32_t cwnd_;
+    uint32_t ssthresh_;
+};
+
+/**
+ * CUBIC (RFC 8312): after a loss, cwnd follows a cubic function of the time
+ * since, so it climbs back to where the loss happened quickly, probes around
+ * it carefully, then grows fast again. Growth depends on time rather than
+ * acks, which is what lets it fill long fat pipes.
+ */
+class Cubic : public CongestionControl
+{
+public:
+    explicit Cubic(uint32_t mss = Packet::MIN_MSS);
+
+    const char* name() const override { return "cubic"; }
+    void on_ack(const AckSample& ack) override;
+    void on_rtt(duration rtt, time_point t) override;
+    void on_loss(time_point t) override;
+    void on_recovery_end(time_point t) override;
+    void on_timeout(time_point t) override;
+    void set_limit(uint32_t bytes) override;
+    void restore(uint32_t cwnd, uint32_t ssthresh) override;
+    uint32_t cwnd() const override { return (uint32_t)cwnd_; }
+    uint32_t ssthresh() const override { return ssthresh_; }
+    double pacing_rate() const override { return 0; }
+
+private:
+    void reduce();
+
+    double cwnd_;           // bytes; growth per ack is often a fraction
+    uint32_t ssthresh_;
+    bool in_recovery_;
+    bool in_epoch_;         // epoch_start_ and k_ are valid
+    time_point epoch_start_;
+    double k_;              // seconds from epoch_start_ to get back to w_max_
+    double origin_;         // bytes; the plateau the cubic is centred on
+    double w_max_;          // bytes; cwnd when the last loss happened
+    double w_est_;          // bytes; what Reno would have by now
+    duration min_rtt_;
+};
+
+/**
+ * A model-based controller in the style of BBR: it measures the bottleneck
+ * bandwidth (the best recent delivery rate) and the round trip propagation
+ * time (the least recent RTT), paces at about their bandwidth and keeps
+ * about their product in flight, instead of reacting to every loss.
+ */
+class Bbr : public CongestionControl
+{
+public:
+    explicit Bbr(uint32_t mss = Packet::MIN_MSS);
+
+    const char* name() const override { return "bbr"; }
+    void on_ack(const AckSample& ack) override;
+    void on_rtt(duration rtt, time_point t) override;
+    void on_loss(time_point t) override;
+    void on_recovery_end(time_point t) override;
+    void on_timeout(time_point t) override;
+    void set_limit(uint32_t bytes) override;
+    void restore(uint32_t cwnd, uint32_t ssthresh) override;
+    uint32_t cwnd() const override { return cwnd_; }
+    uint32_t ssthresh() const override { return 0; }
+    double pacing_rate() const override;
+
+private:
+    enum class State {
+        STARTUP,    // doubling the rate every round until bandwidth plateaus
+        DRAIN,      // emptying the queue STARTUP built
+        PROBE_BW,   // cycling the rate around the bandwidth estimate
+        PROBE_RTT   // shrinking the flight to re-measure the propagation time
+    };
+
+    // How many rounds the bandwidth filter remembers
+    static const size_t BW_ROUNDS = 10;
+
+    double btl_bw() const;
+    uint32_t bdp(double gain) const;
+    void update_round(const AckSample& ack);
+    void update_state(const AckSample& ack);
+    void enter(State state, time_point t);
+
+    State state_;
+    uint32_t cwnd_;
+    uint32_t limit_;
+    double pacing_gain_;
+    double cwnd_gain_;
+    size_t cycle_index_;
+    time_point cycle_start_;
+
+    // Max filter over the delivery rate samples of the last BW_ROUNDS rounds
+    double bw_[BW_ROUNDS];
+    uint64_t round_;
+    uint64_t next_round_delivered_;
+    bool round_start_;
+
+    // Bandwidth stopped growing: when and at what
+    double full_bw_;
+    size_t full_bw_rounds_;
+    bool filled_pipe_;
+
+    duration min_rtt_;
+    time_point min_rtt_stamp_;
+    time_point probe_rtt_done_;
+    uint32_t prior_cwnd_;
+    uint32_t in_flight_;
+    bool in_recovery_;
+};
+
+#endif
@@ -0,0 +1,1506 @@
+#include "Connection.h"
+
+#include "Fec.h"                        // for FecDecoder, fec_block, etc
+#include "Metrics.h"                    // for Counter, Histogram
+#include "Trace.h"                      // for Trace, TRACE_SEND_DATA
+
+#include <algorithm>                    // for max, min
+#include <cerrno>                       // for errno, EAGAIN, EMSGSIZE
+#include <chrono>                       // for milliseconds, seconds
+#include <cstring>                      // for memcpy, memset, strerror
+#include <iostream>                     // for cerr
+
+#include <endian.h>                     // for be32toh, be64toh, htobe64
+#include <sys/socket.h>                 // for sendto, mmsghdr
+#include <sys/uio.h>                    // for iovec
+
+/*
+ * Static Variables
+ */
+// how long to linger after acking the client's FIN-ACK
+static const std::chrono::seconds close_timeout(1);
+// drop connections whose peer has been silent this long
+static const std::chrono::seconds idle_timeout(30);
+// most segments a connection's send window can hold
+static const size_t MAX_WINDOW_SLOTS = 1 << 20;
+// pace at this multiple of cwnd / srtt, in slow start and otherwise (as
+// Linux does), unless the congestion control sets its own rate
+static const double PACING_SS_GAIN = 2.0;
+static const double PACING_CA_GAIN = 1.2;
+// how far ahead of their departure time segments go to the kernel with
+// SO_TXTIME
+static const std::chrono::microseconds txtime_horizon(2000);
+// Besides the largest segment both sides take, the handshake probes the
+// paths these common MTUs make room for: jumbo frames, Ethernet and the
+// minimum for IPv6 tunnels
+static const size_t PROBE_MTUS[] = { 9000, 1500, 1280 };
+// what probes are padded with: up to the longest datagram, less the header
+static const char padding[Packet::OPT_SZ + Packet::MAX_MSS] = {};
+
+// What every connection adds up to, for Metrics snapshots
+static struct
+{
+    Counter connections_opened{"connections_opened"};
+    Counter transfers_completed{"transfers_completed"};
+    Counter segments_sent{"segments_sent"};
+    Counter bytes_sent{"bytes_sent"};
+    Counter segments_retransmitted{"segments_retransmitted"};
+    Counter segments_acked{"segments_acked"};
+    Counter bytes_acked{"bytes_acked"};
+    // segments marked for retransmission, by why
+    Counter timeout_retransmits{"timeout_retransmits"};
+    Counter fast_retransmits{"fast_retransmits"};
+    Counter duplicate_acks{"duplicate_acks"};
+    // mode transitions
+    Counter slow_start_exits{"slow_start_exits"};
+    Counter recoveries_entered{"recoveries_entered"};
+    Counter recoveries_exited{"recoveries_exited"};
+    Counter timeouts{"timeouts"};
+    Histogram rtt{"rtt", "us"};
+    Histogram cwnd{"cwnd", "bytes"};
+    Histogram goodput{"goodput", "bytes/s"};
+    // the segment size each handshake settled on
+    Histogram mss{"mss", "bytes"};
+    Counter parity_sent{"parity_sent"};
+    // how many segments each parity covered
+    Histogram fec_block{"fec_block", "segments"};
+    // blocks of compressed streams sent deflated, and as they were
+    Counter compressed_blocks{"compressed_blocks"};
+    Counter stored_blocks{"stored_blocks"};
+    // bytes resumed transfers didn't have to send again
+    Counter resumed_bytes{"resumed_bytes"};
+    // connections that sent the file right behind the SYN-ACK (OPT_TICKET)
+    Counter fast_opens{"fast_opens"};
+} metrics;
+
+/*
+ * Implementations
+ */
+Connection::Connection(Socket& sock, SendBatch& batch,
+                       const sockaddr_storage& peer, socklen_t peer_len,
+                       const Packet& syn, const MappedFile& file,
+                       const std::string& cc, unsigned max_streams,
+                       size_t max_mss, FastOpen* fast_open) :
+    sock_(sock), batch_(batch), peer_(peer), peer_len_(peer_len),
+    conn_id_(syn.headers.conn_id), client_seq_(syn.headers.seq_number),
+    isn_(get_isn()), wscale_ok_(false), peer_wscale_(0), sack_ok_(false),
+    ts_ok_(false), ts_recent_(0), state_(State::SYN_RCVD), blocked_(false),
+    dirty_(false), last_send_(now()), last_recv_(now()), last_progress_(now()),
+    start_time_(now()), file_(file), stream_(0), streams_(0),
+    range_{0, file.size()}, file_pos_(0), mss_(Packet::MIN_MSS),
+    probe_mss_(Packet::MIN_MSS), cwnd_limit_(UINT32_MAX), cwnd_used_(0),
+    in_flight_(0), in_recovery_(false), inflation_(0), duplicate_acks_(0),
+    pacing_wait_(false), next_(0), seq_(add_seq(isn_, 1)), last_seq_(seq_),
+    sacked_(0), sack_high_(0), lost_to_(0), recover_(seq_), delivered_(0),
+    delivered_time_(now()), rate_valid_(false), rate_delivered_(0), fec_min_(0),
+    fec_max_(0), fec_block_(0), loss_rate_(0), fec_sent_(0), fec_lost_(0),
+    fec_repairs_(0), fec_count_(0), fec_seq_(0), fec_data_(nullptr),
+    fec_len_(0), fec_lengths_(0), checksum_ok_(false),
+    combine_crc_(Packet::MIN_MSS), digest_(0), resume_ok_(false),
+    fast_open_(fast_open), ticket_ok_(false), ticket_valid_(false),
+    fast_ok_(false), fin_ack_seq_(0)
+{
+    // The client may ask for an algorithm; fall back to ours if it names one
+    // we don't have
+    uint8_t len;
+    const uint8_t* name = syn.find_option_any(Packet::OPT_CONGESTION, len);
+    if (name != nullptr)
+    {
+        cc_ = CongestionControl::create(std::string((const char*)name, len));
+    }
+    if (!cc_)
+    {
+        cc_ = CongestionControl::create(cc);
+    }
+    // With SO_TXTIME the kernel does the waiting, so we can hand segments
+    // over in batches instead of waking up for each one
+    if (batch_.txtime())
+    {
+        pacer_.set_horizon(txtime_horizon);
+    }
+    // Window scaling is only on if both sides send the option, so remember
+    // whether the client did
+    const uint8_t* wscale = syn.find_option(Packet::OPT_WSCALE, 1);
+    wscale_ok_ = wscale != nullptr;
+    if (wscale_ok_)
+    {
+        peer_wscale_ = std::min(*wscale, (uint8_t)Packet::MAX_WSCALE);
+    }
+    sack_ok_ = syn.find_option(Packet::OPT_SACK_PERMITTED, 0) != nullptr;
+    uint32_t tsecr;
+    ts_ok_ = syn.get_timestamp(ts_recent_, tsecr);
+    // A client splitting the file across connections asks for a number of
+    // streams on its first one, which we may cut down, then names its share
+    // and the number we granted on each of the others. Anything else gets
+    // the whole file and no OPT_STREAMS back, which tells it we refused.
+    const uint8_t* streams = syn.find_option(Packet::OPT_STREAMS, 2);
+    if (streams != nullptr)
+    {
+        unsigned index = streams[0];
+        unsigned count = std::max(streams[1], (uint8_t)1);
+        // No stream may be empty
+        uint64_t limit = std::min((uint64_t)max_streams, std::max(
+                (file.size() + Packet::MIN_MSS - 1) / Packet::MIN_MSS, (uint64_t)1));
+        if (index == 0)
+        {
+            count = std::min((uint64_t)count, limit);
+        }
+        if (index < count && count <= limit)
+        {
+            stream_ = index;
+            streams_ = count;
+            range_ = stream_range(file.size(), index, count);
+            file_pos_ = range_.start;
+        }
+    }
+    // A client that says how large a segment it takes gets probes up to
+    // that; anything else gets MIN_MSS, as before there was a choice
+    size_t peer_mss = syn.get_mss();
+    if (peer_mss > Packet::MIN_MSS && max_mss > Packet::MIN_MSS)
+    {
+        probe_mss_ = std::min(std::min(peer_mss, max_mss), (size_t)Packet::MAX_MSS);
+    }
+    // A client that wants parity says how long blocks may be; we start at
+    // the shortest, the most redundancy it asked for, and lengthen them
+    // while little is lost
+    const uint8_t* fec = syn.find_option(Packet::OPT_FEC, 2);
+    if (fec != nullptr)
+    {
+        fec_min_ = std::min(std::max((size_t)fec[0],
+                                     (size_t)FecDecoder::MIN_BLOCK),
+                            (size_t)FecDecoder::MAX_BLOCK);
+        fec_max_ = std::min(std::max(fec[1], fec_min_),
+                            (uint8_t)FecDecoder::MAX_BLOCK);
+        fec_block_ = fec_min_;
+    }
+    checksum_ok_ = syn.find_option(Packet::OPT_CHECKSUM, 0) != nullptr;
+    resume_ok_ = syn.find_option(Packet::OPT_RESUME, 0) != nullptr;
+    // A client that can inflate gets our part of the file deflated; if that
+    // can't be set up, it gets it as it is
+    const uint8_t* method = syn.find_option(Packet::OPT_COMPRESS, 1);
+    if (method != nullptr && *method == Packet::COMPRESS_DEFLATE)
+    {
+        try
+        {
+            compressor_.reset(new Compressor(file.data() + range_.start,
+                                             range_.size()));
+            file_pos_ = 0;
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+    }
+    // A client may ask for a ticket, or bring one it got before. A good one
+    // from an address whose path we remember gets the file straight away,
+    // in segments of the size settled last time. Resuming needs the
+    // handshake ACK, so it gets neither.
+    uint8_t ticket_len;
+    const uint8_t* ticket = syn.find_option_any(Packet::OPT_TICKET, ticket_len);
+    PathInfo path;
+    if (fast_open_ != nullptr && !resume_ok_ && ticket != nullptr &&
+            (ticket_len == 0 || ticket_len == sizeof(uint32_t)))
+    {
+        ticket_ok_ = true;
+        uint32_t theirs;
+        if (ticket_len == sizeof(theirs))
+        {
+            std::memcpy(&theirs, ticket, sizeof(theirs));
+            ticket_valid_ = ntohl(theirs) == fast_open_->ticket(peer_);
+        }
+        fast_ok_ = ticket_valid_ && fast_open_->recall(peer_, path);
+    }
+    if (fast_ok_)
+    {
+        set_mss(std::min(path.mss, probe_mss_));
+        probe_mss_ = Packet::MIN_MSS;
+    }
+    metrics.connections_opened.add();
+    send_syn_ack();
+    if (fast_ok_)
+    {
+        start_fast(syn, path);
+    }
+}
+
+void Connection::on_packet(const Packet& in)
+{
+    last_recv_ = now();
+    uint32_t tsecr = take_timestamp(in);
+    switch (state_)
+    {
+        case State::SYN_RCVD:
+        {
+            if (in.headers.syn)
+            {
+                // Our SYN-ACK was lost; the client is retrying
+                send_syn_ack();
+            }
+            else if (in.headers.ack && in.headers.ack_number == seq_)
+            {
+                // After probing, only the client's handshake ACK can tell us
+                // which probe got through; any other ack means it is still
+                // waiting for one, so probe again
+                size_t mss = in.get_mss();
+                if (probe_mss_ > Packet::MIN_MSS &&
+                        (mss < Packet::MIN_MSS || mss > probe_mss_))
+                {
+                    send_syn_ack();
+                    break;
+                }
+                if (!take_resume(in))
+                {
+                    state_ = State::CLOSED;
+                    break;
+                }
+                if (tsecr != 0)
+                {
+                    sample_rtt(since_timestamp(tsecr), now());
+                }
+                state_ = State::ESTABLISHED;
+                start_time_ = now();
+                set_mss(probe_mss_ > Packet::MIN_MSS ? mss : Packet::MIN_MSS);
+                // Size the ring for everything the client will let us have in
+                // flight, plus one for a partial segment
+                window_.reset(seq_, std::min((size_t)(peer_window(in) / mss_) + 1,
+                                             MAX_WINDOW_SLOTS), mss_);
+                clamp_cwnd(in);
+                send_file();
+            }
+            break;
+        }
+        case State::ESTABLISHED:
+        {
+            // Acks are only processed here; the event loop calls flush()
+            // once it has handed us every ack from a batch
+            if (in.headers.syn && fast_ok_)
+            {
+                // We opened fast but our SYN-ACK was lost, so the client
+                // is retrying; the data that followed is no use to it
+                // without one
+                send_syn_ack();
+            }
+            else if (in.headers.ack && !in.headers.syn)
+            {
+                on_ack(in, tsecr);
+                dirty_ = true;
+            }
+            break;
+        }
+        case State::FIN_SENT:
+        {
+            if (in.headers.ack && in.headers.fin &&
+                    in.headers.ack_number == add_seq(last_seq_, 1))
+            {
+                fin_ack_seq_ = in.headers.seq_number;
+                state_ = State::TIME_WAIT;
+                send_fin_ack_ack();
+            }
+            break;
+        }
+        case State::TIME_WAIT:
+        {
+            if (in.headers.fin && in.headers.ack)
+            {
+                // Our ACK was lost and the client retransmitted its FIN-ACK
+                send_fin_ack_ack();
+            }
+            else
+            {
+                state_ = State::CLOSED;
+            }
+            break;
+        }
+        case State::CLOSED:
+            break;
+    }
+}
+
+void Connection::on_timer()
+{
+    if (state_ != State::TIME_WAIT && now() - last_recv_ > idle_timeout)
+    {
+        std::cerr << "Connection " << conn_id_ << " timed out\n";
+        state_ = State::CLOSED;
+        return;
+    }
+    switch (state_)
+    {
+        case State::SYN_RCVD:
+            rtt_.backoff();
+            send_syn_ack();
+            break;
+        case State::ESTABLISHED:
+            // transmit() takes care of whatever timed out
+            send_file();
+            break;
+        case State::FIN_SENT:
+            rtt_.backoff();
+            send_fin();
+            break;
+        case State::TIME_WAIT:
+            // Client got our ack and went away
+            state_ = State::CLOSED;
+            break;
+        case State::CLOSED:
+            break;
+    }
+}
+
+void Connection::flush()
+{
+    if (dirty_ && state_ == State::ESTABLISHED)
+    {
+        send_file();
+    }
+    dirty_ = false;
+}
+
+void Connection::on_writable()
+{
+    blocked_ = false;
+    if (state_ == State::ESTABLISHED)
+    {
+        send_file();
+    }
+}
+
+Connection::time_point Connection::deadline() const
+{
+    time_point idle = last_recv_ + idle_timeout;
+    switch (state_)
+    {
+        case State::SYN_RCVD:
+        case State::FIN_SENT:
+            return std::min(idle, last_send_ + rtt_.rto());
+        case State::ESTABLISHED:
+            if (!timers_.empty())
+            {
+                idle = std::min(idle, timer_deadline(timers_.front()));
+            }
+            if (pacing_wait_)
+            {
+                idle = std::min(idle, pacer_.ready_at());
+            }
+            return idle;
+        case State::TIME_WAIT:
+            return last_send_ + close_timeout;
+        case State::CLOSED:
+            break;
+    }
+    return time_point::max();
+}
+
+/**
+ * Sends p (in host order) to the peer
+ *
+ * @return false if the packet could not be sent; blocked() is set if that
+ * was because the socket buffer is full
+ */
+bool Connection::send_packet(Packet& p, size_t len)
+{
+    p.headers.conn_id = conn_id_;
+    p.to_network();
+    ssize_t ret = sock_.sendto((void*)&p, len, 0, (sockaddr*)&peer_, peer_len_);
+    p.to_host();
+    if (ret < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        {
+            blocked_ = true;
+            return false;
+        }
+        std::cerr << "sendto(): " << std::strerror(errno) << std::endl;
+        state_ = State::CLOSED;
+        return false;
+    }
+    return true;
+}
+
+void Connection::send_syn_ack()
+{
+    Packet out;
+    out.headers.ack = out.headers.syn = true;
+    out.headers.ack_number = add_seq(client_seq_, 1);
+    out.headers.seq_number = isn_;
+    if (ts_ok_)
+    {
+        out.add_timestamp(timestamp(), ts_recent_);
+    }
+    if (wscale_ok_)
+    {
+        // We never receive data, so there is nothing for us to scale
+        uint8_t our_wscale = 0;
+        out.add_option(Packet::OPT_WSCALE, &our_wscale, 1);
+    }
+    if (sack_ok_)
+    {
+        out.add_option(Packet::OPT_SACK_PERMITTED, nullptr, 0);
+    }
+    // Lets the client allocate the whole file before any data arrives
+    uint64_t file_size = htobe64(file_.size());
+    out.add_option(Packet::OPT_FILE_SIZE, &file_size, sizeof(file_size));
+    if (streams_ > 0)
+    {
+        uint8_t streams[2] = { stream_, streams_ };
+        out.add_option(Packet::OPT_STREAMS, streams, sizeof(streams));
+    }
+    if (fec_min_ > 0)
+    {
+        uint8_t fec[2] = { fec_min_, fec_max_ };
+        out.add_option(Packet::OPT_FEC, fec, sizeof(fec));
+    }
+    if (checksum_ok_)
+    {
+        out.add_option(Packet::OPT_CHECKSUM, nullptr, 0);
+    }
+    if (compressor_)
+    {
+        uint8_t method = Packet::COMPRESS_DEFLATE;
+        out.add_option(Packet::OPT_COMPRESS, &method, sizeof(method));
+    }
+    // Which version of the file this is, for the client to check its
+    // record of what it has against
+    if (resume_ok_)
+    {
+        uint32_t fingerprint = htonl(file_.fingerprint());
+        out.add_option(Packet::OPT_RESUME, &fingerprint, sizeof(fingerprint));
+    }
+    // A good ticket is only echoed if it opened the connection fast, which
+    // is how the client knows not to wait for us to get its handshake ACK;
+    // otherwise it keeps the one it has
+    if (ticket_ok_ && (fast_ok_ || !ticket_valid_))
+    {
+        uint32_t ticket = htonl(fast_open_->ticket(peer_));
+        out.add_option(Packet::OPT_TICKET, &ticket, sizeof(ticket));
+    }
+    if (fast_ok_)
+    {
+        out.add_mss(mss_);
+    }
+    if (probe_mss_ > Packet::MIN_MSS)
+    {
+        // Probes go largest first, so on a path that keeps datagrams in
+        // order the first SYN-ACK to reach the client is the largest that
+        // fits; the unpadded one last says MIN_MSS, which always does
+        uint8_t opt_len = out.headers.opt_len;
+        size_t last = Packet::MIN_MSS;
+        for (size_t mtu : PROBE_MTUS)
+        {
+            size_t mss = std::min((size_t)probe_mss_, Packet::mss_for_mtu(mtu));
+            if (mss > Packet::MIN_MSS && mss != last)
+            {
+                out.headers.opt_len = opt_len;
+                out.add_mss(mss);
+                send_probe(out, mss);
+                last = mss;
+            }
+        }
+        out.headers.opt_len = opt_len;
+        out.add_mss(Packet::MIN_MSS);
+    }
+    send_packet(out, out.size());
+    last_send_ = now();
+}
+
+/**
+ * Starts sending the file right after the SYN-ACK, for a client whose
+ * ticket says it has been here before. The connection picks up from how
+ * the last one over the path ended: its RTT, and half its congestion
+ * window, since the path may have changed since. The client's acks say the
+ * SYN-ACK got through; if it didn't, the client sends its SYN again.
+ */
+void Connection::start_fast(const Packet& syn, const PathInfo& path)
+{
+    state_ = State::ESTABLISHED;
+    start_time_ = now();
+    metrics.fast_opens.add();
+    // Only the timeout starts from the cached RTT; it isn't a sample of this
+    // connection, so the histogram and the congestion control never see it
+    rtt_.seed(path.srtt);
+    // The SYN's window is never scaled, but the client picked the least
+    // shift its window fits under, so it takes at least half of what that
+    // shift can say; the ring has room for all of it
+    uint32_t limit = syn.headers.window_sz;
+    if (peer_wscale_ > 0)
+    {
+        limit = std::max(limit, (uint32_t)UINT16_MAX << (peer_wscale_ - 1));
+    }
+    window_.reset(seq_, std::min((size_t)((uint32_t)UINT16_MAX << peer_wscale_) /
+                                 mss_ + 1, MAX_WINDOW_SLOTS), mss_);
+    cc_->restore(path.cwnd / 2, path.ssthresh);
+    cwnd_limit_ = std::min(limit, (uint32_t)(window_.capacity() * mss_));
+    cc_->set_limit(cwnd_limit_);
+    // The restored window is the largest first flight any connection sends,
+    // so it is paced from the start rather than from the first ack
+    update_pacing_rate();
+    send_file();
+}
+
+/**
+ * Skips the front of range_ if the client's handshake ACK says it has it
+ * already (OPT_RESUME). Sequence numbers still count from the start of
+ * range_, so until the client gets a handshake ACK through, its acks
+ * (which are past it) don't pass for one, and we keep asking.
+ *
+ * @return false if the client asked for something we can't do
+ */
+bool Connection::take_resume(const Packet& in)
+{
+    const uint8_t* opt = in.find_option(Packet::OPT_RESUME, 12);
+    if (!resume_ok_ || opt == nullptr)
+    {
+        return true;
+    }
+    uint32_t fingerprint;
+    uint64_t offset;
+    std::memcpy(&fingerprint, opt, sizeof(fingerprint));
+    std::memcpy(&offset, opt + sizeof(fingerprint), sizeof(offset));
+    fingerprint = ntohl(fingerprint);
+    offset = be64toh(offset);
+    if (fingerprint != file_.fingerprint() || offset < range_.start ||
+            offset > range_.end)
+    {
+        std::cerr << "Connection " << conn_id_ << ": can't resume at byte "
+                  << offset << std::endl;
+        return false;
+    }
+    uint64_t skipped = offset - range_.start;
+    if (skipped > 0)
+    {
+        std::cerr << "Connection " << conn_id_ << ": resuming at byte "
+                  << offset << std::endl;
+    }
+    range_.start = offset;
+    file_pos_ = offset;
+    if (compressor_)
+    {
+        try
+        {
+            compressor_.reset(new Compressor(file_.data() + offset,
+                                             range_.size()));
+        }
+        catch (const std::runtime_error& e)
+        {
+            std::cerr << e.what() << std::endl;
+            return false;
+        }
+        file_pos_ = 0;
+    }
+    seq_ = last_seq_ = recover_ = add_seq(seq_, (uint32_t)skipped);
+    metrics.resumed_bytes.add(skipped);
+    return true;
+}
+
+/**
+ * Sends p (in host order) padded to the longest datagram a segment of mss
+ * bytes makes. A probe the path can't carry is simply lost; one too long
+ * for our own interface fails with EMSGSIZE, since IP_PMTUDISC_PROBE keeps
+ * the kernel from fragmenting it, and is dropped here the same way.
+ */
+void Connection::send_probe(Packet& p, size_t mss)
+{
+    size_t pad = Packet::datagram_size(mss) - p.size(false);
+    p.headers.conn_id = conn_id_;
+    p.headers.data_len = pad;
+    p.to_network();
+    iovec iov[2] = { { (void*)&p, p.size(false) }, { (void*)padding, pad } };
+    mmsghdr msg;
+    std::memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_name = (void*)&peer_;
+    msg.msg_hdr.msg_namelen = peer_len_;
+    msg.msg_hdr.msg_iov = iov;
+    msg.msg_hdr.msg_iovlen = 2;
+    if (sock_.sendmmsg(&msg, 1, 0) < 0 && errno != EMSGSIZE &&
+            errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS)
+    {
+        std::cerr << "sendmmsg(): " << std::strerror(errno) << std::endl;
+    }
+    p.to_host();
+    p.headers.data_len = 0;
+}
+
+/**
+ * Settles the segment size the file is sent in, once the handshake is done
+ */
+void Connection::set_mss(uint32_t mss)
+{
+    mss_ = mss;
+    metrics.mss.record(mss);
+    combine_crc_ = Crc32cCombiner(mss_);
+    // Every window the controller keeps is counted in segments
+    if (mss_ != cc_->mss())
+    {
+        cc_ = CongestionControl::create(cc_->name(), mss_);
+    }
+}
+
+/**
+ * Reads as much of the file as the congestion window allows into the send
+ * window and transmits whatever is due. Starts closing the connection once
+ * the whole file has been acked.
+ */
+void Connection::send_file()
+{
+    if (compressor_)
+    {
+        release_compressed();
+    }
+    // Only queue whole segments; SendWindow relies on every segment but the
+    // last being mss_ bytes
+    while (cwnd_used_ + mss_ <= cwnd() && !window_.full())
+    {
+        const char* data = file_.data();
+        uint64_t end = range_.end;
+        if (compressor_)
+        {
+            // Compressing as the window reaches the data, so only the
+            // first block waits for it
+            compressor_->produce(file_pos_ + mss_, pacer_.rate());
+            data = compressor_->data();
+            end = compressor_->size();
+        }
+        if (file_pos_ >= end)
+        {
+            break;
+        }
+        // Nothing is copied here: the slot just points at the segment's
+        // bytes in the mapping, or in the compressed stream
+        PacketWrapper& p = window_.next_slot();
+        p.payload = data + file_pos_;
+        p.seq_number = window_.end_seq();
+        p.data_len = std::min((uint64_t)mss_, end - file_pos_);
+        p.sent = p.retransmit = p.sacked = false;
+        if (checksum_ok_)
+        {
+            // Read once here, while the bytes are about to be sent anyway,
+            // and kept for retransmissions. The FIN's digest is of the file,
+            // which the compressor keeps if there is one.
+            p.crc = crc32c(0, p.payload, p.data_len);
+            if (!compressor_)
+            {
+                digest_ = p.data_len == mss_
+                        ? combine_crc_(digest_, p.crc)
+                        : crc32c_combine(digest_, p.crc, p.data_len);
+            }
+        }
+        file_pos_ += p.data_len;
+        window_.push_back();
+        cwnd_used_ += p.data_len;
+    }
+    if (window_.empty())
+    {
+        close_connection();
+        return;
+    }
+    transmit();
+    prune_timers();
+}
+
+/**
+ * Marks every segment whose timer has run out for retransmission, then sends
+ * retransmissions and new segments that fit in cwnd, a batch at a time
+ */
+void Connection::transmit()
+{
+    auto t = now();
+    bool timed_out = false;
+    while (!timers_.empty() && t >= timer_deadline(timers_.front()))
+    {
+        PacketWrapper* p = live_timer(timers_.front());
+        timers_.pop_front();
+        if (p != nullptr)
+        {
+            mark_retransmit(*p, metrics.timeout_retransmits);
+            timed_out = true;
+        }
+    }
+    // However many segments expired, it's one timeout as far as congestion
+    // control and the RTO are concerned
+    if (timed_out)
+    {
+        on_timeout();
+    }
+    pacing_wait_ = false;
+    while (!blocked_ && state_ == State::ESTABLISHED)
+    {
+        t = now();
+        // Retransmissions go first, oldest first. Ones that no longer fit in
+        // cwnd, or that the pacer holds back, stay queued.
+        size_t kept = 0;
+        size_t retransmits = 0;
+        for (size_t i = 0; i < rtx_queue_.size(); i++)
+        {
+            ssize_t idx = window_.index_of(rtx_queue_[i]);
+            if (idx < 0 || window_.at(idx).sent || window_.at(idx).sacked)
+            {
+                continue; // acked or already resent since
+            }
+            rtx_queue_[kept++] = rtx_queue_[i];
+            PacketWrapper& p = window_.at(idx);
+            if (!batch_.full() && fits_cwnd(p))
+            {
+                if (!pacer_.ready(t))
+                {
+                    pacing_wait_ = true;
+                    continue;
+                }
+                queue_segment(p, t);
+                retransmits++;
+            }
+        }
+        rtx_queue_.resize(kept);
+        // Then segments that have never been sent
+        for (size_t i = next_; i < window_.size() && !batch_.full(); i++)
+        {
+            PacketWrapper& p = window_.at(i);
+            if (!fits_cwnd(p))
+            {
+                break;
+            }
+            if (!pacer_.ready(t))
+            {
+                pacing_wait_ = true;
+                break;
+            }
+            queue_segment(p, t);
+        }
+        if (pending_.empty())
+        {
+            break;
+        }
+        flush_segments(retransmits);
+    }
+}
+
+/**
+ * True if all of p lies within cwnd bytes of the front of the window, not
+ * counting bytes the client has SACKed
+ */
+bool Connection::fits_cwnd(const PacketWrapper& p) const
+{
+    uint32_t end = add_seq(p.seq_number, p.data_len);
+    return end - window_.begin_seq() <= cwnd() + sacked_;
+}
+
+/**
+ * Adds a segment from the window to the batch being built by transmit() at
+ * time t
+ */
+void Connection::queue_segment(PacketWrapper& p, time_point t)
+{
+    Packet head;
+    head.headers.conn_id = conn_id_;
+    head.headers.seq_number = p.seq_number;
+    head.headers.data_len = p.data_len;
+    if (ts_ok_)
+    {
+        head.add_timestamp(timestamp(), ts_recent_);
+    }
+    if (checksum_ok_)
+    {
+        head.add_segment_checksum(p.crc);
+    }
+    batch_.add(head, p.payload, p.data_len, (const sockaddr*)&peer_, peer_len_,
+               pacer_.on_send(p.data_len, t));
+    pending_.push_back(&p);
+}
+
+/**
+ * Sends the batch built by transmit() and starts retransmission timers for
+ * whatever made it out
+ *
+ * @param retransmits how many of the pending segments are retransmissions;
+ * these are queued before any new segments
+ */
+void Connection::flush_segments(size_t retransmits)
+{
+    size_t sent = batch_.flush(sock_);
+    if (sent < pending_.size())
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+        {
+            blocked_ = true;
+        }
+        else
+        {
+            std::cerr << "sendmmsg(): " << std::strerror(errno) << std::endl;
+            state_ = State::CLOSED;
+        }
+    }
+    auto t = now();
+    // Nothing delivered while nothing was in flight, so don't count that
+    // idle time against the rate
+    if (in_flight_ == 0)
+    {
+        delivered_time_ = t;
+    }
+    for (size_t i = 0; i < sent; i++)
+    {
+        PacketWrapper& p = *pending_[i];
+        p.sent = true;
+        p.send_time = t;
+        p.delivered = delivered_;
+        p.delivered_time = delivered_time_;
+        in_flight_ += p.data_len;
+        timers_.push_back({ p.seq_number, p.send_time });
+        metrics.segments_sent.add();
+        metrics.bytes_sent.add(p.data_len);
+        if (p.retransmit)
+        {
+            metrics.segments_retransmitted.add();
+        }
+        Trace::record(TRACE_SEND_DATA, p.retransmit ? TRACE_RETRANSMIT : 0,
+                      conn_id_, p.seq_number, cwnd(), cc_->ssthresh(),
+                      pacer_.rate());
+    }
+    fec_sent_ += sent;
+    if (sent > retransmits)
+    {
+        next_ += sent - retransmits;
+        if (fec_min_ > 0)
+        {
+            send_parity(retransmits, sent);
+        }
+    }
+    pending_.clear();
+}
+
+/**
+ * Adds the new segments flush_segments() just sent, pending_[from, to), to
+ * the FEC block being built, and sends a parity segment for every block
+ * they complete. Parity isn't retransmitted or counted against cwnd, but
+ * the pacer does count it.
+ */
+void Connection::send_parity(size_t from, size_t to)
+{
+    // Room for every parity these segments could complete (the block
+    // already begun, whole ones and a short one at the end of the file),
+    // sized before any of it is queued so nothing queued moves
+    size_t room = std::min(to - from, (to - from) / fec_min_ + 2) * mss_;
+    if (parity_.size() < room)
+    {
+        parity_.resize(room);
+    }
+    size_t parities = 0;
+    auto t = now();
+    for (size_t i = from; i < to; i++)
+    {
+        PacketWrapper& p = *pending_[i];
+        if (fec_count_ == 0)
+        {
+            fec_seq_ = p.seq_number;
+            fec_data_ = p.payload;
+            fec_len_ = p.data_len;
+            fec_lengths_ = 0;
+        }
+        p.fec_block = fec_seq_;
+        fec_count_++;
+        fec_lengths_ ^= p.data_len;
+        // The part's last segment ends its block early
+        if (fec_count_ < fec_block_ && !last_segment(p))
+        {
+            continue;
+        }
+        // New segments are sent in order, so the block's segments lie side
+        // by side in the mapping, each mss_ long but the last
+        char* parity = &parity_[parities++ * mss_];
+        std::memcpy(parity, fec_data_, fec_len_);
+        for (size_t j = 1; j < fec_count_; j++)
+        {
+            xor_bytes(parity, fec_data_ + j * mss_,
+                      j + 1 == fec_count_ ? p.data_len : mss_);
+        }
+        Packet head;
+        head.headers.conn_id = conn_id_;
+        head.headers.seq_number = fec_seq_;
+        head.headers.data_len = fec_len_;
+        if (ts_ok_)
+        {
+            head.add_timestamp(timestamp(), ts_recent_);
+        }
+        head.add_parity(fec_count_, fec_lengths_);
+        if (checksum_ok_)
+        {
+            head.add_segment_checksum(crc32c(0, parity, fec_len_));
+        }
+        batch_.add(head, parity, fec_len_, (const sockaddr*)&peer_, peer_len_,
+                   pacer_.on_send(fec_len_, t));
+        metrics.fec_block.record(fec_count_);
+        fec_count_ = 0;
+        update_fec_block();
+    }
+    if (parities > 0)
+    {
+        // Parity is only worth anything right away, so if the socket is
+        // full it's dropped rather than queued
+        size_t sent = batch_.flush(sock_);
+        metrics.parity_sent.add(sent);
+        if (sent < parities &&
+                (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+        {
+            blocked_ = true;
+        }
+    }
+}
+
+/**
+ * True if p is the last segment of our part of the file
+ */
+bool Connection::last_segment(const PacketWrapper& p) const
+{
+    const char* end = p.payload + p.data_len;
+    if (compressor_)
+    {
+        return compressor_->done() &&
+               end == compressor_->data() + compressor_->size();
+    }
+    return end == file_.data() + range_.end;
+}
+
+/**
+ * Gives back the memory of the compressed stream that nothing will send
+ * again: everything before the window, and before the FEC block being
+ * built, whose parity is still to be computed from it
+ */
+void Connection::release_compressed()
+{
+    if (window_.empty())
+    {
+        return;
+    }
+    const char* keep = window_.at(0).payload;
+    if (fec_count_ > 0)
+    {
+        keep = std::min(keep, fec_data_);
+    }
+    compressor_->release(keep - compressor_->data());
+}
+
+/**
+ * Resizes FEC blocks for the share of segments being lost: shorter ones,
+ * with more parity, when more is lost, and longer ones when less is
+ */
+void Connection::update_fec_block()
+{
+    // A few losses over a handful of segments says little, so only sample
+    // the rate over a block's worth of the longest blocks
+    if (fec_sent_ >= FecDecoder::MAX_BLOCK)
+    {
+        double sample = (double)fec_lost_ / fec_sent_;
+        loss_rate_ += (sample - loss_rate_) / 8;
+        fec_sent_ = fec_lost_ = 0;
+    }
+    fec_block_ = fec_block(loss_rate_, fec_min_, fec_max_);
+}
+
+/**
+ * Queues a sent segment to be sent again
+ *
+ * @param reason counts it, if it wasn't queued already
+ */
+void Connection::mark_retransmit(PacketWrapper& p, Counter& reason)
+{
+    if (p.sent)
+    {
+        reason.add();
+        p.sent = false;
+        p.retransmit = true;
+        in_flight_ -= p.data_len;
+        fec_lost_++;
+        rtx_queue_.push_back(p.seq_number);
+    }
+}
+
+/**
+ * @return the segment a timer entry is for, or nullptr if the entry is stale
+ * because the segment has been acked or sent again since
+ */
+PacketWrapper* Connection::live_timer(const Timer& timer)
+{
+    ssize_t idx = window_.index_of(timer.seq);
+    if (idx < 0)
+    {
+        return nullptr;
+    }
+    PacketWrapper& p = window_.at(idx);
+    if (!p.sent || p.sacked || p.send_time != timer.send_time)
+    {
+        return nullptr;
+    }
+    return &p;
+}
+
+/**
+ * When a retransmission timer runs out: one RTO after the segment was sent,
+ * but like TCP's single timer, never sooner than one RTO after the last ack
+ * that acknowledged new data, so a burst of data delayed behind a hole isn't
+ * declared lost while acks are still arriving
+ */
+Connection::time_point Connection::timer_deadline(const Timer& timer) const
+{
+    return std::max(timer.send_time, last_progress_) + rtt_.rto();
+}
+
+/**
+ * Drops stale entries from the front of the timer queue so its front is the
+ * earliest live retransmission deadline
+ */
+void Connection::prune_timers()
+{
+    while (!timers_.empty() && live_timer(timers_.front()) == nullptr)
+    {
+        timers_.pop_front();
+    }
+}
+
+/**
+ * Remembers the client's timestamp from a packet so we echo it back
+ *
+ * @return the timestamp of ours the packet echoes, or 0 if it has none
+ */
+uint32_t Connection::take_timestamp(const Packet& in)
+{
+    uint32_t tsval, tsecr;
+    if (!ts_ok_ || !in.get_timestamp(tsval, tsecr))
+    {
+        return 0;
+    }
+    ts_recent_ = tsval;
+    return tsecr;
+}
+
+/**
+ * Feeds a round trip time measurement to the RTO estimator and the
+ * congestion control
+ */
+void Connection::sample_rtt(RttEstimator::duration rtt, time_point t)
+{
+    rtt_.sample(rtt, t);
+    cc_->on_rtt(rtt, t);
+    metrics.rtt.record(std::chrono::duration_cast<std::chrono::microseconds>(
+            rtt).count());
+}
+
+/**
+ * @param tsecr the timestamp the ack echoes, or 0 if it has none
+ */
+void Connection::on_ack(const Packet& in, uint32_t tsecr)
+{
+    Trace::record(TRACE_RECV_ACK, 0, conn_id_, in.headers.ack_number);
+    auto t = now();
+    // An echoed timestamp says exactly which transmission was acked, so it
+    // is a good sample even for duplicate acks and retransmissions
+    if (tsecr != 0)
+    {
+        sample_rtt(since_timestamp(tsecr), t);
+    }
+    // Segments the client rebuilt were lost all the same, as far as sizing
+    // FEC blocks goes
+    const uint8_t* repairs = in.find_option(Packet::OPT_FEC, sizeof(uint32_t));
+    if (fec_min_ > 0 && repairs != nullptr)
+    {
+        uint32_t n;
+        std::memcpy(&n, repairs, sizeof(n));
+        n = be32toh(n);
+        if (seq_lt(fec_repairs_, n))
+        {
+            fec_lost_ += n - fec_repairs_;
+            fec_repairs_ = n;
+        }
+    }
+    uint64_t delivered_before = delivered_;
+    rate_valid_ = false;
+    bool lost = sack_ok_ && on_sack(in, t);
+    ssize_t acked = window_.index_ending_at(in.headers.ack_number);
+    if (acked < 0)
+    {
+        if (window_.empty())
+        {
+            return;
+        }
+        metrics.duplicate_acks.add();
+        if (in_recovery_)
+        {
+            // With SACK the holes are already queued and SACKed bytes have
+            // left cwnd_used_, so there's nothing to inflate or resend here
+            if (!sack_ok_)
+            {
+                inflation_ += mss_;
+                mark_retransmit(window_.front(), metrics.fast_retransmits);
+            }
+        }
+        else if (lost || (!sack_ok_ && ++duplicate_acks_ == 3))
+        {
+            enter_fast_recovery();
+        }
+        on_cc_ack(ack_sample(t, delivered_before, true));
+        clamp_cwnd(in);
+        update_pacing_rate();
+        return;
+    }
+    last_seq_ = in.headers.ack_number;
+    last_progress_ = t;
+    // With SACK a partial ack just means the next hole's retransmission is on
+    // its way
+    bool recovered = in_recovery_ && !(sack_ok_ && seq_lt(last_seq_, recover_));
+    duplicate_acks_ = 0;
+    // SACKed segments were already taken out of cwnd_used_
+    uint32_t popped_sacked = 0;
+    bool resent = false;
+    for (ssize_t i = 0; i <= acked; i++)
+    {
+        const PacketWrapper& p = window_.at(i);
+        if (p.sacked)
+        {
+            popped_sacked += p.data_len;
+        }
+        else
+        {
+            deliver(p, t);
+        }
+        resent |= p.retransmit;
+    }
+    // Without timestamps, time the newest segment acked; Karn's rule: not if
+    // anything acked was retransmitted, since we can't tell which copy the
+    // client got and the ack may have been waiting on a hole
+    if (tsecr == 0 && !resent && window_.at(acked).sent)
+    {
+        sample_rtt(std::chrono::duration_cast<RttEstimator::duration>(
+                t - window_.at(acked).send_time), t);
+    }
+    sacked_ -= popped_sacked;
+    cwnd_used_ -= window_.pop_front(acked + 1) - popped_sacked;
+    next_ = next_ > (size_t)acked + 1 ? next_ - (acked + 1) : 0;
+    sack_high_ = sack_high_ > (size_t)acked + 1 ? sack_high_ - (acked + 1) : 0;
+    lost_to_ = lost_to_ > (size_t)acked + 1 ? lost_to_ - (acked + 1) : 0;
+    on_cc_ack(ack_sample(t, delivered_before, false));
+    if (recovered)
+    {
+        in_recovery_ = false;
+        inflation_ = 0;
+        cc_->on_recovery_end(t);
+        metrics.recoveries_exited.add();
+    }
+    clamp_cwnd(in);
+    update_pacing_rate();
+}
+
+/**
+ * Updates the scoreboard from the SACK blocks in an ack
+ *
+ * @return true if that showed new segments to be lost
+ */
+bool Connection::on_sack(const Packet& in, time_point t)
+{
+    SackBlock blocks[Packet::MAX_SACK_BLOCKS];
+    size_t n = in.get_sack(blocks);
+    for (size_t b = 0; b < n; b++)
+    {
+        ssize_t first = window_.index_of(blocks[b].start);
+        ssize_t last = window_.index_ending_at(blocks[b].end);
+        if (first < 0 || last < first ||
+                window_.at(first).seq_number != blocks[b].start)
+        {
+            continue;
+        }
+        // Mark inwards from both ends, stopping at segments we already knew
+        // about. The client puts each segment it receives at the start of
+        // the first block of the ack it sends for it, so the middle of a long
+        // block has been reported before; this keeps the work per ack down
+        // to what is new.
+        ssize_t i = first;
+        for (; i <= last && !window_.at(i).sacked; i++)
+        {
+            mark_sacked(window_.at(i), i, t);
+        }
+        for (ssize_t j = last; j > i && !window_.at(j).sacked; j--)
+        {
+            mark_sacked(window_.at(j), j, t);
+        }
+    }
+    return mark_lost();
+}
+
+void Connection::mark_sacked(PacketWrapper& p, size_t idx, time_point t)
+{
+    p.sacked = true;
+    sacked_ += p.data_len;
+    cwnd_used_ -= p.data_len;
+    sack_high_ = std::max(sack_high_, idx + 1);
+    deliver(p, t);
+}
+
+/**
+ * Counts a segment the client newly acked or SACKed as delivered, and takes
+ * it for the ack's rate sample if it's the most recently sent one so far
+ */
+void Connection::deliver(const PacketWrapper& p, time_point t)
+{
+    metrics.segments_acked.add();
+    metrics.bytes_acked.add(p.data_len);
+    delivered_ += p.data_len;
+    delivered_time_ = t;
+    // A segment marked for retransmission already left in_flight_, but its
+    // send fields still describe the copy that made it
+    if (p.sent)
+    {
+        in_flight_ -= p.data_len;
+    }
+    else if (!p.retransmit)
+    {
+        return;
+    }
+    if (!rate_valid_ || p.send_time > rate_send_time_)
+    {
+        rate_valid_ = true;
+        rate_send_time_ = p.send_time;
+        rate_delivered_ = p.delivered;
+        rate_delivered_time_ = p.delivered_time;
+    }
+}
+
+/**
+ * Describes the ack being handled for the congestion control
+ */
+AckSample Connection::ack_sample(time_point t, uint64_t delivered_before,
+                                 bool duplicate)
+{
+    AckSample ack;
+    ack.time = t;
+    ack.acked = delivered_ - delivered_before;
+    ack.duplicate = duplicate;
+    ack.in_flight = in_flight_;
+    ack.delivered = delivered_;
+    ack.prior_delivered = rate_valid_ ? rate_delivered_ : delivered_;
+    ack.delivery_rate = 0;
+    // The interval runs from the last delivery before the segment was sent,
+    // so it is never shorter than the segment's own round trip
+    auto interval = std::chrono::duration<double>(t - rate_delivered_time_).count();
+    if (rate_valid_ && interval > 0)
+    {
+        ack.delivery_rate = (delivered_ - rate_delivered_) / interval;
+    }
+    return ack;
+}
+
+/**
+ * Like TCP (RFC 6675), takes a segment as lost once the client has SACKed
+ * three segments above it, and queues it for retransmission
+ *
+ * @return true if any segment was newly found lost
+ */
+bool Connection::mark_lost()
+{
+    // Find the third SACKed segment from the top; every hole below it is lost
+    size_t found = 0;
+    size_t i = sack_high_;
+    while (i > lost_to_ && found < 3)
+    {
+        if (window_.at(--i).sacked)
+        {
+            found++;
+        }
+    }
+    if (found < 3)
+    {
+        return false;
+    }
+    // With FEC, a hole's block's parity may yet rebuild it, so it is only
+    // lost once three segments past that parity are SACKed: holes in the
+    // same block as the third one stay for now
+    if (fec_min_ > 0)
+    {
+        ssize_t block = window_.index_of(window_.at(i).fec_block);
+        i = std::max(block < 0 ? lost_to_ : (size_t)block, lost_to_);
+    }
+    bool lost = false;
+    for (; lost_to_ < i; lost_to_++)
+    {
+        PacketWrapper& p = window_.at(lost_to_);
+        if (!p.sacked && p.sent)
+        {
+            mark_retransmit(p, metrics.fast_retransmits);
+            lost = true;
+        }
+    }
+    return lost;
+}
+
+/**
+ * Starts fast recovery after a loss; the congestion control decides how much
+ * to cut cwnd
+ */
+void Connection::enter_fast_recovery()
+{
+    duplicate_acks_ = 0;
+    in_recovery_ = true;
+    metrics.recoveries_entered.add();
+    if (sack_ok_)
+    {
+        // mark_lost() already queued the holes
+        recover_ = window_.end_seq();
+    }
+    else
+    {
+        // The three duplicate acks were for segments that left the network
+        mark_retransmit(window_.front(), metrics.fast_retransmits);
+        inflation_ = 3 * mss_;
+    }
+    cc_->on_loss(now());
+}
+
+/**
+ * Hands an ack to the congestion control, noting what it did to cwnd
+ */
+void Connection::on_cc_ack(const AckSample& ack)
+{
+    bool slow_start = in_slow_start();
+    cc_->on_ack(ack);
+    if (slow_start && !in_slow_start())
+    {
+        metrics.slow_start_exits.add();
+    }
+    metrics.cwnd.record(cwnd());
+}
+
+/**
+ * True while cwnd is below ssthresh; congestion controls without one, like
+ * BBR, are never in slow start by this measure
+ */
+bool Connection::in_slow_start() const
+{
+    uint32_t ssthresh = cc_->ssthresh();
+    return ssthresh != 0 && cwnd() < ssthresh;
+}
+
+/**
+ * Keeps cwnd within what the client will accept and what the ring can hold
+ */
+void Connection::clamp_cwnd(const Packet& in)
+{
+    cwnd_limit_ = std::min(peer_window(in),
+                           (uint32_t)(window_.capacity() * mss_));
+    cc_->set_limit(cwnd_limit_);
+}
+
+/**
+ * The congestion window in bytes: the congestion control's, plus whatever
+ * Reno-style fast recovery inflated it by as far as the limit allows
+ */
+uint32_t Connection::cwnd() const
+{
+    uint32_t cwnd = cc_->cwnd();
+    return std::max(std::min(cwnd + inflation_, cwnd_limit_), cwnd);
+}
+
+/**
+ * Paces at the congestion control's rate, or else spreads cwnd over a round
+ * trip, a little faster so pacing itself never holds the window back (and
+ * twice as fast in slow start, where cwnd doubles every round trip). Nothing
+ * is paced until there is an RTT, sampled or (when opened fast) seeded.
+ */
+void Connection::update_pacing_rate()
+{
+    double rate = cc_->pacing_rate();
+    if (rate <= 0 && rtt_.srtt().count() > 0)
+    {
+        double gain = in_slow_start() ? PACING_SS_GAIN : PACING_CA_GAIN;
+        rate = gain * cwnd() / std::chrono::duration<double>(rtt_.srtt()).count();
+    }
+    pacer_.set_rate(rate);
+}
+
+/**
+ * The receive window the client advertised in an ack, in bytes
+ */
+uint32_t Connection::peer_window(const Packet& in) const
+{
+    return (uint32_t)in.headers.window_sz << peer_wscale_;
+}
+
+/**
+ * Segments timed out (and were marked for retransmission): back off the RTO
+ * and leave fast recovery; the congestion control starts over
+ */
+void Connection::on_timeout()
+{
+    rtt_.backoff();
+    in_recovery_ = false;
+    inflation_ = 0;
+    cc_->on_timeout(now());
+    metrics.timeouts.add();
+    update_pacing_rate();
+}
+
+void Connection::close_connection()
+{
+    double secs = std::chrono::duration<double>(now() - start_time_).count();
+    if (secs > 0)
+    {
+        metrics.goodput.record(range_.size() / secs);
+    }
+    metrics.transfers_completed.add();
+    std::cerr << "Connection " << conn_id_;
+    if (streams_ > 1)
+    {
+        std::cerr << " (stream " << (unsigned)stream_ + 1 << "/"
+                  << (unsigned)streams_ << ")";
+    }
+    std::cerr << ": " << cc_->name() << ", mss " << mss_ << ", ";
+    if (fec_min_ > 0)
+    {
+        std::cerr << "fec block " << fec_block_ << " at loss "
+                  << loss_rate_ * 100 << "%, ";
+    }
+    if (compressor_)
+    {
+        metrics.compressed_blocks.add(compressor_->compressed_blocks());
+        metrics.stored_blocks.add(compressor_->stored_blocks());
+        std::cerr << *compressor_ << ", ";
+    }
+    if (fast_ok_)
+    {
+        std::cerr << "fast open, ";
+    }
+    std::cerr << pacer_ << ", " << rtt_ << std::endl;
+    // For the client's next connection, if it holds a ticket
+    if (ticket_ok_)
+    {
+        fast_open_->remember(peer_, PathInfo{ rtt_.srtt(), cc_->cwnd(),
+                                              cc_->ssthresh(), mss_ });
+    }
+    state_ = State::FIN_SENT;
+    send_fin();
+}
+
+void Connection::send_fin()
+{
+    Packet out;
+    out.headers.fin = true;
+    out.headers.seq_number = last_seq_;
+    if (ts_ok_)
+    {
+        out.add_timestamp(timestamp(), ts_recent_);
+    }
+    if (checksum_ok_)
+    {
+        out.add_checksum(compressor_ ? compressor_->crc() : digest_);
+    }
+    send_packet(out, out.size());
+    last_send_ = now();
+}
+
+void Connection::send_fin_ack_ack()
+{
+    Packet out;
+    out.headers.ack = true;
+    out.headers.seq_number = add_seq(last_seq_, 1);
+    out.headers.ack_number = add_seq(fin_ack_seq_, 1);
+    if (ts_ok_)
+    {
+        out.add_timestamp(timestamp(), ts_recent_);
+    }
+    send_packet(out, out.size());
+    last_send_ = now();
+}
@@ -0,0 +1,265 @@
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "Batch.h"                      // for SendBatch
+#include "Checksum.h"                   // for Crc32cCombiner
+#include "Compress.h"                   // for Compressor
+#include "CongestionControl.h"          // for CongestionControl
+#include "FastOpen.h"                   // for FastOpen, PathInfo
+#include "MappedFile.h"                 // for MappedFile
+#include "Metrics.h"                    // for Counter
+#include "Packet.h"                     // for Packet, PacketWrapper, ByteRange
+#include "Pacer.h"                      // for Pacer
+#include "RttEstimator.h"               // for RttEstimator
+#include "SendWindow.h"                 // for SendWindow
+#include "Socket.h"                     // for Socket
+
+#include <cstdint>                      // for uint16_t, uint32_t
+#include <deque>                        // for deque
+#include <memory>                       // for unique_ptr
+#include <string>                       // for string
+#include <vector>                       // for vector
+
+#include <sys/socket.h>                 // for sockaddr_storage, socklen_t
+
+/**
+ * Server-side state machine for a single client transfer.
+ *
+ * The server's event loop owns one of these per (peer address, connection ID)
+ * and feeds it every datagram for that pair through on_packet(). Nothing in
+ * here blocks: instead of waiting in recv() with SO_RCVTIMEO like the old
+ * single-client server did, a connection reports the next time it needs
+ * attention through deadline() and the event loop calls on_timer() then.
+ */
+class Connection
+{
+public:
+    using time_point = PacketWrapper::time_point;
+
+    enum class State {
+        SYN_RCVD,    // sent SYN-ACK, waiting for the handshake ACK
+        ESTABLISHED, // sending the file
+        FIN_SENT,    // sent FIN, waiting for the client's FIN-ACK
+        TIME_WAIT,   // acked the FIN-ACK, absorbing retransmissions of it
+        CLOSED       // finished (or failed); the event loop may reap us
+    };
+
+    /**
+     * @param sock the (shared, non-blocking) socket to send on
+     * @param batch the (shared) batch to send data segments through
+     * @param peer the client's address
+     * @param peer_len length of peer
+     * @param syn the client's SYN, in host order
+     * @param file the file to send
+     * @param cc the congestion control algorithm to use unless the client
+     * asks for another one it knows
+     * @param max_streams the most streams we let a client split the file
+     * across (OPT_STREAMS)
+     * @param max_mss the largest segment we probe the path for (OPT_MSS);
+     * Packet::MIN_MSS turns probing off
+     * @param fast_open issues and checks tickets (OPT_TICKET), and keeps the
+     * paths they open; nullptr turns fast open off
+     */
+    Connection(Socket& sock, SendBatch& batch, const sockaddr_storage& peer,
+               socklen_t peer_len, const Packet& syn, const MappedFile& file,
+               const std::string& cc, unsigned max_streams = 1,
+               size_t max_mss = Packet::MAX_MSS, FastOpen* fast_open = nullptr);
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    /**
+     * Handles a datagram (already converted to host order) from our peer
+     */
+    void on_packet(const Packet& in);
+
+    /**
+     * Sends whatever the packets handed to on_packet() since the last call
+     * made sendable. The event loop calls this once per batch of datagrams,
+     * so a burst of acks turns into one sendmmsg() rather than one per ack.
+     */
+    void flush();
+
+    /**
+     * Called by the event loop once deadline() has passed
+     */
+    void on_timer();
+
+    /**
+     * Called by the event loop when the socket is writable again after a
+     * send() from this connection returned EAGAIN
+     */
+    void on_writable();
+
+    /**
+     * The next time on_timer() should be called
+     */
+    time_point deadline() const;
+
+    State state() const { return state_; }
+    bool blocked() const { return blocked_; }
+    // round trip time and retransmission timeout estimates
+    const RttEstimator& rtt() const { return rtt_; }
+    const CongestionControl& congestion_control() const { return *cc_; }
+    // the segment size, once the handshake is done
+    uint32_t mss() const { return mss_; }
+    const Pacer& pacer() const { return pacer_; }
+
+private:
+    // A retransmission deadline. Timers are queued in the order segments are
+    // sent, and every segment has the same timeout (whatever the RTO is when
+    // we check), so the queue is also in deadline order. Entries for segments
+    // that were acked or resent since are left in place and skipped when they
+    // reach the front.
+    struct Timer
+    {
+        uint32_t seq;
+        time_point send_time;
+    };
+
+    bool send_packet(Packet& p, size_t len);
+    void send_syn_ack();
+    void start_fast(const Packet& syn, const PathInfo& path);
+    void send_probe(Packet& p, size_t mss);
+    void set_mss(uint32_t mss);
+    void send_file();
+    void transmit();
+    bool fits_cwnd(const PacketWrapper& p) const;
+    void queue_segment(PacketWrapper& p, time_point t);
+    void flush_segments(size_t retransmits);
+    void send_parity(size_t from, size_t to);
+    void update_fec_block();
+    bool take_resume(const Packet& in);
+    bool last_segment(const PacketWrapper& p) const;
+    void release_compressed();
+    void mark_retransmit(PacketWrapper& p, Counter& reason);
+    PacketWrapper* live_timer(const Timer& timer);
+    time_point timer_deadline(const Timer& timer) const;
+    void prune_timers();
+    uint32_t take_timestamp(const Packet& in);
+    void sample_rtt(RttEstimator::duration rtt, time_point t);
+    void on_ack(const Packet& in, uint32_t tsecr);
+    bool on_sack(const Packet& in, time_point t);
+    void mark_sacked(PacketWrapper& p, size_t idx, time_point t);
+    void deliver(const PacketWrapper& p, time_point t);
+    AckSample ack_sample(time_point t, uint64_t delivered_before, bool duplicate);
+    bool mark_lost();
+    void on_cc_ack(const AckSample& ack);
+    bool in_slow_start() const;
+    void enter_fast_recovery();
+    void on_timeout();
+    void clamp_cwnd(const Packet& in);
+    uint32_t cwnd() const;
+    void update_pacing_rate();
+    uint32_t peer_window(const Packet& in) const;
+    void close_connection();
+    void send_fin();
+    void send_fin_ack_ack();
+
+    Socket& sock_;
+    SendBatch& batch_;
+    sockaddr_storage peer_;
+    socklen_t peer_len_;
+    uint16_t conn_id_;
+    uint32_t client_seq_;   // the client's ISN, from its SYN
+    uint32_t isn_;          // our ISN
+    bool wscale_ok_;        // the client negotiated window scaling
+    uint8_t peer_wscale_;   // shift to apply to the client's window_sz
+    bool sack_ok_;          // the client negotiated SACK blocks
+    bool ts_ok_;            // the client negotiated timestamps
+    uint32_t ts_recent_;    // the client's latest timestamp, to echo
+    RttEstimator rtt_;
+    State state_;
+    bool blocked_;
+    bool dirty_;            // got acks since the last flush()
+    time_point last_send_;  // last control packet we sent
+    time_point last_recv_;  // last time we heard from the peer
+    time_point last_progress_; // last time an ack acknowledged new data
+    time_point start_time_; // when the handshake completed
+
+    // Transfer state; this is what used to live on send_file()'s stack
+    const MappedFile& file_;
+    uint8_t stream_;        // our index among the client's streams,
+    uint8_t streams_;       // out of this many, or 0 if it didn't ask
+    ByteRange range_;       // the part of file_ we send: all of it, unless
+                            // the client split it across streams
+    // range_ compressed (OPT_COMPRESS), if the client asked for that; it is
+    // what is sent then, and file_pos_ counts bytes of it
+    std::unique_ptr<Compressor> compressor_;
+    size_t file_pos_;       // offset of the first byte not yet in window_
+    uint32_t mss_;          // how long every segment but the last is
+    uint32_t probe_mss_;    // the largest segment the handshake probes for,
+                            // or MIN_MSS if it doesn't
+    std::unique_ptr<CongestionControl> cc_;
+    uint32_t cwnd_limit_;   // the most the client and window_ can take
+    uint32_t cwnd_used_;    // bytes in window_ the client hasn't SACKed
+    uint32_t in_flight_;    // bytes sent and not yet acked, SACKed or lost
+    bool in_recovery_;
+    uint32_t inflation_;    // cwnd added per duplicate ack in fast recovery
+                            // without SACK, as Reno does
+    uint32_t duplicate_acks_;
+    Pacer pacer_;
+    bool pacing_wait_;      // transmit() left segments for the pacer to send
+    SendWindow window_;
+    size_t next_;           // index in window_ of the first never-sent segment
+    std::vector<uint32_t> rtx_queue_; // seqs of segments awaiting retransmit
+    std::deque<Timer> timers_;
+    std::vector<PacketWrapper*> pending_; // segments queued in batch_
+    uint32_t seq_;          // sequence number of the first byte of the file
+    uint32_t last_seq_;     // highest cumulative ack so far
+
+    // SACK scoreboard; the per-segment part is PacketWrapper::sacked
+    uint32_t sacked_;       // bytes in window_ the client has SACKed
+    size_t sack_high_;      // index in window_ just past the highest SACKed segment
+    size_t lost_to_;        // index in window_ below which holes were marked lost
+    uint32_t recover_;      // fast recovery lasts until this is acked
+
+    // Delivery rate sampling, as in TCP: every segment remembers how much had
+    // been delivered when it was sent, so when it's acked the difference over
+    // the time in between is the rate the path delivered at meanwhile
+    uint64_t delivered_;    // bytes acked or SACKed so far
+    time_point delivered_time_; // when delivered_ last went up
+    bool rate_valid_;       // the ack being handled delivered a sent segment
+    time_point rate_send_time_; // the newest such segment's send time,
+    uint64_t rate_delivered_;   // and delivered_ and delivered_time_ as of
+    time_point rate_delivered_time_; // when it was sent
+
+    // Forward error correction (OPT_FEC): every block of fec_block_ new
+    // segments sent is followed by a parity segment, their XOR
+    uint8_t fec_min_;       // the block lengths the client agreed to, or 0
+    uint8_t fec_max_;       // if it didn't ask for parity
+    size_t fec_block_;      // how long blocks are now, going by loss_rate_
+    double loss_rate_;      // smoothed share of segments sent that were lost
+    uint32_t fec_sent_;     // segments sent and marked for retransmission
+    uint32_t fec_lost_;     // or rebuilt since loss_rate_ was last updated
+    uint32_t fec_repairs_;  // segments the client has rebuilt, as of its
+                            // latest ack that said
+    size_t fec_count_;      // segments sent in the block being built,
+    uint32_t fec_seq_;      // the first one's sequence number,
+    const char* fec_data_;  // where it starts in the mapping,
+    uint16_t fec_len_;      // its length, which no later one is longer than,
+    uint16_t fec_lengths_;  // and all their lengths XORed together
+    std::vector<char> parity_; // parity payloads queued in batch_
+
+    // End-to-end checksums (OPT_CHECKSUM): every segment carries the CRC32C
+    // of its payload, and the FIN that of the whole range
+    bool checksum_ok_;      // the client asked for them
+    Crc32cCombiner combine_crc_; // appends an mss_-long segment's CRC
+    uint32_t digest_;       // the CRC32C of range_ up to file_pos_
+
+    // The client can resume (OPT_RESUME): range_ starts where it left off,
+    // once its handshake ACK says where that is
+    bool resume_ok_;
+
+    // Fast open (OPT_TICKET)
+    FastOpen* fast_open_;
+    bool ticket_ok_;        // the client takes tickets; we remember its path
+    bool ticket_valid_;     // the one it brought is the one we'd issue
+    bool fast_ok_;          // its ticket is good, so the file followed our
+                            // SYN-ACK without waiting for the handshake ACK
+
+    // Closing state
+    uint32_t fin_ack_seq_;  // seq number of the client's FIN-ACK
+};
+
+#endif
@@ -0,0 +1,175 @@
+#include "Dispatcher.h"
+
+#include "Metrics.h"                    // for Gauge
+
+#include <cerrno>                       // for errno, EAGAIN, EINTR
+#include <cstring>                      // for strerror
+#include <iostream>                     // for cerr
+#include <vector>                       // for vector
+
+#include <netinet/in.h>                 // for sockaddr_in
+#include <sys/socket.h>                 // for AF_INET, MSG_DONTWAIT
+
+/*
+ * Static Variables
+ */
+// connections in every worker's table right now
+static Gauge active_connections("active_connections");
+
+/*
+ * Implementations
+ */
+Dispatcher::Dispatcher(Socket& sock, const MappedFile& file,
+                       const ServerConfig& config, FastOpen* fast_open,
+                       SendBatch& batch, RecvBatch& rbatch) :
+    sock_(sock), file_(file), config_(config), fast_open_(fast_open),
+    batch_(batch), rbatch_(rbatch)
+{
+}
+
+Dispatcher::~Dispatcher()
+{
+    active_connections.add(-(int64_t)conns_.size());
+}
+
+void Dispatcher::handle_datagrams()
+{
+    std::vector<ConnKey> touched;
+    while (true)
+    {
+        int n = rbatch_.recv(sock_, MSG_DONTWAIT);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                std::cerr << "recvmmsg(): " << std::strerror(errno) << std::endl;
+            }
+            return;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            Packet& in = rbatch_.packet(i);
+            const sockaddr_storage& client_storage = rbatch_.addr(i);
+            if (!in.valid(rbatch_.length(i)) ||
+                    client_storage.ss_family != AF_INET)
+            {
+                continue;
+            }
+            in.to_host();
+            const sockaddr_in* sin = (const sockaddr_in*)&client_storage;
+            ConnKey key = { sin->sin_addr.s_addr, sin->sin_port, in.headers.conn_id };
+            auto it = conns_.find(key);
+            if (it == conns_.end())
+            {
+                if (!in.headers.syn || in.headers.ack)
+                {
+                    continue;
+                }
+                ConnEntry entry;
+                entry.conn.reset(new Connection(sock_, batch_, client_storage,
+                                                rbatch_.addr_len(i), in, file_,
+                                                config_.cc, config_.max_streams,
+                                                config_.max_mss, fast_open_));
+                entry.timer = timers_.end();
+                it = conns_.emplace(key, std::move(entry)).first;
+                active_connections.add(1);
+            }
+            else
+            {
+                it->second.conn->on_packet(in);
+            }
+            if (!it->second.touched)
+            {
+                it->second.touched = true;
+                touched.push_back(key);
+            }
+        }
+        for (auto& key : touched)
+        {
+            ConnEntry& entry = conns_[key];
+            entry.touched = false;
+            entry.conn->flush();
+            reschedule(key);
+        }
+        touched.clear();
+        if (n < (int)rbatch_.capacity())
+        {
+            return; // drained the socket
+        }
+    }
+}
+
+void Dispatcher::handle_timers()
+{
+    auto t = now();
+    std::vector<ConnKey> expired;
+    for (auto it = timers_.begin(); it != timers_.end() && it->first <= t; ++it)
+    {
+        expired.push_back(it->second);
+    }
+    for (auto& key : expired)
+    {
+        conns_[key].conn->on_timer();
+        reschedule(key);
+    }
+}
+
+void Dispatcher::handle_writable()
+{
+    std::vector<ConnKey> blocked;
+    for (auto& c : conns_)
+    {
+        if (c.second.conn->blocked())
+        {
+            blocked.push_back(c.first);
+        }
+    }
+    for (auto& key : blocked)
+    {
+        conns_[key].conn->on_writable();
+        reschedule(key);
+    }
+}
+
+bool Dispatcher::blocked() const
+{
+    for (auto& c : conns_)
+    {
+        if (c.second.conn->blocked())
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+Dispatcher::time_point Dispatcher::deadline() const
+{
+    return timers_.empty() ? time_point::max() : timers_.begin()->first;
+}
+
+/**
+ * Moves a connection's timer to its current deadline, or drops the
+ * connection entirely if it has closed
+ */
+void Dispatcher::reschedule(const ConnKey& key)
+{
+    auto it = conns_.find(key);
+    if (it == conns_.end())
+    {
+        return;
+    }
+    ConnEntry& entry = it->second;
+    if (entry.timer != timers_.end())
+    {
+        timers_.erase(entry.timer);
+        entry.timer = timers_.end();
+    }
+    if (entry.conn->state() == Connection::State::CLOSED)
+    {
+        conns_.erase(it);
+        active_connections.add(-1);
+        return;
+    }
+    entry.timer = timers_.emplace(entry.conn->deadline(), key);
+}
@@ -0,0 +1,123 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include "Batch.h"                      // for SendBatch, RecvBatch
+#include "Connection.h"                 // for Connection
+#include "FastOpen.h"                   // for FastOpen
+#include "MappedFile.h"                 // for MappedFile
+#include "Packet.h"                     // for Packet
+#include "Socket.h"                     // for Socket
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint16_t, uint32_t, uint64_t
+#include <functional>                   // for hash
+#include <map>                          // for multimap
+#include <memory>                       // for unique_ptr
+#include <string>                       // for string
+#include <unordered_map>                // for unordered_map
+
+// What every connection is set up with, from the command line
+struct ServerConfig
+{
+    ServerConfig() :
+        cc("reno"), txtime(false), gso(false), max_streams(8),
+        max_mss(Packet::MAX_MSS) {}
+    // congestion control for clients that don't ask for one
+    std::string cc;
+    // let the kernel's fq qdisc time paced segments
+    bool txtime;
+    // hand runs of segments to the kernel to split up, with UDP GSO
+    bool gso;
+    // the most streams a client may split the file across
+    unsigned max_streams;
+    // the largest segment to probe the path to a client for
+    size_t max_mss;
+};
+
+/**
+ * A server worker's connections: hands each datagram from the socket to its
+ * connection, creating one for each new SYN, and fires their timers. The
+ * server's event loop drives it from epoll, and the simulator from its
+ * virtual clock, so both run exactly the same code.
+ */
+class Dispatcher
+{
+public:
+    using time_point = Connection::time_point;
+
+    Dispatcher(Socket& sock, const MappedFile& file, const ServerConfig& config,
+               FastOpen* fast_open, SendBatch& batch, RecvBatch& rbatch);
+    ~Dispatcher();
+
+    Dispatcher(const Dispatcher&) = delete;
+    Dispatcher& operator=(const Dispatcher&) = delete;
+
+    /**
+     * Reads every queued datagram off the socket, a batch at a time.
+     * Connections only send once they've seen the whole batch.
+     */
+    void handle_datagrams();
+
+    /**
+     * Fires every connection timer that has expired
+     */
+    void handle_timers();
+
+    /**
+     * Lets the connections stuck on a full socket buffer send again
+     */
+    void handle_writable();
+
+    // whether some connection is waiting for room in the socket buffer
+    bool blocked() const;
+
+    // the earliest connection deadline, or time_point::max() if none
+    time_point deadline() const;
+
+private:
+    // Connections are demultiplexed by the peer's address and the connection
+    // ID it picked for its SYN, so a client can run several transfers from
+    // one port
+    struct ConnKey
+    {
+        uint32_t addr; // network order
+        uint16_t port; // network order
+        uint16_t conn_id;
+        bool operator==(const ConnKey& o) const
+        {
+            return addr == o.addr && port == o.port && conn_id == o.conn_id;
+        }
+    };
+
+    struct ConnKeyHash
+    {
+        size_t operator()(const ConnKey& k) const
+        {
+            return std::hash<uint64_t>()(((uint64_t)k.addr << 32) |
+                                         ((uint64_t)k.port << 16) | k.conn_id);
+        }
+    };
+
+    using TimerQueue = std::multimap<time_point, ConnKey>;
+
+    struct ConnEntry
+    {
+        ConnEntry() : touched(false) {}
+        std::unique_ptr<Connection> conn;
+        TimerQueue::iterator timer;
+        bool touched; // got a datagram in the batch being handled
+    };
+
+    void reschedule(const ConnKey& key);
+
+    Socket& sock_;
+    const MappedFile& file_;
+    const ServerConfig& config_;
+    FastOpen* fast_open_;
+    SendBatch& batch_;
+    RecvBatch& rbatch_;
+    std::unordered_map<ConnKey, ConnEntry, ConnKeyHash> conns_;
+    TimerQueue timers_;
+};
+
+#endif
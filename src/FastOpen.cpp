@@ -0,0 +1,213 @@
+#include "FastOpen.h"
+
+#include <cerrno>                       // for errno
+#include <cstdio>                       // for rename
+#include <cstring>                      // for memcpy, strerror
+#include <fstream>                      // for ifstream, ofstream
+#include <iostream>                     // for cerr, hex, dec
+#include <random>                       // for random_device
+#include <sstream>                      // for istringstream
+#include <string>                       // for to_string
+
+#include <endian.h>                     // for le64toh
+#include <netinet/in.h>                 // for sockaddr_in
+#include <unistd.h>                     // for getpid
+
+/*
+ * Static Variables
+ */
+// how long FastOpen remembers a path
+static const std::chrono::minutes PATH_TTL(10);
+
+/*
+ * Function Declarations
+ */
+static uint64_t siphash24(const uint64_t key[2], const uint8_t* data, size_t len);
+static void sip_round(uint64_t v[4]);
+static uint32_t address(const sockaddr_storage& peer);
+
+/*
+ * Implementations
+ */
+FastOpen::FastOpen()
+{
+    std::random_device rd;
+    for (uint64_t& k : key_)
+    {
+        k = ((uint64_t)rd() << 32) | rd();
+    }
+}
+
+uint32_t FastOpen::ticket(const sockaddr_storage& peer) const
+{
+    uint32_t addr = address(peer);
+    return (uint32_t)siphash24(key_, (const uint8_t*)&addr, sizeof(addr));
+}
+
+void FastOpen::remember(const sockaddr_storage& peer, const PathInfo& path)
+{
+    auto t = now();
+    std::lock_guard<std::mutex> guard(lock_);
+    // Make room by forgetting what has expired, or failing that whatever
+    // comes first
+    if (paths_.size() >= MAX_PATHS && paths_.count(address(peer)) == 0)
+    {
+        for (auto it = paths_.begin(); it != paths_.end();)
+        {
+            if (t - it->second.stored > PATH_TTL)
+            {
+                it = paths_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        if (paths_.size() >= MAX_PATHS)
+        {
+            paths_.erase(paths_.begin());
+        }
+    }
+    paths_[address(peer)] = Entry{ path, t };
+}
+
+bool FastOpen::recall(const sockaddr_storage& peer, PathInfo& path)
+{
+    std::lock_guard<std::mutex> guard(lock_);
+    auto it = paths_.find(address(peer));
+    if (it == paths_.end())
+    {
+        return false;
+    }
+    if (now() - it->second.stored > PATH_TTL)
+    {
+        paths_.erase(it);
+        return false;
+    }
+    path = it->second.path;
+    return true;
+}
+
+TicketStore::TicketStore(const std::string& path) :
+    path_(path)
+{
+    std::ifstream in(path);
+    std::string line;
+    while (std::getline(in, line))
+    {
+        std::istringstream fields(line);
+        std::string server;
+        Entry entry;
+        if (fields >> server >> std::hex >> entry.ticket >> std::dec >> entry.srtt_us)
+        {
+            entries_[server] = entry;
+        }
+    }
+}
+
+bool TicketStore::find(const std::string& server, uint32_t& ticket,
+                       std::chrono::microseconds& srtt) const
+{
+    auto it = entries_.find(server);
+    if (it == entries_.end())
+    {
+        return false;
+    }
+    ticket = it->second.ticket;
+    srtt = std::chrono::microseconds(it->second.srtt_us);
+    return true;
+}
+
+void TicketStore::set(const std::string& server, uint32_t ticket,
+                      std::chrono::microseconds srtt)
+{
+    entries_[server] = Entry{ ticket, (uint64_t)srtt.count() };
+}
+
+bool TicketStore::save() const
+{
+    // Other clients may be reading or saving it too; each sees the old
+    // store or a new one, never half of each
+    std::string tmp = path_ + "." + std::to_string(getpid());
+    {
+        std::ofstream out(tmp, std::ios::trunc);
+        for (auto& e : entries_)
+        {
+            out << e.first << ' ' << std::hex << e.second.ticket << std::dec
+                << ' ' << e.second.srtt_us << '\n';
+        }
+        if (!out.flush())
+        {
+            std::cerr << tmp << ": couldn't write tickets" << std::endl;
+            return false;
+        }
+    }
+    if (std::rename(tmp.c_str(), path_.c_str()) < 0)
+    {
+        std::cerr << "rename(): " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * SipHash-2-4 of len bytes under key (k0, k1), as in the reference
+ * implementation
+ */
+static uint64_t siphash24(const uint64_t key[2], const uint8_t* data, size_t len)
+{
+    uint64_t v[4] = { key[0] ^ 0x736f6d6570736575ull, key[1] ^ 0x646f72616e646f6dull,
+                      key[0] ^ 0x6c7967656e657261ull, key[1] ^ 0x7465646279746573ull };
+    // Whole words, then the rest with the length in the top byte
+    size_t words = len / 8;
+    for (size_t i = 0; i <= words; i++)
+    {
+        uint64_t m = 0;
+        if (i < words)
+        {
+            std::memcpy(&m, data + i * 8, sizeof(m));
+            m = le64toh(m);
+        }
+        else
+        {
+            for (size_t j = 0; j < len % 8; j++)
+            {
+                m |= (uint64_t)data[i * 8 + j] << (8 * j);
+            }
+            m |= (uint64_t)len << 56;
+        }
+        v[3] ^= m;
+        sip_round(v);
+        sip_round(v);
+        v[0] ^= m;
+    }
+    v[2] ^= 0xff;
+    for (int i = 0; i < 4; i++)
+    {
+        sip_round(v);
+    }
+    return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+static void sip_round(uint64_t v[4])
+{
+    auto rotl = [](uint64_t x, int b) { return (x << b) | (x >> (64 - b)); };
+    v[0] += v[1];
+    v[1] = rotl(v[1], 13) ^ v[0];
+    v[0] = rotl(v[0], 32);
+    v[2] += v[3];
+    v[3] = rotl(v[3], 16) ^ v[2];
+    v[0] += v[3];
+    v[3] = rotl(v[3], 21) ^ v[0];
+    v[2] += v[1];
+    v[1] = rotl(v[1], 17) ^ v[2];
+    v[2] = rotl(v[2], 32);
+}
+
+/**
+ * peer's IPv4 address, in network order; the server takes no other kind
+ */
+static uint32_t address(const sockaddr_storage& peer)
+{
+    return ((const sockaddr_in*)&peer)->sin_addr.s_addr;
+}
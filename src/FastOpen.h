@@ -0,0 +1,122 @@
+#ifndef FAST_OPEN_H
+#define FAST_OPEN_H
+
+#include "Packet.h"                     // for PacketWrapper
+
+#include <chrono>                       // for microseconds
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t, uint64_t
+#include <map>                          // for map
+#include <mutex>                        // for mutex
+#include <string>                       // for string
+#include <unordered_map>                // for unordered_map
+
+#include <sys/socket.h>                 // for sockaddr_storage
+
+/*
+ * Fast open (OPT_TICKET) saves a returning client the round trip the
+ * handshake ACK costs. Its first SYN asks for a ticket, and the server puts
+ * one in the SYN-ACK. Later SYNs present it, and if the server knows the
+ * path, it sends the file right behind the SYN-ACK.
+ */
+
+/**
+ * How a connection to a client ended, for the next one from the same
+ * address to start from
+ */
+struct PathInfo
+{
+    std::chrono::microseconds srtt;
+    uint32_t cwnd;          // bytes
+    uint32_t ssthresh;      // bytes, or 0 if the controller has none
+    uint32_t mss;
+};
+
+/**
+ * The server's side of fast open, shared by every worker.
+ *
+ * A ticket is a keyed hash (SipHash-2-4, cut down to 32 bits) of the
+ * client's IPv4 address, under a key picked when the server starts. Only
+ * the server can make one, and one only works from the address it was
+ * issued to, so a SYN with a forged source can't get data sent anywhere.
+ * Tickets last as long as the server does.
+ *
+ * Besides, it remembers how the last connection from each address that
+ * wanted a ticket ended, for ten minutes; a ticket is only any use while its
+ * path is remembered.
+ */
+class FastOpen
+{
+public:
+    // most addresses remembered at once
+    static const size_t MAX_PATHS = 4096;
+
+    FastOpen();
+
+    FastOpen(const FastOpen&) = delete;
+    FastOpen& operator=(const FastOpen&) = delete;
+
+    // the ticket for peer's address
+    uint32_t ticket(const sockaddr_storage& peer) const;
+
+    void remember(const sockaddr_storage& peer, const PathInfo& path);
+
+    /**
+     * @return false if there is nothing (recent) known about the path to
+     * peer's address
+     */
+    bool recall(const sockaddr_storage& peer, PathInfo& path);
+
+private:
+    struct Entry
+    {
+        PathInfo path;
+        PacketWrapper::time_point stored;
+    };
+
+    uint64_t key_[2];
+    std::mutex lock_;       // guards paths_
+    std::unordered_map<uint32_t, Entry> paths_; // by address, network order
+};
+
+/**
+ * The client's side: the tickets it holds, one per server, and the round
+ * trip time it last saw to each, kept in a text file between runs, a line
+ * of "host:port ticket srtt-us" per server
+ */
+class TicketStore
+{
+public:
+    /**
+     * Reads path; a missing or unreadable file is just an empty store
+     */
+    explicit TicketStore(const std::string& path);
+
+    /**
+     * @return false if we hold no ticket for server
+     */
+    bool find(const std::string& server, uint32_t& ticket,
+              std::chrono::microseconds& srtt) const;
+
+    void set(const std::string& server, uint32_t ticket,
+             std::chrono::microseconds srtt);
+
+    /**
+     * Writes the store back to its file, whole, through a temporary file
+     *
+     * @return false if that failed
+     */
+    bool save() const;
+
+private:
+    struct Entry
+    {
+        uint32_t ticket;
+        uint64_t srtt_us;
+    };
+
+    std::string path_;
+    std::map<std::string, Entry> entries_;
+};
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include <algorithm>                    // for max, min
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint16_t, uint32_t, uint64_t
+#include <cstring>                      // for memcpy
+#include <vector>                       // for vector
+
+/**
+ * XORs len bytes of src into dst, a word at a time
+ */
+inline
+void xor_bytes(char* dst, const char* src, size_t len)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t))
+    {
+        uint64_t a, b;
+        std::memcpy(&a, dst + i, sizeof(a));
+        std::memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        std::memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < len; i++)
+    {
+        dst[i] ^= src[i];
+    }
+}
+
+/**
+ * How many data segments the server covers with each parity segment
+ * (OPT_FEC) when it sees loss_rate of what it sends lost: enough that a
+ * block and its parity lose about a quarter of a segment between them, so
+ * blocks with two losses, which one parity can't repair, stay rare. With no
+ * losses seen the blocks are as long as the client allows.
+ *
+ * @param shortest, longest the block lengths the handshake agreed on
+ */
+inline
+size_t fec_block(double loss_rate, size_t shortest, size_t longest)
+{
+    if (loss_rate <= 0)
+    {
+        return longest;
+    }
+    double block = 0.25 / loss_rate - 1;
+    if (block >= longest)
+    {
+        return longest;
+    }
+    return std::max((size_t)std::max(block, 0.0), shortest);
+}
+
+/**
+ * The client's side of forward error correction: keeps a copy of the last
+ * few blocks' worth of data segments, so that when a parity segment arrives
+ * for a block that is missing exactly one of them, the missing one can be
+ * rebuilt by XORing the parity with the rest instead of waiting a round trip
+ * for the server to resend it.
+ *
+ * Like ReorderBuffer, it relies on every segment but the last being mss
+ * bytes, so a segment's slot is its distance from the first one in
+ * segments.
+ */
+class FecDecoder
+{
+public:
+    // Blocks are at least this many data segments long,
+    static const size_t MIN_BLOCK = 2;
+    // and at most this many
+    static const size_t MAX_BLOCK = 32;
+    // How many segments we keep; a parity for a block older than this (the
+    // server sends one right after its block, so only reordering could
+    // delay it that much) can't be used
+    static const size_t HISTORY = 4 * MAX_BLOCK;
+
+    /**
+     * @param first_seq the sequence number of the first byte of the file
+     * @param mss the size of every segment but the last
+     */
+    FecDecoder(uint32_t first_seq, size_t mss) :
+        first_seq_(first_seq), mss_(mss), data_(HISTORY * mss),
+        slots_(HISTORY), repaired_(mss)
+    {
+    }
+
+    FecDecoder(const FecDecoder&) = delete;
+    FecDecoder& operator=(const FecDecoder&) = delete;
+
+    /**
+     * Remembers a data segment, which may be a duplicate or out of order
+     */
+    void add(uint32_t seq, const char* data, size_t len)
+    {
+        uint32_t offset = seq - first_seq_;
+        if (offset % mss_ != 0 || len > mss_)
+        {
+            return;
+        }
+        size_t i = slot(seq);
+        std::memcpy(&data_[i * mss_], data, len);
+        slots_[i].seq = seq;
+        slots_[i].len = len;
+        slots_[i].used = true;
+    }
+
+    /**
+     * Rebuilds the segment a parity segment's block is missing, if it is
+     * missing exactly one
+     *
+     * @param first the sequence number of the block's first segment
+     * @param count how many segments the block has
+     * @param lengths their lengths XORed together
+     * @param parity the parity segment's payload: their data XORed
+     * together, each padded with zeros to parity_len bytes
+     * @param seq, len set to the rebuilt segment's sequence number and
+     * length
+     *
+     * @return the rebuilt segment's data, which stays valid until the next
+     * call, or nullptr if there was nothing to rebuild (or no way to)
+     */
+    const char* repair(uint32_t first, size_t count, uint16_t lengths,
+                       const char* parity, size_t parity_len, uint32_t& seq,
+                       size_t& len)
+    {
+        if ((first - first_seq_) % mss_ != 0 || count == 0 ||
+                count > MAX_BLOCK || parity_len > mss_)
+        {
+            return nullptr;
+        }
+        size_t missing = count;
+        for (size_t j = 0; j < count; j++)
+        {
+            uint32_t s = first + j * mss_;
+            const Slot& held = slots_[slot(s)];
+            if (held.used && held.seq == s)
+            {
+                lengths ^= held.len;
+            }
+            else if (missing == count)
+            {
+                missing = j;
+            }
+            else
+            {
+                return nullptr;
+            }
+        }
+        if (missing == count || lengths > parity_len)
+        {
+            return nullptr;
+        }
+        std::memcpy(repaired_.data(), parity, parity_len);
+        for (size_t j = 0; j < count; j++)
+        {
+            if (j != missing)
+            {
+                size_t i = slot(first + j * mss_);
+                xor_bytes(repaired_.data(), &data_[i * mss_], slots_[i].len);
+            }
+        }
+        seq = first + missing * mss_;
+        len = lengths;
+        add(seq, repaired_.data(), len);
+        return repaired_.data();
+    }
+
+private:
+    struct Slot
+    {
+        Slot() : seq(0), len(0), used(false) {}
+        uint32_t seq;
+        uint16_t len;
+        bool used;
+    };
+
+    size_t slot(uint32_t seq) const
+    {
+        return ((seq - first_seq_) / mss_) % HISTORY;
+    }
+
+    uint32_t first_seq_;
+    size_t mss_;
+    std::vector<char> data_;
+    std::vector<Slot> slots_;
+    std::vector<char> repaired_;
+};
+
+#endif
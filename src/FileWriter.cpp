@@ -0,0 +1,298 @@
+#include "FileWriter.h"
+
+#include "Packet.h"                     // for add_seq
+
+#include <algorithm>                    // for min
+#include <cerrno>                       // for errno, EINTR
+#include <cstring>                      // for strerror
+#include <stdexcept>                    // for runtime_error
+#include <string>                       // for string, operator+
+
+#include <fcntl.h>                      // for open, posix_fallocate, O_RDWR
+#include <unistd.h>                     // for pwrite, ftruncate, close
+
+/*
+ * Function Declarations
+ */
+static bool reserve(int fd, uint64_t size);
+
+/*
+ * Implementations
+ */
+size_t FileWriter::held_ranges(uint32_t recent, SackBlock* blocks,
+                               size_t max) const
+{
+    uint32_t base = next_seq();
+    size_t limit = segments();
+    auto block = [&](size_t begin, size_t end)
+    {
+        SackBlock b;
+        b.start = add_seq(base, begin * mss_);
+        b.end = add_seq(base, (end - 1) * mss_ + length(end - 1));
+        return b;
+    };
+    size_t n = 0;
+    uint32_t offset = recent - base;
+    size_t first = offset / mss_;
+    bool have_recent = offset % mss_ == 0 && first < limit &&
+                       find(first, true) == first;
+    if (have_recent && n < max)
+    {
+        blocks[n++] = block(first, find(first, false));
+    }
+    size_t begin = find(0, true);
+    while (n < max && begin < limit)
+    {
+        size_t end = find(begin, false);
+        // Already reported if it holds recent
+        if (!have_recent || first < begin || first >= end)
+        {
+            blocks[n++] = block(begin, end);
+        }
+        begin = find(end, true);
+    }
+    return n;
+}
+
+OrderedWriter::OrderedWriter(const char* filename, uint32_t next_seq,
+                             size_t window, size_t mss) :
+    FileWriter(mss), out_(filename, std::ofstream::binary),
+    cache_(next_seq, mss, window)
+{
+    if (!out_)
+    {
+        throw std::runtime_error(std::string("Could not open ") + filename);
+    }
+}
+
+OrderedWriter::OrderedWriter(uint32_t next_seq, size_t window, size_t mss) :
+    FileWriter(mss), cache_(next_seq, mss, window)
+{
+}
+
+bool OrderedWriter::write(uint32_t seq, const char* data, size_t len)
+{
+    // Out-of-order segments are copied into the cache, unless they are
+    // duplicates or from too far in the future
+    if (seq != cache_.next_seq())
+    {
+        return cache_.insert(seq, data, len);
+    }
+    // The expected segment goes straight to the file, followed by as many
+    // cached ones as now follow it in order
+    emit(data, len);
+    cache_.skip(len);
+    const char* cached;
+    while ((cached = cache_.front(len)) != nullptr)
+    {
+        emit(cached, len);
+        cache_.pop_front();
+    }
+    return true;
+}
+
+void OrderedWriter::finish()
+{
+    if (out_.is_open() && !out_.flush())
+    {
+        throw std::runtime_error(std::string("write(): ") + std::strerror(errno));
+    }
+}
+
+void OrderedWriter::emit(const char* data, size_t len)
+{
+    // The stream buffers, so a full disk may only show up a few writes later
+    // (or in finish()), but it does show up
+    if (!out_.write(data, len))
+    {
+        throw std::runtime_error(std::string("write(): ") + std::strerror(errno));
+    }
+}
+
+DecompressingWriter::DecompressingWriter(const char* filename,
+                                         uint32_t next_seq, size_t window,
+                                         size_t mss, const ByteRange& part) :
+    OrderedWriter(next_seq, window, mss), pos_(part.start), end_(part.end),
+    inflater_([this](const char* data, size_t len) { write_block(data, len); })
+{
+    fd_ = open(filename, O_RDWR);
+    if (fd_ < 0)
+    {
+        throw std::runtime_error(std::string("open(): ") + std::strerror(errno));
+    }
+}
+
+DecompressingWriter::~DecompressingWriter()
+{
+    close(fd_);
+}
+
+/**
+ * Writes an inflated block at pos_
+ */
+void DecompressingWriter::write_block(const char* data, size_t len)
+{
+    if (end_ != UNKNOWN_SIZE && pos_ + len > end_)
+    {
+        throw std::runtime_error("The compressed stream runs past its part of the file");
+    }
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t ret = pwrite(fd_, data + written, len - written, pos_ + written);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("pwrite(): ") + std::strerror(errno));
+        }
+        written += ret;
+    }
+    pos_ += len;
+}
+
+PositionalWriter::PositionalWriter(const char* filename, uint32_t next_seq,
+                                   size_t window, size_t mss, uint64_t file_size) :
+    FileWriter(mss), window_(window), next_seq_(next_seq), start_(0),
+    next_pos_(0), end_(file_size), held_(0)
+{
+    fd_ = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+    {
+        throw std::runtime_error(std::string("open(): ") + std::strerror(errno));
+    }
+    if (file_size == UNKNOWN_SIZE || file_size == 0)
+    {
+        return;
+    }
+    if (!reserve(fd_, file_size))
+    {
+        int err = errno;
+        close(fd_);
+        throw std::runtime_error(std::string("ftruncate(): ") + std::strerror(err));
+    }
+    done_.reserve((file_size + mss_ - 1) / mss_);
+}
+
+PositionalWriter::PositionalWriter(const char* filename, uint32_t next_seq,
+                                   size_t window, size_t mss, const ByteRange& part) :
+    FileWriter(mss), window_(window), next_seq_(next_seq), start_(part.start),
+    next_pos_(part.start), end_(part.end), held_(0)
+{
+    fd_ = open(filename, O_RDWR);
+    if (fd_ < 0)
+    {
+        throw std::runtime_error(std::string("open(): ") + std::strerror(errno));
+    }
+    // Segments are numbered from the start of the part
+    done_.reserve((part.size() + mss_ - 1) / mss_);
+}
+
+void PositionalWriter::allocate(const char* filename, uint64_t file_size,
+                                bool keep)
+{
+    int fd = open(filename, O_RDWR | O_CREAT | (keep ? 0 : O_TRUNC), 0644);
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("open(): ") + std::strerror(errno));
+    }
+    // A kept file may be longer than this one, from some other transfer
+    if (keep && file_size != UNKNOWN_SIZE && ftruncate(fd, file_size) < 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error(std::string("ftruncate(): ") + std::strerror(err));
+    }
+    if (file_size != UNKNOWN_SIZE && file_size > 0 && !reserve(fd, file_size))
+    {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error(std::string("ftruncate(): ") + std::strerror(err));
+    }
+    close(fd);
+}
+
+PositionalWriter::~PositionalWriter()
+{
+    close(fd_);
+}
+
+bool PositionalWriter::write(uint32_t seq, const char* data, size_t len)
+{
+    // Old duplicates wrap around to huge offsets, so this one check also
+    // drops them
+    uint32_t offset = seq - next_seq_;
+    if (len == 0 || len > mss_ || offset >= window_ || offset % mss_ != 0)
+    {
+        return false;
+    }
+    uint64_t pos = next_pos_ + offset;
+    if (end_ != UNKNOWN_SIZE && pos + len > end_)
+    {
+        return false;
+    }
+    if (!done_.set((pos - start_) / mss_))
+    {
+        return false;
+    }
+    // Only the last segment of our part of the file is short
+    if (len < mss_)
+    {
+        end_ = pos + len;
+    }
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t ret = pwrite(fd_, data + written, len - written, pos + written);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            throw std::runtime_error(std::string("pwrite(): ") + std::strerror(errno));
+        }
+        written += ret;
+    }
+    // Move past every segment we now have contiguously
+    uint64_t first = (next_pos_ - start_) / mss_;
+    uint64_t next = done_.next_clear(first);
+    held_ = held_ + 1 - (next - first);
+    uint64_t next_pos = std::min(start_ + next * mss_, end_);
+    next_seq_ = add_seq(next_seq_, next_pos - next_pos_);
+    next_pos_ = next_pos;
+    return true;
+}
+
+size_t PositionalWriter::find(size_t distance, bool held) const
+{
+    uint64_t base = (next_pos_ - start_) / mss_;
+    uint64_t found = held ? done_.next_set(base + distance)
+                          : done_.next_clear(base + distance);
+    return std::min(found - base, (uint64_t)segments());
+}
+
+size_t PositionalWriter::segments() const
+{
+    return (window_ + mss_ - 1) / mss_;
+}
+
+size_t PositionalWriter::length(size_t distance) const
+{
+    uint64_t pos = next_pos_ + distance * mss_;
+    return std::min((uint64_t)mss_, end_ - pos);
+}
+
+/**
+ * Makes fd size bytes long, reserving the blocks now so writes landing all
+ * over the file don't fragment it; falls back to a sparse file where that
+ * isn't supported
+ *
+ * @return false, with errno set, on failure
+ */
+static bool reserve(int fd, uint64_t size)
+{
+    return posix_fallocate(fd, 0, size) == 0 || ftruncate(fd, size) == 0;
+}
@@ -0,0 +1,237 @@
+#ifndef FILE_WRITER_H
+#define FILE_WRITER_H
+
+#include "Compress.h"                   // for Decompressor
+#include "Packet.h"                     // for SackBlock, ByteRange
+#include "ReorderBuffer.h"              // for ReorderBuffer
+#include "SegmentBitmap.h"              // for SegmentBitmap
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t, uint64_t, UINT64_MAX
+#include <fstream>                      // for ofstream
+
+/**
+ * Where the client puts the data segments it receives.
+ *
+ * Implementations decide what to do with out-of-order segments; the client
+ * only needs to hand them every segment and ask what to acknowledge.
+ */
+class FileWriter
+{
+public:
+    // the file size when the server didn't tell us
+    static const uint64_t UNKNOWN_SIZE = UINT64_MAX;
+
+    virtual ~FileWriter() {}
+
+    /**
+     * Takes a data segment, in or out of order. Throws std::runtime_error if
+     * the file can't be written.
+     *
+     * @return false if it was a duplicate or outside the window
+     */
+    virtual bool write(uint32_t seq, const char* data, size_t len) = 0;
+
+    /**
+     * @return the sequence number of the first byte we don't have yet, which
+     * is what we acknowledge
+     */
+    virtual uint32_t next_seq() const = 0;
+
+    // how many segments past next_seq() we hold
+    virtual size_t held() const = 0;
+
+    /**
+     * Makes sure everything written so far has reached the file, once the
+     * last segment is in. Throws std::runtime_error if it couldn't.
+     */
+    virtual void finish() {}
+
+    /**
+     * Describes the data we hold past next_seq(), for the SACK blocks in an
+     * ack: the run starting at recent first, if we just received it, then
+     * the lowest runs, which border the holes the server should fill first
+     *
+     * @return how many blocks were filled in, at most max
+     */
+    size_t held_ranges(uint32_t recent, SackBlock* blocks, size_t max) const;
+
+protected:
+    // Every segment but the last is mss bytes long
+    explicit FileWriter(size_t mss) : mss_(mss) {}
+
+    // Segments are numbered here by their distance from next_seq()
+
+    /**
+     * @return the first segment at or after distance that we hold (or, if
+     * held is false, that we don't), or segments() if there is none
+     */
+    virtual size_t find(size_t distance, bool held) const = 0;
+    // how many segments past next_seq() the window reaches
+    virtual size_t segments() const = 0;
+    // the length of a segment we hold
+    virtual size_t length(size_t distance) const = 0;
+
+    const size_t mss_;
+};
+
+/**
+ * Writes the file front to back, holding out-of-order segments in a
+ * ReorderBuffer until the gap before them fills
+ */
+class OrderedWriter : public FileWriter
+{
+public:
+    /**
+     * @param next_seq the sequence number of the first byte of the file
+     * @param window bytes of out-of-order data to make room for
+     * @param mss the length of every segment but the last
+     */
+    OrderedWriter(const char* filename, uint32_t next_seq, size_t window,
+                  size_t mss);
+
+    bool write(uint32_t seq, const char* data, size_t len) override;
+    uint32_t next_seq() const override { return cache_.next_seq(); }
+    size_t held() const override { return cache_.size(); }
+    void finish() override;
+
+protected:
+    /**
+     * For subclasses that put the data somewhere other than a file of their
+     * own; they override emit()
+     */
+    OrderedWriter(uint32_t next_seq, size_t window, size_t mss);
+
+    /**
+     * Puts the next len bytes of the file, in order, where they go
+     */
+    virtual void emit(const char* data, size_t len);
+
+    size_t find(size_t distance, bool held) const override
+    {
+        return cache_.find(distance, held);
+    }
+    size_t segments() const override
+    {
+        return cache_.window() / mss_;
+    }
+    size_t length(size_t distance) const override
+    {
+        return cache_.length(distance);
+    }
+
+private:
+    std::ofstream out_;
+    ReorderBuffer cache_;
+};
+
+/**
+ * Receives a compressed stream (OPT_COMPRESS): puts it in order like
+ * OrderedWriter, then inflates it a block at a time and pwrite()s each
+ * block to its place in the file. Sequence numbers count bytes of the
+ * stream, not of the file.
+ */
+class DecompressingWriter : public OrderedWriter
+{
+public:
+    /**
+     * @param next_seq the sequence number of the first byte of the stream
+     * @param window bytes of out-of-order data to make room for
+     * @param mss the length of every segment but the last
+     * @param part where in the file the stream's data goes; the file must
+     * exist, as PositionalWriter::allocate() leaves it
+     */
+    DecompressingWriter(const char* filename, uint32_t next_seq, size_t window,
+                        size_t mss, const ByteRange& part);
+    ~DecompressingWriter();
+
+    DecompressingWriter(const DecompressingWriter&) = delete;
+    DecompressingWriter& operator=(const DecompressingWriter&) = delete;
+
+    /**
+     * @return true if the stream so far has filled the whole part, with no
+     * block left half fed
+     */
+    bool complete() const
+    {
+        return inflater_.idle() && (end_ == UNKNOWN_SIZE || pos_ == end_);
+    }
+    // the CRC32C of the file's bytes written so far
+    uint32_t crc() const { return inflater_.crc(); }
+    uint64_t raw_bytes() const { return inflater_.raw_bytes(); }
+
+protected:
+    void emit(const char* data, size_t len) override
+    {
+        inflater_.feed(data, len);
+    }
+
+private:
+    void write_block(const char* data, size_t len);
+
+    int fd_;
+    uint64_t pos_;          // file offset of the next inflated byte
+    uint64_t end_;          // where the part ends, or UNKNOWN_SIZE
+    Decompressor inflater_;
+};
+
+/**
+ * Writes every segment straight to its offset in the file with pwrite(), so
+ * out-of-order data is never buffered in memory and the window is only
+ * limited by the disk. A SegmentBitmap records which segments are done.
+ */
+class PositionalWriter : public FileWriter
+{
+public:
+    /**
+     * @param next_seq the sequence number of the first byte of the file
+     * @param window how far past next_seq() a segment may start
+     * @param mss the length of every segment but the last
+     * @param file_size the file's length if the server told us, in which case
+     * the file is allocated up front; UNKNOWN_SIZE otherwise
+     */
+    PositionalWriter(const char* filename, uint32_t next_seq, size_t window,
+                     size_t mss, uint64_t file_size);
+    /**
+     * Writes only part of the file, which starts at next_seq, for receiving
+     * a file split across streams: every stream writes its own part of the
+     * same file, which allocate() must have set up
+     */
+    PositionalWriter(const char* filename, uint32_t next_seq, size_t window,
+                     size_t mss, const ByteRange& part);
+    ~PositionalWriter();
+
+    /**
+     * Creates (or truncates) filename and allocates file_size bytes for it.
+     * Throws std::runtime_error if that fails.
+     *
+     * @param keep leave what the file holds already, only sizing it, for
+     * resuming a transfer (-r)
+     */
+    static void allocate(const char* filename, uint64_t file_size,
+                         bool keep = false);
+
+    PositionalWriter(const PositionalWriter&) = delete;
+    PositionalWriter& operator=(const PositionalWriter&) = delete;
+
+    bool write(uint32_t seq, const char* data, size_t len) override;
+    uint32_t next_seq() const override { return next_seq_; }
+    size_t held() const override { return held_; }
+
+protected:
+    size_t find(size_t distance, bool held) const override;
+    size_t segments() const override;
+    size_t length(size_t distance) const override;
+
+private:
+    int fd_;
+    size_t window_;
+    uint32_t next_seq_;
+    uint64_t start_;        // file offset of our first segment
+    uint64_t next_pos_;     // file offset of next_seq_
+    uint64_t end_;          // file size, or UNKNOWN_SIZE until the last segment
+    size_t held_;           // segments done past next_pos_
+    SegmentBitmap done_;
+};
+
+#endif
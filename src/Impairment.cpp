@@ -0,0 +1,104 @@
+#include "Impairment.h"
+
+#include <algorithm>                    // for max
+
+/*
+ * Static Variables
+ */
+// reordered datagrams are held back this much more than the delay
+static const std::chrono::milliseconds reorder_gap(1);
+
+/*
+ * Implementations
+ */
+ImpairedLink::ImpairedLink(const Impairment& impairment, std::mt19937_64& rng) :
+    imp_(impairment), rng_(rng), bad_(false)
+{
+}
+
+size_t ImpairedLink::schedule(time_point t, std::string& data,
+                              time_point* departures)
+{
+    // Losses come in bursts, as in the Gilbert-Elliott model: every
+    // datagram in the bad state is lost, and the chances of moving between
+    // the states give the mean loss rate and burst length asked for
+    if (bad_)
+    {
+        bad_ = !chance(1 / imp_.burst);
+    }
+    else
+    {
+        bad_ = chance(imp_.loss / (imp_.burst * (1 - imp_.loss)));
+    }
+    if (bad_)
+    {
+        stats_.dropped++;
+        return 0;
+    }
+    int copies = 1;
+    if (chance(imp_.duplicate))
+    {
+        copies = 2;
+        stats_.duplicated++;
+    }
+    size_t len = data.size();
+    if (len > 0 && chance(imp_.corrupt))
+    {
+        size_t bit = std::uniform_int_distribution<size_t>(0, 8 * len - 1)(rng_);
+        data[bit / 8] ^= 1 << (bit % 8);
+        stats_.corrupted++;
+    }
+    size_t n = 0;
+    for (int c = 0; c < copies; c++)
+    {
+        time_point departure = t;
+        // The bottleneck sends one datagram at a time at the rate, and drops
+        // what arrives while its queue is full
+        if (imp_.rate > 0)
+        {
+            while (!backlog_.empty() && backlog_.front() <= t)
+            {
+                backlog_.pop_front();
+            }
+            if (backlog_.size() >= imp_.limit)
+            {
+                stats_.overflowed++;
+                continue;
+            }
+            free_ = std::max(free_, t) +
+                    std::chrono::duration_cast<time_point::duration>(
+                        std::chrono::duration<double>(len / imp_.rate));
+            backlog_.push_back(free_);
+            departure = free_;
+        }
+        departure += imp_.delay;
+        if (imp_.jitter.count() > 0)
+        {
+            double j = std::uniform_real_distribution<double>(-1, 1)(rng_);
+            departure += std::chrono::duration_cast<time_point::duration>(
+                    imp_.jitter * j);
+        }
+        if (chance(imp_.reorder))
+        {
+            departure += imp_.delay + reorder_gap;
+            stats_.reordered++;
+        }
+        else
+        {
+            // Jitter alone doesn't reorder, as on a real path
+            departure = std::max(departure, last_);
+            last_ = departure;
+        }
+        departures[n++] = departure;
+        stats_.forwarded++;
+    }
+    return n;
+}
+
+/**
+ * @return true with probability p
+ */
+bool ImpairedLink::chance(double p)
+{
+    return p > 0 && std::uniform_real_distribution<double>(0, 1)(rng_) < p;
+}
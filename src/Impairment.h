@@ -0,0 +1,90 @@
+#ifndef IMPAIRMENT_H
+#define IMPAIRMENT_H
+
+#include <chrono>                       // for high_resolution_clock
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint64_t
+#include <deque>                        // for deque
+#include <random>                       // for mt19937_64
+#include <string>                       // for string
+
+/**
+ * What a link does to the datagrams crossing it
+ */
+struct Impairment
+{
+    using duration = std::chrono::high_resolution_clock::duration;
+
+    Impairment() :
+        loss(0), burst(1), delay(0), jitter(0), reorder(0), duplicate(0),
+        corrupt(0), rate(0), limit(1000) {}
+    double loss;        // fraction of datagrams dropped, on average
+    double burst;       // mean length of a run of drops
+    duration delay;
+    duration jitter;    // delay varies by up to this much either way
+    double reorder;     // fraction held back so later ones overtake them
+    double duplicate;   // fraction sent twice
+    double corrupt;     // fraction with one bit flipped
+    double rate;        // bottleneck bandwidth in bytes per second, or 0
+    size_t limit;       // datagrams the bottleneck queue holds
+};
+
+/**
+ * One direction of an impaired path: bursty loss, duplication, corruption,
+ * a drop-tail bottleneck, delay, jitter and reordering. impair puts real
+ * datagrams through it and sim simulated ones, so the simulator's paths
+ * behave like the ones the proxy makes.
+ *
+ * It only decides what happens to each datagram and when; holding the
+ * datagram until then is up to the caller.
+ */
+class ImpairedLink
+{
+public:
+    using time_point = std::chrono::high_resolution_clock::time_point;
+
+    // how many datagrams met each fate
+    struct Stats
+    {
+        Stats() :
+            forwarded(0), dropped(0), overflowed(0), duplicated(0),
+            corrupted(0), reordered(0) {}
+        uint64_t forwarded;
+        uint64_t dropped;
+        uint64_t overflowed; // dropped because the queue was full
+        uint64_t duplicated;
+        uint64_t corrupted;
+        uint64_t reordered;
+    };
+
+    /**
+     * @param rng where every random decision comes from, so a seed replays
+     * the same path
+     */
+    ImpairedLink(const Impairment& impairment, std::mt19937_64& rng);
+
+    /**
+     * Decides what happens to a datagram that arrives at t, flipping a bit
+     * of data if it is to be corrupted
+     *
+     * @param departures filled in with when each copy that gets through
+     * comes out the other end; it has room for two
+     * @return how many copies get through: 0 if it is lost, 2 if duplicated
+     */
+    size_t schedule(time_point t, std::string& data, time_point* departures);
+
+    const Stats& stats() const { return stats_; }
+
+private:
+    bool chance(double p);
+
+    Impairment imp_;
+    std::mt19937_64& rng_;
+    bool bad_;          // in a loss burst
+    time_point free_;   // when the bottleneck finishes what it has
+    time_point last_;   // latest departure in order so far
+    std::deque<time_point> backlog_; // when each queued one is through
+    Stats stats_;
+};
+
+#endif
@@ -0,0 +1,69 @@
+#include "MappedFile.h"
+
+#include "Checksum.h"                   // for crc32c
+
+#include <algorithm>                    // for min
+#include <cerrno>                       // for errno
+#include <cstring>                      // for strerror
+#include <stdexcept>                    // for runtime_error
+#include <string>                       // for string, operator+
+
+#include <fcntl.h>                      // for open, O_RDONLY
+#include <sys/mman.h>                   // for mmap, munmap, madvise
+#include <sys/stat.h>                   // for fstat
+#include <unistd.h>                     // for close
+
+/*
+ * Implementations
+ */
+MappedFile::MappedFile(const char* filename) :
+    data_(nullptr), size_(0), fingerprint_(0)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("open(): ") + std::strerror(errno));
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        int err = errno;
+        close(fd);
+        throw std::runtime_error(std::string("fstat(): ") + std::strerror(err));
+    }
+    size_ = st.st_size;
+    // mmap() refuses zero-length mappings; an empty file just has no data
+    if (size_ > 0)
+    {
+        void* addr = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+        {
+            int err = errno;
+            close(fd);
+            throw std::runtime_error(std::string("mmap(): ") + std::strerror(err));
+        }
+        // Most reads are front to back; retransmissions are rare enough not
+        // to matter
+        madvise(addr, size_, MADV_SEQUENTIAL);
+        data_ = (const char*)addr;
+    }
+    // Rewriting the file in place changes its modification time, and
+    // replacing it its inode; the samples of the data catch a copy made
+    // with the times kept
+    uint64_t stamp[4] = { (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec,
+                          (uint64_t)st.st_mtim.tv_nsec, (uint64_t)st.st_ino };
+    fingerprint_ = crc32c(0, stamp, sizeof(stamp));
+    size_t span = std::min(size_, (size_t)FINGERPRINT_SPAN);
+    fingerprint_ = crc32c(fingerprint_, data_, span);
+    fingerprint_ = crc32c(fingerprint_, data_ + size_ - span, span);
+    // The mapping keeps the file alive
+    close(fd);
+}
+
+MappedFile::~MappedFile()
+{
+    if (data_ != nullptr)
+    {
+        munmap((void*)data_, size_);
+    }
+}
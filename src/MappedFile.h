@@ -0,0 +1,43 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t
+
+/**
+ * A read-only memory mapping of a whole file.
+ *
+ * The server maps the file it serves once and every connection sends its
+ * segments straight out of the mapping, so file data is never copied into
+ * user space buffers.
+ */
+class MappedFile
+{
+public:
+    /**
+     * Throws std::runtime_error if the file can't be opened or mapped
+     */
+    explicit MappedFile(const char* filename);
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+    /**
+     * Tells this version of the file from others, for resuming transfers
+     * (OPT_RESUME): the CRC32C of its size, modification time and inode,
+     * and of its first and last FINGERPRINT_SPAN bytes
+     */
+    uint32_t fingerprint() const { return fingerprint_; }
+
+    static const size_t FINGERPRINT_SPAN = 64 * 1024;
+
+private:
+    const char* data_;
+    size_t size_;
+    uint32_t fingerprint_;
+};
+
+#endif
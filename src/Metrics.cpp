@@ -0,0 +1,296 @@
+#include "Metrics.h"
+
+#include <algorithm>                    // for max, min
+#include <cerrno>                       // for errno, EINTR
+#include <cstring>                      // for strcmp, strerror, strncpy
+#include <fstream>                      // for ofstream
+#include <iostream>                     // for cout, cerr
+#include <sstream>                      // for ostringstream
+#include <vector>                       // for vector
+
+#include <poll.h>                       // for poll, pollfd
+#include <sys/socket.h>                 // for socket, bind, listen, send
+#include <sys/un.h>                     // for sockaddr_un
+#include <unistd.h>                     // for close, unlink
+
+/*
+ * Static Variables
+ */
+// how often the serving thread checks whether to stop
+static const int POLL_INTERVAL_MS = 100;
+// quantiles every histogram reports
+static const double QUANTILES[] = { 0.5, 0.9, 0.99, 0.999 };
+static const char* QUANTILE_NAMES[] = { "p50", "p90", "p99", "p999" };
+
+int Metrics::listenfd_ = -1;
+std::string Metrics::path_;
+std::atomic<bool> Metrics::running_(false);
+std::thread Metrics::thread_;
+
+/*
+ * Function Declarations
+ */
+static std::vector<Counter*>& counters();
+static std::vector<Gauge*>& gauges();
+static std::vector<Histogram*>& histograms();
+static bool write_all(int fd, const char* buf, size_t len);
+
+/*
+ * Implementations
+ */
+Counter::Counter(const char* name) :
+    name_(name), value_(0)
+{
+    counters().push_back(this);
+}
+
+Gauge::Gauge(const char* name) :
+    name_(name), value_(0), max_(0)
+{
+    gauges().push_back(this);
+}
+
+Histogram::Histogram(const char* name, const char* unit) :
+    name_(name), unit_(unit), sum_(0), min_(UINT64_MAX), max_(0)
+{
+    for (auto& b : buckets_)
+    {
+        b.store(0, std::memory_order_relaxed);
+    }
+    histograms().push_back(this);
+}
+
+uint64_t Histogram::count() const
+{
+    uint64_t n = 0;
+    for (auto& b : buckets_)
+    {
+        n += b.load(std::memory_order_relaxed);
+    }
+    return n;
+}
+
+uint64_t Histogram::min() const
+{
+    uint64_t v = min_.load(std::memory_order_relaxed);
+    return v == UINT64_MAX ? 0 : v;
+}
+
+double Histogram::mean() const
+{
+    uint64_t n = count();
+    return n > 0 ? (double)sum_.load(std::memory_order_relaxed) / n : 0;
+}
+
+uint64_t Histogram::quantile(double q) const
+{
+    uint64_t n = count();
+    if (n == 0)
+    {
+        return 0;
+    }
+    // The rank of the value we want, counting from 1
+    uint64_t rank = std::max((uint64_t)(q * n + 0.5), (uint64_t)1);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; i++)
+    {
+        seen += buckets_[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+        {
+            // Never claim more than was actually recorded
+            return std::min(bucket_max(i), max());
+        }
+    }
+    return max();
+}
+
+uint64_t Histogram::bucket_max(size_t i)
+{
+    if (i < 2 * SUB_BUCKETS)
+    {
+        return i;
+    }
+    unsigned shift = i / SUB_BUCKETS - 1;
+    uint64_t top = i % SUB_BUCKETS + SUB_BUCKETS;
+    // For the very last bucket this wraps around to UINT64_MAX, as it should
+    return ((top + 1) << shift) - 1;
+}
+
+void Metrics::write_json(std::ostream& os)
+{
+    // Names are identifiers we chose, so they need no escaping
+    os << "{\n  \"counters\": {";
+    const char* sep = "\n";
+    for (const Counter* c : counters())
+    {
+        os << sep << "    \"" << c->name() << "\": " << c->value();
+        sep = ",\n";
+    }
+    os << "\n  },\n  \"gauges\": {";
+    sep = "\n";
+    for (const Gauge* g : gauges())
+    {
+        os << sep << "    \"" << g->name() << "\": { \"value\": " << g->value()
+           << ", \"max\": " << g->max() << " }";
+        sep = ",\n";
+    }
+    os << "\n  },\n  \"histograms\": {";
+    sep = "\n";
+    for (const Histogram* h : histograms())
+    {
+        os << sep << "    \"" << h->name() << "\": { \"unit\": \"" << h->unit()
+           << "\", \"count\": " << h->count() << ", \"min\": " << h->min()
+           << ", \"mean\": " << (uint64_t)h->mean();
+        for (size_t i = 0; i < sizeof(QUANTILES) / sizeof(QUANTILES[0]); i++)
+        {
+            os << ", \"" << QUANTILE_NAMES[i] << "\": " << h->quantile(QUANTILES[i]);
+        }
+        os << ", \"max\": " << h->max() << " }";
+        sep = ",\n";
+    }
+    os << "\n  }\n}\n";
+}
+
+bool Metrics::dump(const char* path)
+{
+    if (std::strcmp(path, "-") == 0)
+    {
+        write_json(std::cout);
+        std::cout.flush();
+        return true;
+    }
+    std::ofstream out(path);
+    if (out)
+    {
+        write_json(out);
+        out.close();
+    }
+    if (!out)
+    {
+        std::cerr << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Metrics::serve(const char* path)
+{
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (std::strlen(path) >= sizeof(addr.sun_path))
+    {
+        std::cerr << path << ": socket path too long" << std::endl;
+        return false;
+    }
+    std::strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    listenfd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenfd_ < 0)
+    {
+        std::cerr << "socket(): " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    // A socket left behind by an earlier run would make bind() fail
+    unlink(path);
+    if (bind(listenfd_, (const sockaddr*)&addr, sizeof(addr)) < 0 ||
+            listen(listenfd_, 16) < 0)
+    {
+        std::cerr << path << ": " << std::strerror(errno) << std::endl;
+        close(listenfd_);
+        listenfd_ = -1;
+        return false;
+    }
+    path_ = path;
+    running_ = true;
+    thread_ = std::thread(accept_loop);
+    return true;
+}
+
+void Metrics::stop()
+{
+    if (listenfd_ < 0)
+    {
+        return;
+    }
+    running_ = false;
+    thread_.join();
+    close(listenfd_);
+    listenfd_ = -1;
+    unlink(path_.c_str());
+}
+
+/**
+ * The background thread: writes a snapshot to each connection as it comes
+ * in, until stop()
+ */
+void Metrics::accept_loop()
+{
+    pollfd pfd;
+    pfd.fd = listenfd_;
+    pfd.events = POLLIN;
+    while (running_)
+    {
+        int ret = poll(&pfd, 1, POLL_INTERVAL_MS);
+        if (ret <= 0)
+        {
+            continue;
+        }
+        int fd = accept4(listenfd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+        {
+            continue;
+        }
+        std::ostringstream json;
+        write_json(json);
+        const std::string& s = json.str();
+        if (!write_all(fd, s.data(), s.size()))
+        {
+            std::cerr << "metrics: send(): " << std::strerror(errno) << std::endl;
+        }
+        close(fd);
+    }
+}
+
+// Function-local, so metrics defined at namespace scope in other files can
+// register whatever order they're constructed in
+static std::vector<Counter*>& counters()
+{
+    static std::vector<Counter*> all;
+    return all;
+}
+
+static std::vector<Gauge*>& gauges()
+{
+    static std::vector<Gauge*> all;
+    return all;
+}
+
+static std::vector<Histogram*>& histograms()
+{
+    static std::vector<Histogram*> all;
+    return all;
+}
+
+/**
+ * Sends all len bytes of buf to fd, without SIGPIPE if the reader left
+ *
+ * @return false, with errno set, on failure
+ */
+static bool write_all(int fd, const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t ret = send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
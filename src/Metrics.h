@@ -0,0 +1,213 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>                       // for atomic, memory_order_relaxed
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint64_t, UINT64_MAX
+#include <iosfwd>                       // for ostream
+#include <string>                       // for string
+#include <thread>                       // for thread
+
+/*
+ * Metrics are updated by the threads moving packets (the server's workers,
+ * or the client's streams) and read by the thread serving snapshots.
+ * Updates are relaxed atomic adds, so concurrent ones are never lost and an
+ * uncontended one costs about as much as incrementing an ordinary integer;
+ * a snapshot may be a few updates behind but never tears a value. Metrics
+ * register themselves by name when they're constructed, so they are meant
+ * to be defined once, at namespace scope, next to the code that updates
+ * them; a snapshot lists whichever ones the binary links in.
+ */
+
+/**
+ * Moves a up (raise_to) or down (lower_to) to v unless it's already past
+ * it, so running maxima and minima stay right with several writers
+ */
+inline
+void raise_to(std::atomic<uint64_t>& a, uint64_t v)
+{
+    uint64_t cur = a.load(std::memory_order_relaxed);
+    while (v > cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    {
+    }
+}
+
+inline
+void lower_to(std::atomic<uint64_t>& a, uint64_t v)
+{
+    uint64_t cur = a.load(std::memory_order_relaxed);
+    while (v < cur && !a.compare_exchange_weak(cur, v, std::memory_order_relaxed))
+    {
+    }
+}
+
+/**
+ * A count that only goes up
+ */
+class Counter
+{
+public:
+    explicit Counter(const char* name);
+
+    Counter(const Counter&) = delete;
+    Counter& operator=(const Counter&) = delete;
+
+    void add(uint64_t n = 1)
+    {
+        value_.fetch_add(n, std::memory_order_relaxed);
+    }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+    const char* name() const { return name_; }
+
+private:
+    const char* name_;
+    std::atomic<uint64_t> value_;
+};
+
+/**
+ * A level that goes up and down, and the highest it has been
+ */
+class Gauge
+{
+public:
+    explicit Gauge(const char* name);
+
+    Gauge(const Gauge&) = delete;
+    Gauge& operator=(const Gauge&) = delete;
+
+    void set(uint64_t v)
+    {
+        value_.store(v, std::memory_order_relaxed);
+        raise_to(max_, v);
+    }
+    void add(int64_t n)
+    {
+        raise_to(max_, value_.fetch_add(n, std::memory_order_relaxed) + n);
+    }
+    uint64_t value() const { return value_.load(std::memory_order_relaxed); }
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    const char* name() const { return name_; }
+
+private:
+    const char* name_;
+    std::atomic<uint64_t> value_;
+    std::atomic<uint64_t> max_;
+};
+
+/**
+ * A distribution of values, bucketed as HdrHistogram does: exactly below
+ * 2 * SUB_BUCKETS, then SUB_BUCKETS equal buckets for every power of two
+ * above that, so any value is recorded to within 1/SUB_BUCKETS of itself
+ * with a fixed, small table and no allocation. Recording is a shift and an
+ * index, whatever the range.
+ */
+class Histogram
+{
+public:
+    // buckets per power of two; each is within 1/16 (6%) of its values
+    static const unsigned SUB_BITS = 4;
+    static const uint64_t SUB_BUCKETS = 1 << SUB_BITS;
+    // enough for every uint64_t
+    static const size_t BUCKETS = (65 - SUB_BITS) * SUB_BUCKETS;
+
+    /**
+     * @param unit what values are measured in, for the snapshot, e.g. "us"
+     */
+    Histogram(const char* name, const char* unit);
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void record(uint64_t v)
+    {
+        buckets_[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+        sum_.fetch_add(v, std::memory_order_relaxed);
+        lower_to(min_, v);
+        raise_to(max_, v);
+    }
+
+    uint64_t count() const;
+    uint64_t min() const;
+    uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+    double mean() const;
+    /**
+     * @param q between 0 and 1
+     *
+     * @return the highest value that falls in the same bucket as the q-th
+     * quantile, or 0 if nothing was recorded
+     */
+    uint64_t quantile(double q) const;
+
+    const char* name() const { return name_; }
+    const char* unit() const { return unit_; }
+
+    static size_t bucket(uint64_t v)
+    {
+        if (v < 2 * SUB_BUCKETS)
+        {
+            return v;
+        }
+        // Keep the top SUB_BITS + 1 bits; the leading one picks the power of
+        // two and the rest the sub-bucket within it
+        unsigned shift = 63 - __builtin_clzll(v) - SUB_BITS;
+        return (shift + 1) * SUB_BUCKETS + (v >> shift) - SUB_BUCKETS;
+    }
+    // the highest value in bucket i
+    static uint64_t bucket_max(size_t i);
+
+private:
+    const char* name_;
+    const char* unit_;
+    std::atomic<uint64_t> buckets_[BUCKETS];
+    std::atomic<uint64_t> sum_;
+    std::atomic<uint64_t> min_;
+    std::atomic<uint64_t> max_;
+};
+
+/**
+ * Snapshots of every registered metric, as JSON, for watching a transfer
+ * while it runs: once serve() is called, anything that connects to the Unix
+ * socket gets the current snapshot and is disconnected, e.g.
+ *
+ *     socat - UNIX-CONNECT:server.sock
+ */
+class Metrics
+{
+public:
+    /**
+     * Writes a snapshot as one JSON object: counters by name, gauges as
+     * their value and max, and histograms as their count, min, mean, max
+     * and percentiles
+     */
+    static void write_json(std::ostream& os);
+
+    /**
+     * Writes a snapshot to path, or to stdout if path is "-"
+     *
+     * @return false, with a message on stderr, if path can't be written
+     */
+    static bool dump(const char* path);
+
+    /**
+     * Starts answering connections on a Unix socket at path from a
+     * background thread. Replaces whatever is at path.
+     *
+     * @return false, with a message on stderr, if the socket can't be made
+     */
+    static bool serve(const char* path);
+
+    /**
+     * Stops serving and removes the socket
+     */
+    static void stop();
+
+private:
+    static void accept_loop();
+
+    static int listenfd_;
+    static std::string path_;
+    static std::atomic<bool> running_;
+    static std::thread thread_;
+};
+
+#endif
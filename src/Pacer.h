@@ -0,0 +1,114 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <algorithm>                    // for max
+#include <chrono>                       // for duration, microseconds
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint64_t
+#include <ostream>                      // for ostream, operator<<
+
+/*
+ * Static Variables
+ */
+// how much sending time may be saved up while idle and then spent at once,
+// like TCP's TSO autosizing: waking up for every segment at high rates
+// costs more than a millisecond's burst does
+static const std::chrono::microseconds pacing_quantum(1000);
+// segments that may always go out back to back, however slow the rate
+static const size_t pacing_min_burst = 2;
+
+/**
+ * Spreads segments out at a rate instead of sending a window in one burst.
+ *
+ * The pacer doesn't wait itself: the sender asks ready() before each
+ * segment, tells on_send() when it sends one, and sleeps until ready_at()
+ * when it has to. With a horizon, segments may be handed over that much
+ * before they are due, stamped with the time they should leave, for the
+ * kernel (SO_TXTIME and the fq qdisc) to hold until then.
+ */
+class Pacer
+{
+public:
+    using time_point = std::chrono::high_resolution_clock::time_point;
+    using duration = std::chrono::microseconds;
+
+    Pacer() :
+        rate_(0), horizon_(0), bytes_(0) {}
+
+    /**
+     * @param rate bytes per second, or 0 to stop pacing
+     */
+    void set_rate(double rate) { rate_ = rate; }
+    void set_horizon(duration horizon) { horizon_ = horizon; }
+
+    /**
+     * @return true if a segment may be handed over at time t
+     */
+    bool ready(time_point t) const
+    {
+        return rate_ <= 0 || next_ <= t + horizon_;
+    }
+
+    /**
+     * Accounts for a segment of len bytes handed over at time t
+     *
+     * @return when it should leave
+     */
+    time_point on_send(size_t len, time_point t)
+    {
+        time_point departure = t;
+        if (rate_ > 0)
+        {
+            // Credit saved up while idle is capped at a quantum
+            time_point::duration credit = pacing_quantum;
+            credit = std::max(credit, gap(pacing_min_burst * len));
+            next_ = std::max(next_, t - credit);
+            departure = std::max(next_, t);
+            next_ += gap(len);
+        }
+        if (bytes_ == 0)
+        {
+            first_ = departure;
+        }
+        last_ = departure;
+        bytes_ += len;
+        return departure;
+    }
+
+    // when ready() turns true, if it isn't
+    time_point ready_at() const { return next_ - horizon_; }
+    double rate() const { return rate_; }
+
+    /**
+     * @return the average rate segments actually left at, in bytes per second
+     */
+    double achieved() const
+    {
+        double secs = std::chrono::duration<double>(last_ - first_).count();
+        return secs > 0 ? bytes_ / secs : 0;
+    }
+
+private:
+    // how long len bytes take at rate_
+    time_point::duration gap(size_t len) const
+    {
+        return std::chrono::duration_cast<time_point::duration>(
+                std::chrono::duration<double>(len / rate_));
+    }
+
+    double rate_;
+    duration horizon_;
+    time_point next_;
+    uint64_t bytes_;
+    time_point first_;
+    time_point last_;
+};
+
+inline
+std::ostream& operator<<(std::ostream& os, const Pacer& p)
+{
+    os << "paced at " << (uint64_t)p.achieved() << " B/s";
+    return os;
+}
+
+#endif
@@ -1,6 +1,8 @@
 #ifndef PACKET_H
 #define PACKET_H
 
+#include "Checksum.h"                   // for crc32c
+
 #include <algorithm>                    // for uniform_int_distribution, move
 #include <chrono>                       // for high_resolution_clock
 #include <cstddef>                      // for size_t
@@ -12,15 +14,20 @@
 
 #include <arpa/inet.h>                  // for htons, htonl, ntohs, etc
 
+/**
+ * A range of sequence numbers [start, end) the client has received past its
+ * cumulative ack
+ */
+struct SackBlock
+{
+    uint32_t start;
+    uint32_t end;
+};
+
 struct Packet
 {
     struct {
-        uint16_t ack_number;
-        uint16_t seq_number;
-        union {
-            uint16_t data_len; // used by server to keep track of how big packet is
-            uint16_t window_sz; // used by client to report its window size
-        };
+        uint8_t version; // WIRE_VERSION; anything else is dropped
     #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
         bool ack : 1;
         bool syn : 1;
@@ -34,55 +41,394 @@ struct Packet
     #else
     #error "Unknown endian or __BYTE_ORDER__ not defined"
     #endif
+        uint16_t conn_id; // chosen by the client, echoed on every packet
+        uint32_t ack_number;
+        uint32_t seq_number;
+        union {
+            uint16_t data_len; // used by server to keep track of how big packet is
+            uint16_t window_sz; // used by client to report its window size
+        };
+        uint8_t opt_len; // bytes of options between the header and the payload
+        uint8_t _reserved;
     } headers;
 
-    static const size_t PKT_SZ    = 1032;
-    static const size_t DATA_SZ   = 1024;
+    /**
+     * Options are TCP-style (kind, length, value) triples packed into the
+     * first opt_len bytes of data, ahead of the payload
+     */
+    enum Option : uint8_t {
+        OPT_WSCALE = 1, // SYN/SYN-ACK: shift applied to window_sz in acks
+        OPT_FILE_SIZE = 2, // SYN-ACK: the file's length, 8 bytes big-endian
+        OPT_SACK_PERMITTED = 3, // SYN/SYN-ACK: acks may carry OPT_SACK
+        OPT_SACK = 4,   // acks: up to MAX_SACK_BLOCKS SackBlocks, big-endian
+        OPT_TIMESTAMP = 5, // any packet once negotiated in SYN/SYN-ACK: the
+                           // sender's clock and the peer's latest one echoed
+        OPT_CONGESTION = 6, // SYN: name of the congestion control the client
+                            // would like the server to use
+        OPT_STREAMS = 7, // SYN/SYN-ACK: this connection's index among the
+                         // streams the file is split across and how many
+                         // there are (1 byte each); see stream_range()
+        OPT_MSS = 8,    // 2 bytes big-endian. SYN: the largest segment the
+                        // client takes. SYN-ACK: the size this one probes
+                        // for. Handshake ACK: the largest that got through.
+        OPT_FEC = 9,    // SYN/SYN-ACK: the shortest and longest blocks of
+                        // data segments a parity segment may cover (1 byte
+                        // each). Data: marks a parity segment for the block
+                        // of segments from seq_number on; see add_parity().
+                        // Acks: how many segments the client has rebuilt
+                        // from parity so far, 4 bytes big-endian.
+        OPT_CHECKSUM = 10, // SYN/SYN-ACK: empty, segments will carry one.
+                           // Data: the CRC32C of the payload. FIN: the
+                           // CRC32C of the whole file (or this stream's
+                           // range of it). 4 bytes big-endian.
+        OPT_COMPRESS = 11, // SYN/SYN-ACK: the compression the data is sent
+                           // with (1 byte, COMPRESS_DEFLATE); sequence
+                           // numbers then count bytes of the compressed
+                           // stream. See Compress.h.
+        OPT_RESUME = 12, // SYN: empty, the client can resume. SYN-ACK: the
+                         // file's fingerprint(), 4 bytes. Handshake ACK:
+                         // that fingerprint and the file offset to start
+                         // from, 8 bytes. Big-endian.
+        OPT_TICKET = 13, // SYN: empty, the client wants a ticket, or one it
+                         // got before, 4 bytes. SYN-ACK: the ticket for the
+                         // client's address; the one it sent, if the data
+                         // follows without waiting for the handshake ACK.
+                         // Never with OPT_RESUME. See FastOpen.h.
+    };
+
+    // OPT_COMPRESS's methods
+    static const uint8_t COMPRESS_DEFLATE = 1;
+
+    static const uint8_t WIRE_VERSION = 3;
+    // Room for every option a SYN-ACK may carry at once
+    static const size_t OPT_SZ    = 48;
     static const size_t HEADER_SZ = sizeof(headers);
-    static const size_t SEQ_MAX   = 15360;
+    // IPv4 and UDP headers, which the path MTU also has to carry
+    static const size_t IP_UDP_SZ = 28;
+    // Segments are this long unless the handshake settles on more (OPT_MSS);
+    // it's what every datagram used to carry, so it is assumed to fit
+    static const size_t MIN_MSS   = 1024;
+    // what fits a 9000-byte jumbo frame along with all the headers
+    static const size_t MAX_MSS   = 9000 - IP_UDP_SZ - HEADER_SZ - OPT_SZ;
+    static const uint8_t MAX_WSCALE = 14; // keeps windows under 2^30
+    static const size_t MAX_SACK_BLOCKS = (OPT_SZ - 2) / sizeof(SackBlock);
 
-    char data[DATA_SZ];
+    // Only the options: payloads are sent from and received into buffers of
+    // their own (see SendBatch and RecvBatch), sized for the connection's MSS
+    char data[OPT_SZ];
 
     Packet()
     {
-        static_assert(sizeof(Packet) == PKT_SZ,
+        static_assert(sizeof(Packet) == HEADER_SZ + OPT_SZ,
                 "Incorrect packet size");
+        static_assert(HEADER_SZ == 16, "Incorrect header size");
         clear();
     }
     Packet(const Packet&) = delete; // Copying a Packet will be slow
     Packet& operator=(const Packet&) = delete;
     Packet(Packet&&) = default; // Moving a Packet will be fast!
     Packet& operator=(Packet&&) = default;
-    void clear() { std::memset(&headers, 0, HEADER_SZ); }
+    void clear()
+    {
+        std::memset(&headers, 0, HEADER_SZ);
+        headers.version = WIRE_VERSION;
+    }
     void to_network()
     {
-        headers.ack_number = htons(headers.ack_number);
-        headers.seq_number = htons(headers.seq_number);
+        headers.conn_id = htons(headers.conn_id);
+        headers.ack_number = htonl(headers.ack_number);
+        headers.seq_number = htonl(headers.seq_number);
         headers.window_sz = htons(headers.window_sz);
     }
     void to_host()
     {
-        headers.ack_number = ntohs(headers.ack_number);
-        headers.seq_number = ntohs(headers.seq_number);
+        headers.conn_id = ntohs(headers.conn_id);
+        headers.ack_number = ntohl(headers.ack_number);
+        headers.seq_number = ntohl(headers.seq_number);
         headers.window_sz = ntohs(headers.window_sz);
     }
+    /**
+     * Checks that a datagram of len bytes holds a whole header of our wire
+     * version and all of its options. Works in either byte order.
+     */
+    bool valid(size_t len) const
+    {
+        return len >= HEADER_SZ && headers.version == WIRE_VERSION &&
+               headers.opt_len <= OPT_SZ && HEADER_SZ + headers.opt_len <= len;
+    }
+    /**
+     * Bytes on the wire for this packet: header, options and data_len bytes
+     * of payload (pass with_payload = false for acks, which reuse data_len as
+     * window_sz)
+     */
+    size_t size(bool with_payload = true) const
+    {
+        return HEADER_SZ + headers.opt_len + (with_payload ? headers.data_len : 0);
+    }
+    /**
+     * The longest datagram a segment of mss bytes can make
+     */
+    static size_t datagram_size(size_t mss)
+    {
+        return HEADER_SZ + OPT_SZ + mss;
+    }
+    /**
+     * The largest segment whose datagrams fit a path MTU of mtu bytes
+     */
+    static size_t mss_for_mtu(size_t mtu)
+    {
+        size_t overhead = IP_UDP_SZ + HEADER_SZ + OPT_SZ;
+        return mtu > overhead ? mtu - overhead : 0;
+    }
+    /**
+     * Appends an option. Options must be added before the payload is filled.
+     *
+     * @return false if there isn't room for it
+     */
+    bool add_option(uint8_t kind, const void* value, uint8_t len)
+    {
+        if (headers.opt_len + 2u + len > OPT_SZ)
+        {
+            return false;
+        }
+        uint8_t* opt = (uint8_t*)data + headers.opt_len;
+        opt[0] = kind;
+        opt[1] = len;
+        if (len > 0)
+        {
+            std::memcpy(opt + 2, value, len);
+        }
+        headers.opt_len += 2 + len;
+        return true;
+    }
+    /**
+     * @return a pointer to the value of option kind if it is present with
+     * exactly len bytes of value, nullptr otherwise
+     */
+    const uint8_t* find_option(uint8_t kind, uint8_t len) const
+    {
+        uint8_t found_len;
+        const uint8_t* value = find_option_any(kind, found_len);
+        return value != nullptr && found_len == len ? value : nullptr;
+    }
+    /**
+     * @return a pointer to the value of option kind, whatever its length
+     * (which goes in len), or nullptr if it isn't present
+     */
+    const uint8_t* find_option_any(uint8_t kind, uint8_t& len) const
+    {
+        const uint8_t* opt = (const uint8_t*)data;
+        const uint8_t* end = opt + headers.opt_len;
+        while (opt + 2 <= end && opt + 2 + opt[1] <= end)
+        {
+            if (opt[0] == kind)
+            {
+                len = opt[1];
+                return opt + 2;
+            }
+            opt += 2 + opt[1];
+        }
+        return nullptr;
+    }
+    /**
+     * Appends an OPT_SACK option with as many of the n blocks as there is
+     * room for, first ones first
+     */
+    void add_sack(const SackBlock* blocks, size_t n)
+    {
+        size_t used = headers.opt_len + 2;
+        size_t room = used < OPT_SZ ? (OPT_SZ - used) / sizeof(SackBlock) : 0;
+        n = n < room ? n : room;
+        if (n == 0)
+        {
+            return;
+        }
+        uint32_t value[2 * MAX_SACK_BLOCKS];
+        for (size_t i = 0; i < n; i++)
+        {
+            value[2 * i] = htonl(blocks[i].start);
+            value[2 * i + 1] = htonl(blocks[i].end);
+        }
+        add_option(OPT_SACK, value, n * sizeof(SackBlock));
+    }
+    /**
+     * Appends an OPT_MSS option
+     */
+    void add_mss(uint16_t mss)
+    {
+        uint16_t value = htons(mss);
+        add_option(OPT_MSS, &value, sizeof(value));
+    }
+    /**
+     * @return the value of the OPT_MSS option, or 0 if there is none
+     */
+    uint16_t get_mss() const
+    {
+        const uint8_t* value = find_option(OPT_MSS, sizeof(uint16_t));
+        if (value == nullptr)
+        {
+            return 0;
+        }
+        uint16_t mss;
+        std::memcpy(&mss, value, sizeof(mss));
+        return ntohs(mss);
+    }
+    /**
+     * Appends an OPT_FEC option making this a parity segment
+     *
+     * @param count how many data segments its block has
+     * @param lengths their lengths XORed together, so the one a parity
+     * rebuilds gets its length back too
+     */
+    void add_parity(uint8_t count, uint16_t lengths)
+    {
+        uint8_t value[3] = { count, (uint8_t)(lengths >> 8), (uint8_t)lengths };
+        add_option(OPT_FEC, value, sizeof(value));
+    }
+    /**
+     * @return false if this isn't a parity segment
+     */
+    bool get_parity(uint8_t& count, uint16_t& lengths) const
+    {
+        const uint8_t* value = find_option(OPT_FEC, 3);
+        if (value == nullptr)
+        {
+            return false;
+        }
+        count = value[0];
+        lengths = (uint16_t)(value[1] << 8 | value[2]);
+        return true;
+    }
+    /**
+     * Appends an OPT_CHECKSUM option carrying crc
+     */
+    void add_checksum(uint32_t crc)
+    {
+        uint32_t value = htonl(crc);
+        add_option(OPT_CHECKSUM, &value, sizeof(value));
+    }
+    /**
+     * @return false if there is no OPT_CHECKSUM option with a value
+     */
+    bool get_checksum(uint32_t& crc) const
+    {
+        const uint8_t* value = find_option(OPT_CHECKSUM, sizeof(uint32_t));
+        if (value == nullptr)
+        {
+            return false;
+        }
+        std::memcpy(&crc, value, sizeof(crc));
+        crc = ntohl(crc);
+        return true;
+    }
+    /**
+     * Appends the OPT_CHECKSUM of a data or parity segment whose payload's
+     * CRC32C is crc. It goes on over the sequence number (which must be set
+     * first), so a segment whose header was damaged isn't taken for another.
+     */
+    void add_segment_checksum(uint32_t crc)
+    {
+        add_checksum(segment_checksum(crc));
+    }
+    /**
+     * @return true if this segment's OPT_CHECKSUM is there and matches crc,
+     * its payload's CRC32C
+     */
+    bool check_segment(uint32_t crc) const
+    {
+        uint32_t found;
+        return get_checksum(found) && found == segment_checksum(crc);
+    }
+    /**
+     * @return crc, a payload's CRC32C, carried on over seq_number
+     */
+    uint32_t segment_checksum(uint32_t crc) const
+    {
+        uint32_t seq = htonl(headers.seq_number);
+        return crc32c(crc, &seq, sizeof(seq));
+    }
+    /**
+     * Appends an OPT_TIMESTAMP option
+     *
+     * @param tsval the sender's timestamp() when it sent the packet
+     * @param tsecr the tsval being echoed back, or 0 for none
+     */
+    void add_timestamp(uint32_t tsval, uint32_t tsecr)
+    {
+        uint32_t value[2] = { htonl(tsval), htonl(tsecr) };
+        add_option(OPT_TIMESTAMP, value, sizeof(value));
+    }
+    /**
+     * @return false if there is no OPT_TIMESTAMP option
+     */
+    bool get_timestamp(uint32_t& tsval, uint32_t& tsecr) const
+    {
+        const uint8_t* value = find_option(OPT_TIMESTAMP, 2 * sizeof(uint32_t));
+        if (value == nullptr)
+        {
+            return false;
+        }
+        uint32_t fields[2];
+        std::memcpy(fields, value, sizeof(fields));
+        tsval = ntohl(fields[0]);
+        tsecr = ntohl(fields[1]);
+        return true;
+    }
+    /**
+     * Reads the blocks of an OPT_SACK option into blocks, which must have
+     * room for MAX_SACK_BLOCKS
+     *
+     * @return how many there were
+     */
+    size_t get_sack(SackBlock* blocks) const
+    {
+        uint8_t len;
+        const uint8_t* value = find_option_any(OPT_SACK, len);
+        if (value == nullptr)
+        {
+            return 0;
+        }
+        size_t n = len / sizeof(SackBlock);
+        n = n < MAX_SACK_BLOCKS ? n : MAX_SACK_BLOCKS;
+        for (size_t i = 0; i < n; i++)
+        {
+            uint32_t edges[2];
+            std::memcpy(edges, value + i * sizeof(SackBlock), sizeof(edges));
+            blocks[i].start = ntohl(edges[0]);
+            blocks[i].end = ntohl(edges[1]);
+        }
+        return n;
+    }
 };
 
 /**
- * structure used by server to keep track of sent packets, what time they were
- * sent, if they were retransmitted, etc
+ * structure used by server to keep track of sent segments, what time they
+ * were sent, if they were retransmitted, etc. The payload isn't copied in
+ * here; it points into the server's memory-mapped file, so a retransmission
+ * sends from the same place again.
  */
 struct PacketWrapper
 {
     // 'using x = y' is like 'typedef y x' and gives us the shorthand time_point
     // to represent the type returned by the now() function
     using time_point = decltype(std::chrono::high_resolution_clock::now());
-    PacketWrapper(Packet&& p) :
-        packet(std::move(p)), sent(false), retransmit(false) {}
-    Packet packet;
+    PacketWrapper() :
+        payload(nullptr), seq_number(0), data_len(0), sent(false),
+        retransmit(false), sacked(false), fec_block(0), crc(0), delivered(0) {}
+    const char* payload;
+    uint32_t seq_number;
+    uint16_t data_len;
     time_point send_time;
     bool sent;
     bool retransmit;
+    bool sacked; // the client reported having it in a SACK block
+    // the sequence number of the first segment of its FEC block, once sent
+    uint32_t fec_block;
+    // the CRC32C of the payload, if the connection carries OPT_CHECKSUM
+    uint32_t crc;
+    // the connection's delivery count and time as of when this was sent
+    uint64_t delivered;
+    time_point delivered_time;
 };
 
 /*
@@ -96,45 +442,191 @@ inline
 std::ostream& operator<<(std::ostream& os, const Packet& p)
 {
     os << "ack: " << p.headers.ack << "|fin: " << p.headers.fin << "|syn: "
-       << p.headers.syn << "|ack_number: " << std::setw(5) << p.headers.ack_number
-       << "|seq_number: " << std::setw(5) << p.headers.seq_number << "|data_len: "
+       << p.headers.syn << "|ack_number: " << std::setw(10) << p.headers.ack_number
+       << "|seq_number: " << std::setw(10) << p.headers.seq_number << "|data_len: "
        << p.headers.data_len;
     return os;
 }
 
 /**
- * Generates a random sequence number in range [0, SEQ_MAX]
+ * The generator behind get_isn() and get_conn_id(): one per thread, so the
+ * server's workers and the client's streams don't share it, each seeded
+ * from std::random_device, which is more random than C-style rand()
+ */
+inline
+std::mt19937& random_engine()
+{
+    thread_local std::random_device rd;
+    thread_local std::mt19937 rndgen(rd());
+    return rndgen;
+}
+
+/**
+ * Makes get_isn() and get_conn_id() on this thread repeat the same sequence
+ * every time, for reproducible simulations
+ */
+inline
+void seed_random(uint32_t seed)
+{
+    random_engine().seed(seed);
+}
+
+/**
+ * Generates a random 32-bit initial sequence number
  */
 inline
 uint32_t get_isn()
 {
-    // Create the random devices and generators--static so they are only
-    // initialized once. These are more random than C-style rand()
-    static std::random_device rd;
-    static std::mt19937 rndgen(rd());
-    static std::uniform_int_distribution<> dist(0, Packet::SEQ_MAX);
+    std::uniform_int_distribution<uint32_t> dist;
     // Return a value from the uniform distribution
-    return dist(rndgen);
+    return dist(random_engine());
 }
 
 /**
- * Handles modulo addition to the sequence number
+ * Generates a random, nonzero connection ID for the client to put in its SYN
+ */
+inline
+uint16_t get_conn_id()
+{
+    std::uniform_int_distribution<> dist(1, UINT16_MAX);
+    return dist(random_engine());
+}
+
+/**
+ * Adds to a sequence number; sequence numbers wrap modulo 2^32
  */
 inline
 uint32_t add_seq(uint32_t base, uint32_t add)
 {
-    return (base + add) % Packet::SEQ_MAX;
+    return base + add;
+}
+
+/**
+ * Serial number arithmetic (RFC 1982): the signed distance from b to a, which
+ * is meaningful as long as the two are less than 2^31 apart
+ */
+inline
+int32_t seq_diff(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b);
+}
+
+/**
+ * True if sequence number a comes before b
+ */
+inline
+bool seq_lt(uint32_t a, uint32_t b)
+{
+    return seq_diff(a, b) < 0;
+}
+
+/**
+ * True if sequence number a comes before or is equal to b
+ */
+inline
+bool seq_leq(uint32_t a, uint32_t b)
+{
+    return seq_diff(a, b) <= 0;
+}
+
+/**
+ * The smallest window scale shift that lets window fit in a 16 bit window_sz
+ */
+inline
+uint8_t window_shift(uint32_t window)
+{
+    uint8_t shift = 0;
+    while (shift < Packet::MAX_WSCALE && (window >> shift) > UINT16_MAX)
+    {
+        shift++;
+    }
+    return shift;
+}
+
+/**
+ * A contiguous part of a file: bytes [start, end)
+ */
+struct ByteRange
+{
+    uint64_t start;
+    uint64_t end;
+    uint64_t size() const { return end - start; }
+};
+
+/**
+ * The part of a file of file_size bytes that the index-th of count streams
+ * carries (OPT_STREAMS): whole blocks of MIN_MSS bytes, split as evenly as
+ * they go. Every stream settles on its own MSS and cuts its part into
+ * segments of that from the start, so only each part's last segment may be
+ * short. The server never grants more streams than the file has blocks, so
+ * none is empty.
+ */
+inline
+ByteRange stream_range(uint64_t file_size, unsigned index, unsigned count)
+{
+    uint64_t blocks = (file_size + Packet::MIN_MSS - 1) / Packet::MIN_MSS;
+    ByteRange r;
+    r.start = std::min(blocks * index / count * Packet::MIN_MSS, file_size);
+    r.end = std::min(blocks * (index + 1) / count * Packet::MIN_MSS, file_size);
+    return r;
 }
 
+/**
+ * Where now() gets the time from, when it isn't the system clock: a
+ * simulation installs one that only moves when it says so
+ */
+class Clock
+{
+public:
+    virtual ~Clock() {}
+    virtual PacketWrapper::time_point now() const = 0;
+
+    /**
+     * The clock now() reads; nullptr (the default) for the system clock
+     */
+    static Clock*& current()
+    {
+        static Clock* clock = nullptr;
+        return clock;
+    }
+};
+
 /**
  * Returns the current time
  */
 inline
 PacketWrapper::time_point now()
 {
+    const Clock* clock = Clock::current();
+    if (clock != nullptr)
+    {
+        return clock->now();
+    }
     return std::chrono::high_resolution_clock::now();
 }
 
+/**
+ * The current time as an OPT_TIMESTAMP value: microseconds on this host's
+ * clock, wrapping modulo 2^32 (so never compare two that are more than an
+ * hour apart). Never 0, which means "no timestamp" in an echo.
+ */
+inline
+uint32_t timestamp(PacketWrapper::time_point t = now())
+{
+    using namespace std::chrono;
+    uint32_t ts = duration_cast<microseconds>(t.time_since_epoch()).count();
+    return ts != 0 ? ts : 1;
+}
+
+/**
+ * The time elapsed since an echoed OPT_TIMESTAMP value
+ */
+inline
+std::chrono::microseconds since_timestamp(uint32_t ts)
+{
+    return std::chrono::microseconds(timestamp() - ts);
+}
+
 /**
  * Converts a std::chrono duration to a timeval
  */
@@ -0,0 +1,173 @@
+#ifndef REORDER_BUFFER_H
+#define REORDER_BUFFER_H
+
+#include "Packet.h"                     // for add_seq
+
+#include <algorithm>                    // for min
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint16_t, uint32_t, uint64_t
+#include <cstring>                      // for memcpy
+#include <vector>                       // for vector
+
+/**
+ * The client's reassembly buffer for out-of-order segments: a circular buffer
+ * of segment-sized slots, allocated once, with a bitmap saying which slots
+ * hold data.
+ *
+ * The server only sends whole segments (except the last one of the file), so
+ * a segment's slot is just its distance from the next expected sequence
+ * number in segments. Inserting, spotting duplicates and draining in order
+ * are all O(1) and never allocate.
+ */
+class ReorderBuffer
+{
+public:
+    /**
+     * @param next_seq the next sequence number the client expects
+     * @param segment_sz the size of every segment but the last
+     * @param window bytes of out-of-order data to make room for
+     */
+    ReorderBuffer(uint32_t next_seq, size_t segment_sz, size_t window) :
+        segment_sz_(segment_sz), head_(0), count_(0), next_seq_(next_seq)
+    {
+        size_t slots = 1;
+        while (slots * segment_sz < window)
+        {
+            slots <<= 1;
+        }
+        mask_ = slots - 1;
+        data_.resize(slots * segment_sz);
+        lengths_.resize(slots);
+        present_.resize((slots + 63) / 64);
+    }
+
+    ReorderBuffer(const ReorderBuffer&) = delete;
+    ReorderBuffer& operator=(const ReorderBuffer&) = delete;
+
+    // the sequence number of the next in-order byte
+    uint32_t next_seq() const { return next_seq_; }
+    // number of out-of-order segments held
+    size_t size() const { return count_; }
+    // bytes of sequence space the buffer covers past next_seq()
+    size_t window() const { return (mask_ + 1) * segment_sz_; }
+
+    /**
+     * Stores a copy of an out-of-order segment
+     *
+     * @return false if the segment isn't past next_seq(), doesn't start on a
+     * segment boundary, doesn't fit in the window, or is a duplicate
+     */
+    bool insert(uint32_t seq, const char* data, size_t len)
+    {
+        uint32_t offset = seq - next_seq_;
+        if (offset == 0 || offset % segment_sz_ != 0 || len > segment_sz_)
+        {
+            return false;
+        }
+        size_t distance = offset / segment_sz_;
+        if (distance > mask_)
+        {
+            return false;
+        }
+        size_t slot = (head_ + distance) & mask_;
+        if (test(slot))
+        {
+            return false;
+        }
+        std::memcpy(&data_[slot * segment_sz_], data, len);
+        lengths_[slot] = len;
+        present_[slot / 64] |= (uint64_t)1 << (slot % 64);
+        count_++;
+        return true;
+    }
+
+    /**
+     * Moves past an in-order segment of len bytes that the caller consumed
+     * without storing it
+     */
+    void skip(size_t len)
+    {
+        next_seq_ = add_seq(next_seq_, len);
+        head_ = (head_ + 1) & mask_;
+    }
+
+    /**
+     * @return the stored segment at next_seq(), or nullptr if we don't have
+     * it yet; its length goes in len
+     */
+    const char* front(size_t& len) const
+    {
+        if (!test(head_))
+        {
+            return nullptr;
+        }
+        len = lengths_[head_];
+        return &data_[head_ * segment_sz_];
+    }
+
+    /**
+     * Releases the segment returned by front()
+     */
+    void pop_front()
+    {
+        present_[head_ / 64] &= ~((uint64_t)1 << (head_ % 64));
+        count_--;
+        skip(lengths_[head_]);
+    }
+
+    /**
+     * @return the distance in segments past next_seq() of the first slot at
+     * or after distance that holds a segment (or, if present is false, that
+     * doesn't); window() / segment_sz if there is none
+     */
+    size_t find(size_t distance, bool present) const
+    {
+        size_t slots = mask_ + 1;
+        while (distance < slots)
+        {
+            // Check the rest of the slot's bitmap word at once, up to where
+            // the word (or the ring) ends
+            size_t slot = (head_ + distance) & mask_;
+            size_t span = std::min(std::min(64 - slot % 64, slots - slot),
+                                   slots - distance);
+            uint64_t bits = present ? present_[slot / 64] : ~present_[slot / 64];
+            bits >>= slot % 64;
+            if (span < 64)
+            {
+                bits &= ((uint64_t)1 << span) - 1;
+            }
+            if (bits != 0)
+            {
+                return distance + __builtin_ctzll(bits);
+            }
+            distance += span;
+        }
+        return slots;
+    }
+
+    /**
+     * @return the length of the segment held distance segments past
+     * next_seq()
+     */
+    size_t length(size_t distance) const
+    {
+        return lengths_[(head_ + distance) & mask_];
+    }
+
+private:
+    bool test(size_t slot) const
+    {
+        return (present_[slot / 64] >> (slot % 64)) & 1;
+    }
+
+    size_t segment_sz_;
+    size_t mask_;
+    size_t head_;           // slot for next_seq_
+    size_t count_;
+    uint32_t next_seq_;
+    std::vector<char> data_;
+    std::vector<uint16_t> lengths_;
+    std::vector<uint64_t> present_;
+};
+
+#endif
@@ -0,0 +1,124 @@
+#include "Resume.h"
+
+#include "Checksum.h"                   // for crc32c
+
+#include <cerrno>                       // for errno
+#include <cstddef>                      // for offsetof
+#include <cstring>                      // for memcmp, memcpy, memset, strerror
+#include <stdexcept>                    // for runtime_error
+
+#include <fcntl.h>                      // for open, sync_file_range
+#include <sys/stat.h>                   // for fstat
+#include <unistd.h>                     // for pread, pwrite, fdatasync, close
+
+/*
+ * Static Variables
+ */
+static const char MAGIC[8] = { 'R', 'E', 'S', 'U', 'M', 'E', '0', '1' };
+
+/*
+ * Implementations
+ */
+ResumeRecord::ResumeRecord(const std::string& output, unsigned stream) :
+    stream_(stream), flushing_(0)
+{
+    static_assert(sizeof(Slot) == 64, "Incorrect resume slot size");
+    std::memset(&slot_, 0, sizeof(slot_));
+    data_fd_ = open(output.c_str(), O_RDWR | O_CREAT, 0644);
+    if (data_fd_ < 0)
+    {
+        throw std::runtime_error(std::string("open(): ") + std::strerror(errno));
+    }
+    fd_ = open(path(output).c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd_ < 0)
+    {
+        int err = errno;
+        close(data_fd_);
+        throw std::runtime_error(std::string("open(): ") + std::strerror(err));
+    }
+}
+
+ResumeRecord::~ResumeRecord()
+{
+    close(fd_);
+    close(data_fd_);
+}
+
+uint64_t ResumeRecord::start(uint64_t file_size, uint32_t fingerprint,
+                             unsigned streams, const ByteRange& part)
+{
+    Slot old;
+    std::memset(&old, 0, sizeof(old));
+    bool found = pread(fd_, &old, sizeof(old), stream_ * sizeof(Slot)) ==
+                 (ssize_t)sizeof(old) &&
+                 old.crc == crc32c(0, &old, offsetof(Slot, crc));
+    uint64_t old_done = old.done;
+    // A slot is no good if output has been replaced or cut short since
+    struct stat st;
+    if (fstat(data_fd_, &st) < 0)
+    {
+        std::memset(&st, 0, sizeof(st));
+    }
+    found = found && (uint64_t)st.st_size == file_size;
+
+    std::memcpy(slot_.magic, MAGIC, sizeof(MAGIC));
+    slot_.file_size = file_size;
+    slot_.fingerprint = fingerprint;
+    slot_.stream = stream_;
+    slot_.streams = streams;
+    slot_.start = part.start;
+    slot_.end = part.end;
+    slot_.done = part.start;
+    slot_.inode = st.st_ino;
+    // Everything but how far it got has to match
+    old.done = slot_.done;
+    old.crc = slot_.crc;
+    found = found && std::memcmp(&old, &slot_, sizeof(Slot)) == 0 &&
+            old_done >= part.start && old_done <= part.end;
+    uint64_t done = found ? old_done : part.start;
+    flushing_ = done;
+    write_slot(done);
+    return done;
+}
+
+void ResumeRecord::advance(uint64_t done)
+{
+    if (done < flushing_ + INTERVAL)
+    {
+        return;
+    }
+    // The bytes we started writing back last time have had an interval to
+    // get to the disk, so this rarely waits; once they are there, the slot
+    // can vouch for them
+    if (flushing_ > slot_.done)
+    {
+        sync_file_range(data_fd_, slot_.done, flushing_ - slot_.done,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+        write_slot(flushing_);
+    }
+    sync_file_range(data_fd_, flushing_, done - flushing_, SYNC_FILE_RANGE_WRITE);
+    flushing_ = done;
+}
+
+void ResumeRecord::finish(bool intact)
+{
+    if (intact)
+    {
+        fdatasync(data_fd_);
+    }
+    flushing_ = intact ? slot_.end : slot_.start;
+    write_slot(flushing_);
+}
+
+/**
+ * Moves our slot on to say the part is written up to done
+ */
+void ResumeRecord::write_slot(uint64_t done)
+{
+    slot_.done = done;
+    slot_.crc = crc32c(0, &slot_, offsetof(Slot, crc));
+    // Only ever a record of progress; losing an update just means sending
+    // a little more again
+    pwrite(fd_, &slot_, sizeof(slot_), stream_ * sizeof(Slot));
+}
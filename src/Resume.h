@@ -0,0 +1,97 @@
+#ifndef RESUME_H
+#define RESUME_H
+
+#include "Packet.h"                     // for ByteRange
+
+#include <cstdint>                      // for uint16_t, uint32_t, uint64_t
+#include <string>                       // for string
+
+/**
+ * How far a client has got with each stream's part of the file, kept next to
+ * the output file (as path()) so a transfer that dies can be picked up again
+ * with -r without sending anything twice that made it to the disk.
+ *
+ * Every stream has a fixed-size slot of its own in the record, so the
+ * streams' threads never touch each other's. A slot says which file (by its
+ * size and the server's fingerprint) and which part of it it is for, the
+ * output file's inode, and how far from the start of the part everything
+ * has been written. It is only moved on once the data it vouches for is on
+ * the disk, and it carries its own CRC32C, so a slot torn by a crash reads
+ * as no slot at all.
+ */
+class ResumeRecord
+{
+public:
+    // how far a stream gets between updates of its slot
+    static const uint64_t INTERVAL = 16 * 1024 * 1024;
+
+    /**
+     * Opens the record of output for stream, creating it (and output) if
+     * they don't exist. Throws std::runtime_error if that fails.
+     */
+    ResumeRecord(const std::string& output, unsigned stream);
+    ~ResumeRecord();
+
+    ResumeRecord(const ResumeRecord&) = delete;
+    ResumeRecord& operator=(const ResumeRecord&) = delete;
+
+    // where output's record lives
+    static std::string path(const std::string& output)
+    {
+        return output + ".resume";
+    }
+
+    /**
+     * Starts recording the stream's part of a file
+     *
+     * @param file_size, fingerprint the file, as the server described it
+     * @param streams how many streams it is split across
+     * @param part the stream's part of it
+     * @return where the part is written up to, if our slot is for the same
+     * part of the same file and output hasn't been replaced; part.start
+     * otherwise
+     */
+    uint64_t start(uint64_t file_size, uint32_t fingerprint, unsigned streams,
+                   const ByteRange& part);
+
+    /**
+     * Notes that the part is written up to done. Every INTERVAL bytes this
+     * starts writing them back to the disk, and moves the slot on past the
+     * ones it started on the time before.
+     */
+    void advance(uint64_t done);
+
+    /**
+     * Records the part as all written, once it is on the disk, or as not
+     * written at all if the transfer's checksum showed it is wrong
+     */
+    void finish(bool intact);
+
+private:
+    // One stream's slot, in our byte order; 64 bytes, so none ever
+    // straddles a disk sector
+    struct Slot
+    {
+        char magic[8];
+        uint64_t file_size;
+        uint32_t fingerprint;
+        uint16_t stream;
+        uint16_t streams;
+        uint64_t start;
+        uint64_t end;
+        uint64_t done;
+        uint64_t inode;
+        uint32_t _reserved;
+        uint32_t crc;       // of everything before it
+    };
+
+    void write_slot(uint64_t done);
+
+    int fd_;                // the record
+    int data_fd_;           // output, for syncing it
+    unsigned stream_;
+    Slot slot_;
+    uint64_t flushing_;     // writing back of the part up to here has started
+};
+
+#endif
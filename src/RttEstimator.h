@@ -0,0 +1,125 @@
+#ifndef RTT_ESTIMATOR_H
+#define RTT_ESTIMATOR_H
+
+#include <algorithm>                    // for min, max
+#include <chrono>                       // for microseconds, milliseconds
+#include <cstdint>                      // for uint32_t
+#include <ostream>                      // for ostream, operator<<
+
+/*
+ * Static Variables
+ */
+// Low enough that a loss on a LAN doesn't stall for hundreds of RTTs, high
+// enough to ride out scheduling hiccups on a busy host
+static const std::chrono::microseconds min_rto(20000);
+static const std::chrono::microseconds max_rto(60000000);
+// what the timeout was before it adapted, until there is a sample
+static const std::chrono::microseconds initial_rto(500000);
+// clock granularity (RFC 6298's G), the least rttvar counts for
+static const std::chrono::microseconds rto_granularity(1000);
+
+/**
+ * Round trip time estimation and retransmission timeout, as in TCP
+ * (RFC 6298).
+ *
+ * Until the first sample the timeout is the old fixed 500 ms. Callers are
+ * responsible for Karn's rule: never feed in a sample from a segment that was
+ * retransmitted, unless a timestamp echo says which transmission it was.
+ *
+ * The RFC's gains assume about one sample per round trip; fed a sample for
+ * every ack, rttvar decays to nothing within a window and the timeout ends
+ * up a hair above srtt. So at most one sample per srtt is used.
+ */
+class RttEstimator
+{
+public:
+    using duration = std::chrono::microseconds;
+    using time_point = std::chrono::high_resolution_clock::time_point;
+
+    RttEstimator() :
+        srtt_(0), rttvar_(0), rto_(initial_rto), backoff_(0), samples_(0) {}
+
+    /**
+     * Folds in a round trip time measurement taken at time t and clears any
+     * backoff, unless we already took one less than srtt ago
+     */
+    void sample(duration rtt, time_point t)
+    {
+        if (samples_ > 0 && t - last_sample_ < srtt_)
+        {
+            return;
+        }
+        last_sample_ = t;
+        rtt = std::max(rtt, duration(1));
+        if (samples_++ == 0)
+        {
+            srtt_ = rtt;
+            rttvar_ = rtt / 2;
+        }
+        else
+        {
+            // rttvar = 3/4 rttvar + 1/4 |srtt - rtt|, srtt = 7/8 srtt + 1/8 rtt
+            duration err = srtt_ > rtt ? srtt_ - rtt : rtt - srtt_;
+            rttvar_ = (3 * rttvar_ + err) / 4;
+            srtt_ = (7 * srtt_ + rtt) / 8;
+        }
+        backoff_ = 0;
+        rto_ = clamp(srtt_ + std::max(rto_granularity, 4 * rttvar_));
+    }
+
+    /**
+     * Starts from srtt, as measured on an earlier connection, instead of
+     * the initial timeout; the first sample replaces it
+     */
+    void seed(duration srtt)
+    {
+        if (samples_ == 0 && srtt.count() > 0)
+        {
+            srtt_ = srtt;
+            rttvar_ = srtt / 2;
+            rto_ = clamp(srtt_ + std::max(rto_granularity, 4 * rttvar_));
+        }
+    }
+
+    /**
+     * Doubles the timeout after it expired, up to max_rto
+     */
+    void backoff()
+    {
+        if (rto_ < max_rto)
+        {
+            backoff_++;
+            rto_ = clamp(2 * rto_);
+        }
+    }
+
+    duration srtt() const { return srtt_; }
+    duration rttvar() const { return rttvar_; }
+    duration rto() const { return rto_; }
+    // times the timeout has been doubled since the last sample
+    unsigned backoffs() const { return backoff_; }
+    uint32_t samples() const { return samples_; }
+
+private:
+    static duration clamp(duration d)
+    {
+        return std::min(std::max(d, min_rto), max_rto);
+    }
+
+    duration srtt_;
+    duration rttvar_;
+    duration rto_;
+    unsigned backoff_;
+    uint32_t samples_;
+    time_point last_sample_;
+};
+
+inline
+std::ostream& operator<<(std::ostream& os, const RttEstimator& r)
+{
+    os << "srtt " << r.srtt().count() << "us rttvar " << r.rttvar().count()
+       << "us rto " << r.rto().count() << "us (" << r.samples() << " samples)";
+    return os;
+}
+
+#endif
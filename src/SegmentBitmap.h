@@ -0,0 +1,102 @@
+#ifndef SEGMENT_BITMAP_H
+#define SEGMENT_BITMAP_H
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint64_t, UINT64_MAX
+#include <vector>                       // for vector
+
+/**
+ * One bit per segment of a file, saying which segments we already have.
+ *
+ * It grows on demand, so the file size doesn't need to be known up front;
+ * every bit past the end is clear.
+ */
+class SegmentBitmap
+{
+public:
+    /**
+     * Makes room for n segments so set() won't have to allocate
+     */
+    void reserve(uint64_t n)
+    {
+        words_.reserve((n + 63) / 64);
+    }
+
+    /**
+     * Marks segment i as received
+     *
+     * @return false if it already was
+     */
+    bool set(uint64_t i)
+    {
+        size_t word = i / 64;
+        if (word >= words_.size())
+        {
+            words_.resize(word + 1);
+        }
+        uint64_t bit = (uint64_t)1 << (i % 64);
+        if (words_[word] & bit)
+        {
+            return false;
+        }
+        words_[word] |= bit;
+        return true;
+    }
+
+    bool test(uint64_t i) const
+    {
+        size_t word = i / 64;
+        return word < words_.size() && ((words_[word] >> (i % 64)) & 1);
+    }
+
+    /**
+     * @return the first segment at or after i that we don't have
+     */
+    uint64_t next_clear(uint64_t i) const
+    {
+        size_t word = i / 64;
+        if (word >= words_.size())
+        {
+            return i;
+        }
+        // Look at a whole word at a time, ignoring the bits before i
+        uint64_t missing = ~words_[word] & (~(uint64_t)0 << (i % 64));
+        while (missing == 0)
+        {
+            if (++word == words_.size())
+            {
+                return (uint64_t)word * 64;
+            }
+            missing = ~words_[word];
+        }
+        return (uint64_t)word * 64 + __builtin_ctzll(missing);
+    }
+
+    /**
+     * @return the first segment at or after i that we have, or UINT64_MAX if
+     * there is none
+     */
+    uint64_t next_set(uint64_t i) const
+    {
+        size_t word = i / 64;
+        if (word >= words_.size())
+        {
+            return UINT64_MAX;
+        }
+        uint64_t held = words_[word] & (~(uint64_t)0 << (i % 64));
+        while (held == 0)
+        {
+            if (++word == words_.size())
+            {
+                return UINT64_MAX;
+            }
+            held = words_[word];
+        }
+        return (uint64_t)word * 64 + __builtin_ctzll(held);
+    }
+
+private:
+    std::vector<uint64_t> words_;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef SEND_WINDOW_H
+#define SEND_WINDOW_H
+
+#include "Packet.h"                     // for Packet, PacketWrapper, add_seq
+
+#include <cstddef>                      // for size_t
+#include <cstdint>                      // for uint32_t
+#include <vector>                       // for vector
+
+#include <sys/types.h>                  // for ssize_t
+
+/**
+ * The server's window of unacked segments: a fixed-capacity ring of
+ * PacketWrapper slots, indexed by sequence offset.
+ *
+ * Every segment except the last one of the file is exactly the connection's
+ * MSS, so the slot holding a given sequence number is computed rather than
+ * searched for, and releasing cumulatively acked segments just moves the
+ * head. Slots only describe segments (the payload stays in the server's
+ * memory-mapped file), so they are small and nothing is allocated once the
+ * ring exists.
+ */
+class SendWindow
+{
+public:
+    SendWindow() :
+        mss_(Packet::MIN_MSS), mask_(0), head_(0), count_(0), head_seq_(0),
+        end_seq_(0) {}
+
+    /**
+     * Empties the window and makes room for at least capacity segments,
+     * rounded up to a power of two so indexing is a mask
+     *
+     * @param first_seq sequence number of the first byte that will be queued
+     * @param mss how long every segment but the last will be
+     */
+    void reset(uint32_t first_seq, size_t capacity, uint32_t mss)
+    {
+        mss_ = mss;
+        size_t slots = 1;
+        while (slots < capacity)
+        {
+            slots <<= 1;
+        }
+        slots_ = std::vector<PacketWrapper>(slots);
+        mask_ = slots - 1;
+        head_ = count_ = 0;
+        head_seq_ = end_seq_ = first_seq;
+    }
+
+    bool empty() const { return count_ == 0; }
+    bool full() const { return count_ == slots_.size(); }
+    size_t size() const { return count_; }
+    size_t capacity() const { return slots_.size(); }
+    uint32_t mss() const { return mss_; }
+    // first unacked byte
+    uint32_t begin_seq() const { return head_seq_; }
+    // one past the last queued byte
+    uint32_t end_seq() const { return end_seq_; }
+    // bytes queued
+    uint32_t bytes() const { return end_seq_ - head_seq_; }
+
+    PacketWrapper& front() { return slots_[head_]; }
+    // the i-th segment from the front
+    PacketWrapper& at(size_t i) { return slots_[(head_ + i) & mask_]; }
+    const PacketWrapper& at(size_t i) const { return slots_[(head_ + i) & mask_]; }
+
+    /**
+     * The free slot just past the back. Fill it in (seq_number must be
+     * end_seq()), then call push_back() to add it to the window.
+     */
+    PacketWrapper& next_slot() { return slots_[(head_ + count_) & mask_]; }
+    void push_back()
+    {
+        end_seq_ = add_seq(end_seq_, next_slot().data_len);
+        count_++;
+    }
+
+    /**
+     * @return the index from the front of the segment holding seq, or -1 if
+     * seq isn't in the window
+     */
+    ssize_t index_of(uint32_t seq) const
+    {
+        uint32_t offset = seq - head_seq_;
+        if (offset >= bytes())
+        {
+            return -1;
+        }
+        return offset / mss_;
+    }
+
+    /**
+     * @return the index from the front of the segment whose last byte is just
+     * before ack, i.e. the last segment a cumulative ack of ack covers, or -1
+     * if ack doesn't fall on a segment boundary in the window
+     */
+    ssize_t index_ending_at(uint32_t ack) const
+    {
+        uint32_t offset = ack - head_seq_;
+        if (offset == 0 || offset > bytes())
+        {
+            return -1;
+        }
+        if (ack == end_seq_)
+        {
+            return count_ - 1;
+        }
+        if (offset % mss_ != 0)
+        {
+            return -1;
+        }
+        return offset / mss_ - 1;
+    }
+
+    /**
+     * Drops the first n segments
+     *
+     * @return the number of bytes they held
+     */
+    uint32_t pop_front(size_t n)
+    {
+        uint32_t old_head = head_seq_;
+        head_seq_ = n == count_ ? end_seq_
+                                : at(n).seq_number;
+        head_ = (head_ + n) & mask_;
+        count_ -= n;
+        return head_seq_ - old_head;
+    }
+
+private:
+    std::vector<PacketWrapper> slots_;
+    uint32_t mss_;          // 32-bit, so index_of() divides cheaply
+    size_t mask_;
+    size_t head_;
+    size_t count_;
+    uint32_t head_seq_;
+    uint32_t end_seq_;
+};
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef SOCKET_H
+#define SOCKET_H
+
+#include <cstddef>                      // for size_t
+
+#include <sys/socket.h>                 // for send, recv, sendmmsg, etc
+#include <sys/types.h>                  // for ssize_t
+
+/**
+ * The socket calls the server and client make while transferring, so the
+ * same code can run over something other than a real UDP socket: the
+ * simulator (sim.cpp) connects a server and a client through an in-memory
+ * link instead. Each call behaves like the system call it's named after,
+ * including returning -1 with errno set; the only socket option the code
+ * relies on being honoured is SO_RCVTIMEO.
+ */
+class Socket
+{
+public:
+    virtual ~Socket() {}
+
+    virtual ssize_t send(const void* buf, size_t len, int flags) = 0;
+    virtual ssize_t sendto(const void* buf, size_t len, int flags,
+                           const sockaddr* addr, socklen_t addr_len) = 0;
+    virtual ssize_t recv(void* buf, size_t len, int flags) = 0;
+    virtual int sendmmsg(mmsghdr* msgs, unsigned int n, int flags) = 0;
+    virtual int recvmmsg(mmsghdr* msgs, unsigned int n, int flags) = 0;
+    virtual int setsockopt(int level, int name, const void* value,
+                           socklen_t len) = 0;
+};
+
+/**
+ * A real socket. It doesn't own the descriptor; whoever opened it closes it.
+ */
+class UdpSocket : public Socket
+{
+public:
+    explicit UdpSocket(int fd) : fd_(fd) {}
+
+    int fd() const { return fd_; }
+
+    ssize_t send(const void* buf, size_t len, int flags) override
+    {
+        return ::send(fd_, buf, len, flags);
+    }
+    ssize_t sendto(const void* buf, size_t len, int flags,
+                   const sockaddr* addr, socklen_t addr_len) override
+    {
+        return ::sendto(fd_, buf, len, flags, addr, addr_len);
+    }
+    ssize_t recv(void* buf, size_t len, int flags) override
+    {
+        return ::recv(fd_, buf, len, flags);
+    }
+    int sendmmsg(mmsghdr* msgs, unsigned int n, int flags) override
+    {
+        return ::sendmmsg(fd_, msgs, n, flags);
+    }
+    int recvmmsg(mmsghdr* msgs, unsigned int n, int flags) override
+    {
+        return ::recvmmsg(fd_, msgs, n, flags, nullptr);
+    }
+    int setsockopt(int level, int name, const void* value,
+                   socklen_t len) override
+    {
+        return ::setsockopt(fd_, level, name, value, len);
+    }
+
+private:
+    int fd_;
+};
+
+#endif
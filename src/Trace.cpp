@@ -0,0 +1,199 @@
+#include "Trace.h"
+
+#include "Packet.h"                     // for now
+
+#include <algorithm>                    // for min
+#include <cerrno>                       // for errno, EINTR
+#include <chrono>                       // for duration_cast, nanoseconds
+#include <cstdint>                      // for UINT32_MAX
+#include <cstring>                      // for memcpy, strcmp, strerror
+#include <iostream>                     // for cerr
+
+#include <fcntl.h>                      // for open, O_WRONLY, O_CREAT
+#include <unistd.h>                     // for write, close
+
+/*
+ * Static Variables
+ */
+// records the ring holds; a power of two. At 32 bytes each, that's 2 MB,
+// about a second of a fast transfer for the drain thread to fall behind by
+static const size_t RING_SIZE = 1 << 16;
+// how long the drain thread sleeps when the ring is empty
+static const std::chrono::milliseconds DRAIN_INTERVAL(5);
+
+std::atomic<int> Trace::level_(Trace::OFF);
+Trace::Level Trace::open_level_ = Trace::OFF;
+std::vector<TraceRecord> Trace::ring_;
+std::atomic_flag Trace::lock_ = ATOMIC_FLAG_INIT;
+std::atomic<uint64_t> Trace::head_(0);
+std::atomic<uint64_t> Trace::tail_(0);
+std::atomic<bool> Trace::running_(false);
+uint64_t Trace::dropped_ = 0;
+int Trace::fd_ = -1;
+std::thread Trace::thread_;
+
+/*
+ * Function Declarations
+ */
+static bool write_all(int fd, const void* buf, size_t len);
+
+/*
+ * Implementations
+ */
+bool Trace::parse_level(const char* s, Level& level)
+{
+    static const char* names[] = { "off", "loss", "all" };
+    for (int i = OFF; i <= ALL; i++)
+    {
+        if (std::strcmp(s, names[i]) == 0)
+        {
+            level = (Level)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool Trace::open(const char* path, Level level)
+{
+    if (level == OFF)
+    {
+        return true;
+    }
+    fd_ = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd_ < 0)
+    {
+        std::cerr << path << ": " << std::strerror(errno) << std::endl;
+        return false;
+    }
+    TraceHeader header;
+    std::memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(TraceRecord);
+    if (!write_all(fd_, &header, sizeof(header)))
+    {
+        std::cerr << path << ": " << std::strerror(errno) << std::endl;
+        ::close(fd_);
+        fd_ = -1;
+        return false;
+    }
+    ring_.resize(RING_SIZE);
+    open_level_ = level;
+    running_ = true;
+    thread_ = std::thread(drain);
+    level_.store(level, std::memory_order_relaxed);
+    return true;
+}
+
+void Trace::close()
+{
+    if (fd_ < 0)
+    {
+        return;
+    }
+    level_.store(OFF, std::memory_order_relaxed);
+    running_ = false;
+    thread_.join();
+    ::close(fd_);
+    fd_ = -1;
+    if (dropped_ > 0)
+    {
+        std::cerr << "trace: dropped " << dropped_ << " records" << std::endl;
+    }
+}
+
+void Trace::toggle()
+{
+    if (open_level_ != OFF)
+    {
+        level_.store(level() == OFF ? open_level_ : OFF, std::memory_order_relaxed);
+    }
+}
+
+void Trace::push(TraceEvent type, uint8_t flags, uint16_t conn_id,
+                 uint32_t seq, uint32_t cwnd, uint32_t ssthresh, double rate)
+{
+    while (lock_.test_and_set(std::memory_order_acquire))
+    {
+    }
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    if (head - tail_.load(std::memory_order_acquire) == RING_SIZE)
+    {
+        dropped_++;
+        lock_.clear(std::memory_order_release);
+        return;
+    }
+    TraceRecord& r = ring_[head & (RING_SIZE - 1)];
+    r.time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            now().time_since_epoch()).count();
+    r.type = type;
+    r.flags = flags;
+    r.conn_id = conn_id;
+    r.seq = seq;
+    r.cwnd = cwnd;
+    r.ssthresh = ssthresh;
+    r.rate = rate < UINT32_MAX ? (uint32_t)rate : UINT32_MAX;
+    r._reserved = 0;
+    // Publishes the record to the drain thread
+    head_.store(head + 1, std::memory_order_release);
+    lock_.clear(std::memory_order_release);
+}
+
+/**
+ * The background thread: writes out whatever is in the ring, as contiguous
+ * runs, until close() and the ring is empty
+ */
+void Trace::drain()
+{
+    while (true)
+    {
+        // Read running_ first, so nothing recorded before close() is missed
+        bool running = running_;
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        uint64_t head = head_.load(std::memory_order_acquire);
+        if (head == tail)
+        {
+            if (!running)
+            {
+                return;
+            }
+            std::this_thread::sleep_for(DRAIN_INTERVAL);
+            continue;
+        }
+        // Up to the end of the ring; the rest goes next time round
+        size_t start = tail & (RING_SIZE - 1);
+        size_t n = std::min(head - tail, (uint64_t)(RING_SIZE - start));
+        if (!write_all(fd_, &ring_[start], n * sizeof(TraceRecord)))
+        {
+            std::cerr << "trace: write(): " << std::strerror(errno) << std::endl;
+            // Stop recording, but still consume these so close() finishes
+            level_.store(OFF, std::memory_order_relaxed);
+        }
+        tail_.store(tail + n, std::memory_order_release);
+    }
+}
+
+/**
+ * Writes all len bytes of buf to fd
+ *
+ * @return false, with errno set, on failure
+ */
+static bool write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = (const char*)buf;
+    while (len > 0)
+    {
+        ssize_t ret = write(fd, p, len);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return true;
+}
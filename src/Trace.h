@@ -0,0 +1,135 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>                       // for atomic
+#include <cstdint>                      // for uint8_t, uint16_t, uint32_t, etc
+#include <thread>                       // for thread
+#include <vector>                       // for vector
+
+/**
+ * What a trace record describes
+ */
+enum TraceEvent : uint8_t {
+    TRACE_SEND_DATA = 1,    // server sent a data segment
+    TRACE_RECV_ACK = 2,     // server received an ack
+    TRACE_SEND_ACK = 3,     // client sent an ack
+    TRACE_RECV_DATA = 4     // client received a data segment
+};
+
+// TraceRecord::flags
+static const uint8_t TRACE_RETRANSMIT = 1;
+
+/**
+ * One event, exactly as it's written to the trace file (in host byte order).
+ * Fields an event doesn't have are 0.
+ */
+struct TraceRecord
+{
+    uint64_t time;          // nanoseconds since the epoch
+    uint8_t type;           // a TraceEvent
+    uint8_t flags;
+    uint16_t conn_id;
+    uint32_t seq;           // sequence number sent, or ack number
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t rate;          // pacing rate in bytes per second
+    uint32_t _reserved;
+};
+
+static_assert(sizeof(TraceRecord) == 32, "TraceRecord is part of the file format");
+
+/**
+ * What a trace file starts with
+ */
+struct TraceHeader
+{
+    char magic[8];          // TRACE_MAGIC
+    uint32_t version;       // TRACE_VERSION
+    uint32_t record_size;   // sizeof(TraceRecord)
+};
+
+static const char TRACE_MAGIC[8] = { 'U', 'D', 'P', 'T', 'R', 'A', 'C', 'E' };
+static const uint32_t TRACE_VERSION = 1;
+
+/**
+ * The per-packet event trace, which replaces printing a line per packet.
+ *
+ * record() only copies a fixed-size record into a ring in memory; a
+ * background thread drains the ring to the trace file, so the hot path never
+ * formats, flushes or makes a system call. If the ring is full the record is
+ * dropped and counted rather than waiting. `tracedump` turns a trace file
+ * back into the old text lines.
+ *
+ * Several threads may call record() (the server's workers, the client's
+ * streams); they take turns through a spinlock, which costs one atomic
+ * exchange per record when nobody else is recording.
+ */
+class Trace
+{
+public:
+    enum Level {
+        OFF = 0,    // record nothing, and don't start the thread
+        LOSS = 1,   // only retransmissions and duplicate acks
+        ALL = 2     // every packet
+    };
+
+    /**
+     * Parses "off", "loss" or "all"
+     *
+     * @return false if s is none of those
+     */
+    static bool parse_level(const char* s, Level& level);
+
+    /**
+     * Starts tracing to path at level. Does nothing for OFF.
+     *
+     * @return false, with a message on stderr, if path can't be written
+     */
+    static bool open(const char* path, Level level);
+
+    /**
+     * Writes out everything recorded so far and stops tracing
+     */
+    static void close();
+
+    /**
+     * Pauses tracing, or resumes it at the level it was opened with. Safe to
+     * call from a signal handler. Has no effect unless open() started
+     * tracing.
+     */
+    static void toggle();
+    static Level level() { return (Level)level_.load(std::memory_order_relaxed); }
+
+    static void record(TraceEvent type, uint8_t flags, uint16_t conn_id,
+                       uint32_t seq, uint32_t cwnd = 0, uint32_t ssthresh = 0,
+                       double rate = 0)
+    {
+        int needed = (flags & TRACE_RETRANSMIT) ? LOSS : ALL;
+        if (level_.load(std::memory_order_relaxed) < needed)
+        {
+            return;
+        }
+        push(type, flags, conn_id, seq, cwnd, ssthresh, rate);
+    }
+
+private:
+    static void push(TraceEvent type, uint8_t flags, uint16_t conn_id,
+                     uint32_t seq, uint32_t cwnd, uint32_t ssthresh,
+                     double rate);
+    static void drain();
+
+    static std::atomic<int> level_;
+    static Level open_level_;
+    static std::vector<TraceRecord> ring_;
+    // head_ is only written by whoever holds lock_ and tail_ only by the
+    // draining thread; both count records ever, and wrap with the ring's size
+    static std::atomic_flag lock_;
+    static std::atomic<uint64_t> head_;
+    static std::atomic<uint64_t> tail_;
+    static std::atomic<bool> running_;
+    static uint64_t dropped_;
+    static int fd_;
+    static std::thread thread_;
+};
+
+#endif
@@ -0,0 +1,331 @@
+#include "Impairment.h"                 // for Impairment, ImpairedLink
+
+#include <algorithm>                    // for max
+#include <cerrno>                       // for errno, EAGAIN, EINTR
+#include <chrono>                       // for high_resolution_clock, duration
+#include <csignal>                      // for sigaction, SIGINT, SIGTERM
+#include <cstdint>                      // for uint64_t
+#include <cstdlib>                      // for strtod, strtoul
+#include <cstring>                      // for memset, memcmp, strerror
+#include <iostream>                     // for cout, cerr
+#include <map>                          // for map
+#include <queue>                        // for priority_queue
+#include <random>                       // for mt19937_64
+#include <string>                       // for string
+#include <vector>                       // for vector
+
+#include <getopt.h>                     // for getopt, optarg, optind
+#include <netdb.h>                      // for addrinfo, getaddrinfo
+#include <netinet/in.h>                 // for sockaddr_in, IPPROTO_UDP
+#include <poll.h>                       // for ppoll, pollfd
+#include <sys/socket.h>                 // for socket, bind, sendto, recvfrom
+#include <unistd.h>                     // for close
+
+/*
+ * Types
+ */
+using Clock = std::chrono::high_resolution_clock;
+
+// A datagram waiting for its departure time
+struct Pending
+{
+    Clock::time_point departure;
+    uint64_t order;     // breaks ties, so equal departures keep their order
+    int fd;
+    sockaddr_in to;
+    std::string data;
+    bool operator>(const Pending& o) const
+    {
+        return departure != o.departure ? departure > o.departure
+                                        : order > o.order;
+    }
+};
+
+using PendingQueue = std::priority_queue<Pending, std::vector<Pending>,
+                                         std::greater<Pending>>;
+
+struct AddrLess
+{
+    bool operator()(const sockaddr_in& a, const sockaddr_in& b) const
+    {
+        return std::memcmp(&a, &b, sizeof(a)) < 0;
+    }
+};
+
+/*
+ * Static Variables
+ */
+static volatile sig_atomic_t running = 1;
+// enough for any UDP datagram
+static const size_t MAX_DATAGRAM = 65536;
+// socket buffer size to ask for
+static const int SOCKET_BUFFER = 8 * 1024 * 1024;
+static Impairment impairment;
+static std::mt19937_64 rng;
+static uint64_t next_order = 0;
+
+/*
+ * Function Declarations
+ */
+void on_signal(int);
+void schedule(ImpairedLink& link, PendingQueue& queue, int fd,
+              const sockaddr_in& to, const char* data, size_t len);
+Clock::duration millis(const char* s);
+int udp_socket(uint16_t port);
+void print_link(const char* name, const ImpairedLink& link);
+
+/*
+ * Implementations
+ */
+
+/**
+ * A UDP proxy that impairs what goes through it the way a bad network path
+ * would, so transfers can be tested under loss, delay, reordering,
+ * duplication and a bandwidth limit over loopback, without root or netem.
+ *
+ * Clients send to listen-port; each client address gets its own socket
+ * towards the server, so the server still sees them as different peers.
+ */
+int main(int argc, char** argv)
+{
+    int opt;
+    bool usage = false;
+    unsigned long seed = 1;
+    while ((opt = getopt(argc, argv, "b:C:d:D:j:l:q:r:s:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                impairment.burst = std::max(std::strtod(optarg, nullptr), 1.0);
+                break;
+            case 'C':
+                impairment.corrupt = std::strtod(optarg, nullptr);
+                break;
+            case 'd':
+                impairment.delay = millis(optarg);
+                break;
+            case 'D':
+                impairment.duplicate = std::strtod(optarg, nullptr);
+                break;
+            case 'j':
+                impairment.jitter = millis(optarg);
+                break;
+            case 'l':
+                impairment.loss = std::strtod(optarg, nullptr);
+                break;
+            case 'q':
+                impairment.limit = std::max(std::strtoul(optarg, nullptr, 10), 1ul);
+                break;
+            case 'r':
+                impairment.reorder = std::strtod(optarg, nullptr);
+                break;
+            case 's':
+                seed = std::strtoul(optarg, nullptr, 10);
+                break;
+            case 'w':
+                impairment.rate = std::strtod(optarg, nullptr);
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    if (usage || argc - optind != 3 || impairment.loss >= 1)
+    {
+        std::cout << "Usage: " << argv[0]
+                  << " [-l loss] [-b burst-length] [-d delay-ms] [-j jitter-ms]"
+                  << " [-r reorder] [-D duplicate] [-C corrupt]"
+                  << " [-w bytes-per-sec]"
+                  << " [-q queue-limit] [-s seed]"
+                  << " listen-port server-host server-port\n";
+        return 1;
+    }
+    rng.seed(seed);
+
+    addrinfo hints, *res;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_flags = AI_NUMERICSERV;
+    int ret = getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &res);
+    if (ret != 0)
+    {
+        std::cerr << "getaddrinfo(): " << gai_strerror(ret) << std::endl;
+        return 1;
+    }
+    sockaddr_in server = *(const sockaddr_in*)res->ai_addr;
+    freeaddrinfo(res);
+    int front = udp_socket(std::strtoul(argv[optind], nullptr, 10));
+    if (front < 0)
+    {
+        return 1;
+    }
+
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    // A socket towards the server for every client, and the way back
+    std::map<sockaddr_in, int, AddrLess> upstream;
+    std::map<int, sockaddr_in> downstream;
+    std::vector<pollfd> fds(1);
+    fds[0].fd = front;
+    fds[0].events = POLLIN;
+    ImpairedLink up(impairment, rng), down(impairment, rng);
+    PendingQueue queue;
+    std::vector<char> buf(MAX_DATAGRAM);
+    while (running)
+    {
+        // Sleep until the next departure, or until something arrives
+        timespec timeout, *tp = nullptr;
+        if (!queue.empty())
+        {
+            auto wait = std::max(queue.top().departure - Clock::now(),
+                                 Clock::duration(0));
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(wait).count();
+            timeout.tv_sec = ns / 1000000000;
+            timeout.tv_nsec = ns % 1000000000;
+            tp = &timeout;
+        }
+        if (ppoll(fds.data(), fds.size(), tp, nullptr) < 0 && errno != EINTR)
+        {
+            std::cerr << "ppoll(): " << std::strerror(errno) << std::endl;
+            break;
+        }
+        for (size_t i = 0; i < fds.size(); i++)
+        {
+            if (!(fds[i].revents & POLLIN))
+            {
+                continue;
+            }
+            while (true)
+            {
+                sockaddr_in from;
+                socklen_t from_len = sizeof(from);
+                ssize_t n = recvfrom(fds[i].fd, buf.data(), buf.size(),
+                                     MSG_DONTWAIT, (sockaddr*)&from, &from_len);
+                if (n < 0)
+                {
+                    break;
+                }
+                if (fds[i].fd != front)
+                {
+                    schedule(down, queue, front, downstream[fds[i].fd],
+                             buf.data(), n);
+                    continue;
+                }
+                auto it = upstream.find(from);
+                if (it == upstream.end())
+                {
+                    int fd = udp_socket(0);
+                    if (fd < 0)
+                    {
+                        continue;
+                    }
+                    it = upstream.emplace(from, fd).first;
+                    downstream[fd] = from;
+                    pollfd pfd;
+                    pfd.fd = fd;
+                    pfd.events = POLLIN;
+                    fds.push_back(pfd);
+                }
+                schedule(up, queue, it->second, server, buf.data(), n);
+            }
+        }
+        auto t = Clock::now();
+        while (!queue.empty() && queue.top().departure <= t)
+        {
+            const Pending& p = queue.top();
+            if (sendto(p.fd, p.data.data(), p.data.size(), 0,
+                       (const sockaddr*)&p.to, sizeof(p.to)) < 0 &&
+                    errno != EAGAIN && errno != ECONNREFUSED)
+            {
+                std::cerr << "sendto(): " << std::strerror(errno) << std::endl;
+            }
+            queue.pop();
+        }
+    }
+    print_link("client -> server", up);
+    print_link("server -> client", down);
+    close(front);
+    for (auto& u : upstream)
+    {
+        close(u.second);
+    }
+}
+
+void on_signal(int)
+{
+    running = 0;
+}
+
+/**
+ * Puts a datagram that just arrived through link and queues whatever copies
+ * of it survive for when they should leave
+ */
+void schedule(ImpairedLink& link, PendingQueue& queue, int fd,
+              const sockaddr_in& to, const char* data, size_t len)
+{
+    std::string datagram(data, len);
+    Clock::time_point departures[2];
+    size_t n = link.schedule(Clock::now(), datagram, departures);
+    for (size_t i = 0; i < n; i++)
+    {
+        queue.push({ departures[i], next_order++, fd, to, datagram });
+    }
+}
+
+/**
+ * Parses a (possibly fractional) number of milliseconds
+ */
+Clock::duration millis(const char* s)
+{
+    return std::chrono::duration_cast<Clock::duration>(
+            std::chrono::duration<double, std::milli>(std::strtod(s, nullptr)));
+}
+
+/**
+ * Opens a UDP socket bound to port, or to any port if it's 0
+ *
+ * @return the socket, or -1 on failure
+ */
+int udp_socket(uint16_t port)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (fd < 0)
+    {
+        std::cerr << "socket(): " << std::strerror(errno) << std::endl;
+        return -1;
+    }
+    // Bursts from the server shouldn't overflow the proxy itself; any loss
+    // should be the loss we were asked for. This is only a hint, capped by
+    // net.core.rmem_max.
+    int size = SOCKET_BUFFER;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, (const sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        std::cerr << "bind(): " << std::strerror(errno) << std::endl;
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void print_link(const char* name, const ImpairedLink& link)
+{
+    const ImpairedLink::Stats& stats = link.stats();
+    std::cerr << name << ": forwarded " << stats.forwarded << ", lost "
+              << stats.dropped << ", overflowed " << stats.overflowed
+              << ", duplicated " << stats.duplicated << ", corrupted "
+              << stats.corrupted << ", reordered "
+              << stats.reordered << std::endl;
+}
@@ -0,0 +1,592 @@
+#include "Batch.h"                      // for SendBatch
+#include "Checksum.h"                   // for crc32c, FileDigest
+#include "Compress.h"                   // for Compressor, Decompressor
+#include "Fec.h"                        // for FecDecoder, xor_bytes
+#include "Metrics.h"                    // for Histogram
+#include "Packet.h"                     // for Packet, PacketWrapper, add_seq
+#include "Pacer.h"                      // for Pacer
+#include "ReorderBuffer.h"              // for ReorderBuffer
+#include "RttEstimator.h"               // for RttEstimator
+#include "SegmentBitmap.h"              // for SegmentBitmap
+#include "SendWindow.h"                 // for SendWindow
+#include "Socket.h"                     // for Socket
+
+#include <algorithm>                    // for sort, max
+#include <chrono>                       // for steady_clock, duration
+#include <cstdint>                      // for uint32_t, uint64_t, UINT64_MAX
+#include <cstdio>                       // for snprintf
+#include <cstdlib>                      // for strtoul
+#include <cstring>                      // for strstr
+#include <iomanip>                      // for setw, setprecision
+#include <iostream>                     // for cout
+#include <random>                       // for mt19937
+#include <utility>                      // for move
+#include <vector>                       // for vector
+
+#include <getopt.h>                     // for getopt, optarg, optind
+
+/*
+ * Types
+ */
+// A benchmark runs its operation ops times per call
+struct Benchmark
+{
+    const char* name;
+    void (*run)(size_t ops);
+};
+
+// Takes datagrams and does nothing with them, so SendBatch can be timed
+// without the system call
+class NullSocket : public Socket
+{
+public:
+    ssize_t send(const void*, size_t len, int) override { return len; }
+    ssize_t sendto(const void*, size_t len, int, const sockaddr*,
+                   socklen_t) override { return len; }
+    ssize_t recv(void*, size_t, int) override { return 0; }
+    int sendmmsg(mmsghdr*, unsigned int n, int) override { return n; }
+    int recvmmsg(mmsghdr*, unsigned int, int) override { return 0; }
+    int setsockopt(int, int, const void*, socklen_t) override { return 0; }
+};
+
+/*
+ * Static Variables
+ */
+// segments in the windows the window benchmarks work on, a 4 MB window
+static const size_t WINDOW_SEGMENTS = 4096;
+static char payload[Packet::MIN_MSS];
+
+/*
+ * Function Declarations
+ */
+template <typename T> void keep(const T& value);
+void bench_byte_order(size_t ops);
+void bench_add_seq(size_t ops);
+void bench_packet_move(size_t ops);
+void bench_wrapper(size_t ops);
+void bench_window_push_pop(size_t ops);
+void bench_window_lookup(size_t ops);
+void bench_reorder(size_t ops);
+void bench_bitmap(size_t ops);
+void bench_fec_parity(size_t ops);
+void bench_fec_repair(size_t ops);
+void bench_crc32c(size_t ops);
+void bench_file_digest(size_t ops);
+const std::vector<char>& sample_text();
+void compress_segments(const std::vector<char>& in, size_t ops);
+void bench_compress_text(size_t ops);
+void bench_compress_random(size_t ops);
+void bench_decompress(size_t ops);
+void bench_send_batch(size_t ops);
+void bench_histogram(size_t ops);
+void bench_rtt(size_t ops);
+void bench_pacer(size_t ops);
+void bench_now(size_t ops);
+
+static const Benchmark benchmarks[] = {
+    { "Packet to_network+to_host", bench_byte_order },
+    { "add_seq", bench_add_seq },
+    { "Packet move", bench_packet_move },
+    { "PacketWrapper construct+move", bench_wrapper },
+    { "SendWindow push_back+pop_front", bench_window_push_pop },
+    { "SendWindow index_of+index_ending_at", bench_window_lookup },
+    { "ReorderBuffer insert+drain (2 segs)", bench_reorder },
+    { "SegmentBitmap set+next_clear", bench_bitmap },
+    { "xor_bytes (per segment)", bench_fec_parity },
+    { "FecDecoder add+repair (per segment)", bench_fec_repair },
+    { "crc32c (per segment)", bench_crc32c },
+    { "FileDigest add+advance (per segment)", bench_file_digest },
+    { "Compressor text (per segment)", bench_compress_text },
+    { "Compressor random (per segment)", bench_compress_random },
+    { "Decompressor feed (per segment)", bench_decompress },
+    { "SendBatch add+flush (per datagram)", bench_send_batch },
+    { "Histogram record", bench_histogram },
+    { "RttEstimator sample", bench_rtt },
+    { "Pacer ready+on_send", bench_pacer },
+    { "now()", bench_now },
+};
+
+/*
+ * Implementations
+ */
+
+/**
+ * Times the building blocks of the packet path, so a change to one of them
+ * can be justified with numbers. Each benchmark is warmed up, then run for
+ * a number of repetitions of ops operations; the spread of ns/op across the
+ * repetitions shows how noisy the machine is.
+ */
+int main(int argc, char** argv)
+{
+    size_t ops = 100000;
+    size_t reps = 30;
+    size_t warmup = 3;
+    const char* filter = nullptr;
+    int opt;
+    bool usage = false;
+    while ((opt = getopt(argc, argv, "f:n:r:w:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'f':
+                filter = optarg;
+                break;
+            case 'n':
+                ops = std::max(std::strtoul(optarg, nullptr, 10), 1ul);
+                break;
+            case 'r':
+                reps = std::max(std::strtoul(optarg, nullptr, 10), 1ul);
+                break;
+            case 'w':
+                warmup = std::strtoul(optarg, nullptr, 10);
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    if (usage || argc != optind)
+    {
+        std::cout << "Usage: " << argv[0]
+                  << " [-f name-filter] [-n ops-per-rep] [-r reps] [-w warmup-reps]\n";
+        return 1;
+    }
+
+    std::cout << ops << " ops x " << reps << " reps after " << warmup
+              << " warmup reps; ns/op\n\n"
+              << std::left << std::setw(40) << "benchmark" << std::right
+              << std::setw(9) << "mean" << std::setw(9) << "min"
+              << std::setw(9) << "p50" << std::setw(9) << "p90"
+              << std::setw(9) << "p99" << '\n'
+              << std::fixed << std::setprecision(2);
+    for (auto& b : benchmarks)
+    {
+        if (filter != nullptr && std::strstr(b.name, filter) == nullptr)
+        {
+            continue;
+        }
+        for (size_t i = 0; i < warmup; i++)
+        {
+            b.run(ops);
+        }
+        std::vector<double> ns;
+        for (size_t i = 0; i < reps; i++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            b.run(ops);
+            auto end = std::chrono::steady_clock::now();
+            ns.push_back(std::chrono::duration<double, std::nano>(end - start).count() / ops);
+        }
+        std::sort(ns.begin(), ns.end());
+        double sum = 0;
+        for (double v : ns)
+        {
+            sum += v;
+        }
+        // nearest rank
+        auto pct = [&](double q) {
+            return ns[std::max((size_t)(q * ns.size() + 0.999999), (size_t)1) - 1];
+        };
+        std::cout << std::left << std::setw(40) << b.name << std::right
+                  << std::setw(9) << sum / ns.size() << std::setw(9) << ns.front()
+                  << std::setw(9) << pct(0.5) << std::setw(9) << pct(0.9)
+                  << std::setw(9) << pct(0.99) << '\n';
+    }
+}
+
+/**
+ * Makes the compiler assume value is used, so the work producing it isn't
+ * optimized away
+ */
+template <typename T>
+inline void keep(const T& value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+void bench_byte_order(size_t ops)
+{
+    Packet p;
+    p.headers.seq_number = 12345;
+    for (size_t i = 0; i < ops; i++)
+    {
+        p.headers.ack_number = i;
+        p.to_network();
+        keep(p.headers);
+        p.to_host();
+        keep(p.headers);
+    }
+}
+
+void bench_add_seq(size_t ops)
+{
+    uint32_t seq = UINT32_MAX - 1000;
+    for (size_t i = 0; i < ops; i++)
+    {
+        seq = add_seq(seq, Packet::MIN_MSS);
+        keep(seq);
+    }
+}
+
+void bench_packet_move(size_t ops)
+{
+    Packet a, b;
+    for (size_t i = 0; i < ops; i++)
+    {
+        a.headers.seq_number = i;
+        b = std::move(a);
+        keep(b);
+        a = std::move(b);
+        keep(a);
+    }
+}
+
+void bench_wrapper(size_t ops)
+{
+    PacketWrapper out;
+    for (size_t i = 0; i < ops; i++)
+    {
+        PacketWrapper w;
+        w.payload = payload;
+        w.seq_number = i;
+        w.data_len = Packet::MIN_MSS;
+        keep(w);
+        out = std::move(w);
+        keep(out);
+    }
+}
+
+/**
+ * A window kept half full: every op queues a segment and releases one, as
+ * sending into the window and a cumulative ack do
+ */
+void bench_window_push_pop(size_t ops)
+{
+    SendWindow window;
+    window.reset(0, WINDOW_SEGMENTS, Packet::MIN_MSS);
+    uint32_t seq = 0;
+    for (size_t i = 0; i < WINDOW_SEGMENTS / 2; i++)
+    {
+        PacketWrapper& w = window.next_slot();
+        w.seq_number = seq;
+        w.data_len = Packet::MIN_MSS;
+        window.push_back();
+        seq = add_seq(seq, Packet::MIN_MSS);
+    }
+    for (size_t i = 0; i < ops; i++)
+    {
+        PacketWrapper& w = window.next_slot();
+        w.seq_number = seq;
+        w.data_len = Packet::MIN_MSS;
+        window.push_back();
+        seq = add_seq(seq, Packet::MIN_MSS);
+        uint32_t released = window.pop_front(1);
+        keep(released);
+    }
+}
+
+/**
+ * Finding what an ack (or SACK block) refers to in a full window, at random
+ * positions; this is what send_file() once searched the window for
+ */
+void bench_window_lookup(size_t ops)
+{
+    static SendWindow window;
+    static std::vector<uint32_t> seqs;
+    if (seqs.empty())
+    {
+        window.reset(0, WINDOW_SEGMENTS, Packet::MIN_MSS);
+        uint32_t seq = 0;
+        while (!window.full())
+        {
+            PacketWrapper& w = window.next_slot();
+            w.seq_number = seq;
+            w.data_len = Packet::MIN_MSS;
+            window.push_back();
+            seq = add_seq(seq, Packet::MIN_MSS);
+        }
+        std::mt19937 rng(1);
+        for (size_t i = 0; i < 4096; i++)
+        {
+            seqs.push_back((rng() % WINDOW_SEGMENTS + 1) * Packet::MIN_MSS);
+        }
+    }
+    for (size_t i = 0; i < ops; i++)
+    {
+        uint32_t seq = seqs[i % seqs.size()];
+        ssize_t a = window.index_of(seq - Packet::MIN_MSS);
+        ssize_t b = window.index_ending_at(seq);
+        keep(a);
+        keep(b);
+    }
+}
+
+/**
+ * Segments arriving in swapped pairs: every op stores the second one of a
+ * pair, then takes the first in order and drains the second after it, as
+ * the client's packet cache does
+ */
+void bench_reorder(size_t ops)
+{
+    ReorderBuffer buf(0, Packet::MIN_MSS, WINDOW_SEGMENTS * Packet::MIN_MSS);
+    for (size_t i = 0; i < ops; i++)
+    {
+        uint32_t seq = buf.next_seq();
+        bool stored = buf.insert(add_seq(seq, Packet::MIN_MSS), payload,
+                                 Packet::MIN_MSS);
+        keep(stored);
+        buf.skip(Packet::MIN_MSS);
+        size_t len;
+        const char* data;
+        while ((data = buf.front(len)) != nullptr)
+        {
+            keep(data);
+            buf.pop_front();
+        }
+    }
+}
+
+/**
+ * The positional writer's bookkeeping, with a hole kept open a window
+ * behind the segment arriving
+ */
+void bench_bitmap(size_t ops)
+{
+    SegmentBitmap bitmap;
+    bitmap.reserve(ops + WINDOW_SEGMENTS);
+    for (size_t i = 0; i < ops; i++)
+    {
+        bool fresh = bitmap.set(i + 1);
+        uint64_t next = bitmap.next_clear(i >= WINDOW_SEGMENTS ? i - WINDOW_SEGMENTS : 0);
+        keep(fresh);
+        keep(next);
+    }
+}
+
+/**
+ * Building a parity segment, as the server does for every segment of a
+ * block
+ */
+void bench_fec_parity(size_t ops)
+{
+    static char parity[Packet::MIN_MSS];
+    for (size_t i = 0; i < ops; i++)
+    {
+        xor_bytes(parity, payload, Packet::MIN_MSS);
+        keep(parity);
+    }
+}
+
+/**
+ * The client's side of FEC with blocks of 8 segments, each missing one that
+ * the parity rebuilds
+ */
+void bench_fec_repair(size_t ops)
+{
+    static const size_t BLOCK = 8;
+    FecDecoder fec(0, Packet::MIN_MSS);
+    for (size_t i = 0; i < ops; i++)
+    {
+        uint32_t seq = i * Packet::MIN_MSS;
+        if (i % BLOCK != BLOCK - 1)
+        {
+            fec.add(seq, payload, Packet::MIN_MSS);
+            continue;
+        }
+        size_t len;
+        const char* data = fec.repair(seq - (BLOCK - 1) * Packet::MIN_MSS,
+                                      BLOCK, 0, payload, Packet::MIN_MSS,
+                                      seq, len);
+        keep(data);
+    }
+}
+
+/**
+ * Checksumming a segment, as the server does for each one it queues and
+ * the client for each one it receives
+ */
+void bench_crc32c(size_t ops)
+{
+    uint32_t crc = 0;
+    for (size_t i = 0; i < ops; i++)
+    {
+        crc = crc32c(crc, payload, Packet::MIN_MSS);
+        keep(crc);
+    }
+}
+
+/**
+ * Folding segments' checksums into the file's, every other pair arriving
+ * swapped
+ */
+void bench_file_digest(size_t ops)
+{
+    FileDigest digest(0, Packet::MIN_MSS, WINDOW_SEGMENTS * Packet::MIN_MSS);
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t j = i % 4 == 2 ? i + 1 : i % 4 == 3 ? i - 1 : i;
+        digest.add(j * Packet::MIN_MSS, j, Packet::MIN_MSS);
+        digest.advance((i + 1) * Packet::MIN_MSS);
+        keep(digest.value());
+    }
+}
+
+/**
+ * A window's worth of log lines, which deflate shrinks to under a third
+ */
+const std::vector<char>& sample_text()
+{
+    static std::vector<char> text;
+    if (text.empty())
+    {
+        std::mt19937 rng(1);
+        auto below = [&](unsigned n) { return (unsigned)(rng() % n); };
+        char line[128];
+        while (text.size() < WINDOW_SEGMENTS * Packet::MIN_MSS)
+        {
+            int n = std::snprintf(line, sizeof(line),
+                    "2026-10-17T%02u:%02u:%02u host-%02u GET /api/items/%u %u %u\n",
+                    below(24), below(60), below(60), below(16), below(100000),
+                    below(4) == 0 ? 404 : 200, below(65536));
+            text.insert(text.end(), line, line + n);
+        }
+        text.resize(WINDOW_SEGMENTS * Packet::MIN_MSS);
+    }
+    return text;
+}
+
+/**
+ * Turns ops segments' worth of in, over and over, into the compressed
+ * stream, as the server does as its window reaches the data
+ */
+void compress_segments(const std::vector<char>& in, size_t ops)
+{
+    for (uint64_t left = (uint64_t)ops * Packet::MIN_MSS; left > 0;)
+    {
+        uint64_t len = std::min(left, (uint64_t)in.size());
+        Compressor compressor(in.data(), len);
+        compressor.produce(UINT64_MAX, 0);
+        keep(compressor.crc());
+        left -= len;
+    }
+}
+
+void bench_compress_text(size_t ops)
+{
+    compress_segments(sample_text(), ops);
+}
+
+/**
+ * Data deflate can't shrink, which after the first few blocks is stored
+ * without being tried
+ */
+void bench_compress_random(size_t ops)
+{
+    static std::vector<char> noise;
+    if (noise.empty())
+    {
+        std::mt19937 rng(1);
+        noise.resize(WINDOW_SEGMENTS * Packet::MIN_MSS);
+        for (char& c : noise)
+        {
+            c = (char)rng();
+        }
+    }
+    compress_segments(noise, ops);
+}
+
+/**
+ * Inflating the compressed stream a segment at a time, as the client does
+ * as it comes in order
+ */
+void bench_decompress(size_t ops)
+{
+    static std::vector<char> stream;
+    static Decompressor inflater([](const char* data, size_t len)
+    {
+        keep(data);
+        keep(len);
+    });
+    static size_t pos = 0;
+    if (stream.empty())
+    {
+        const std::vector<char>& text = sample_text();
+        Compressor compressor(text.data(), text.size());
+        compressor.produce(UINT64_MAX, 0);
+        stream.assign(compressor.data(), compressor.data() + compressor.size());
+    }
+    // The stream starts over once it runs out, where the inflater expects a
+    // block to start anyway
+    for (size_t i = 0; i < ops; i++)
+    {
+        size_t len = std::min((size_t)Packet::MIN_MSS, stream.size() - pos);
+        inflater.feed(&stream[pos], len);
+        pos = pos + len == stream.size() ? 0 : pos + len;
+    }
+}
+
+void bench_send_batch(size_t ops)
+{
+    static NullSocket sock;
+    static SendBatch batch(64);
+    Packet p;
+    p.headers.data_len = Packet::MIN_MSS;
+    for (size_t i = 0; i < ops; i++)
+    {
+        p.headers.seq_number = i * Packet::MIN_MSS;
+        batch.add(p, payload, Packet::MIN_MSS);
+        if (batch.full())
+        {
+            batch.flush(sock);
+        }
+    }
+    batch.flush(sock);
+}
+
+void bench_histogram(size_t ops)
+{
+    static Histogram hist("microbench", "ns");
+    uint64_t v = 1;
+    for (size_t i = 0; i < ops; i++)
+    {
+        v = v * 6364136223846793005ull + 1442695040888963407ull;
+        hist.record(v >> 44);
+    }
+}
+
+void bench_rtt(size_t ops)
+{
+    RttEstimator rtt;
+    RttEstimator::time_point t;
+    for (size_t i = 0; i < ops; i++)
+    {
+        t += std::chrono::milliseconds(20);
+        rtt.sample(RttEstimator::duration(10000 + i % 512), t);
+    }
+    keep(rtt);
+}
+
+void bench_pacer(size_t ops)
+{
+    Pacer pacer;
+    pacer.set_rate(1e9);
+    Pacer::time_point t;
+    for (size_t i = 0; i < ops; i++)
+    {
+        t += std::chrono::nanoseconds(1000);
+        if (pacer.ready(t))
+        {
+            auto departure = pacer.on_send(Packet::MIN_MSS, t);
+            keep(departure);
+        }
+    }
+}
+
+void bench_now(size_t ops)
+{
+    for (size_t i = 0; i < ops; i++)
+    {
+        auto t = now();
+        keep(t);
+    }
+}
@@ -1,406 +1,424 @@
-#include "Packet.h"                     // for Packet, add_seq, get_isn, etc
+#include "Batch.h"                      // for SendBatch, RecvBatch
+#include "CongestionControl.h"          // for CongestionControl
+#include "Dispatcher.h"                 // for Dispatcher, ServerConfig
+#include "FastOpen.h"                   // for FastOpen
+#include "MappedFile.h"                 // for MappedFile
+#include "Metrics.h"                    // for Metrics
+#include "Packet.h"                     // for Packet
+#include "Socket.h"                     // for UdpSocket
+#include "Trace.h"                      // for Trace
 
-#include <algorithm>                    // for max, find_if
-#include <cassert>                      // TODO: delete me
+#include <algorithm>                    // for max, min
 #include <cerrno>                       // for errno
-#include <chrono>                       // for microseconds, duration
-#include <cstddef>                      // for size_t
-#include <cstdint>                      // for uint32_t
+#include <chrono>                       // for nanoseconds, duration_cast
+#include <csignal>                      // for sigaction, SIGINT, SIGTERM
+#include <cstdint>                      // for uint64_t
+#include <cstdlib>                      // for strtoul
 #include <cstring>                      // for strerror
-#include <fstream>                      // for ifstream
+#include <functional>                   // for cref, ref
 #include <iostream>                     // for operator<<, basic_ostream, etc
-#include <iterator>                     // for next
-#include <list>                         // for list
+#include <memory>                       // for unique_ptr
 #include <stdexcept>                    // for runtime_error
+#include <string>                       // for string
+#include <thread>                       // for thread
+#include <vector>                       // for vector
 
 #include <netdb.h>                      // for addrinfo, gai_strerror, etc
-#include <netinet/in.h>                 // for IPPROTO_UDP
-#include <sys/socket.h>                 // for bind, recv, send, etc
-#include <sys/time.h>                   // for timeval
-#include <unistd.h>                     // for close, ssize_t
+#include <netinet/in.h>                 // for IPPROTO_UDP, IP_PMTUDISC_PROBE, etc
+#include <pthread.h>                    // for pthread_sigmask
+#include <sys/epoll.h>                  // for epoll_create1, epoll_wait, etc
+#include <sys/eventfd.h>                // for eventfd
+#include <sys/socket.h>                 // for bind, recvfrom, etc
+#include <sys/timerfd.h>                // for timerfd_create, timerfd_settime
+#include <unistd.h>                     // for close, read, getopt, optind
+
+/*
+ * Types
+ */
+// A worker's system call batching, summed up on exit
+struct WorkerStats
+{
+    BatchStats sent;
+    BatchStats received;
+};
 
 /*
  * Static Variables
  */
-static timeval rcv_timeout = { .tv_sec = 0, .tv_usec = 500000 };
-static timeval close_timeout = { .tv_sec = 1, .tv_usec = 0 };
-static timeval no_timeout  = { .tv_sec = 0, .tv_usec = 0 };
+static volatile sig_atomic_t running = 1;
+// most datagrams sent or received per system call
+static const size_t BATCH_SZ = 64;
 
 /*
  * Function Declarations
  */
-bool establish_connection(int sockfd, uint32_t& seq_out);
-bool send_file(int sockfd, const char* filename, uint32_t seq);
-bool close_connection(int sockfd, uint32_t seq);
-
-enum class Mode {
-    SS, // slow start
-    CA, // congestion avoidance
-    FR  // fast recovery
-};
+int bind_socket(const char* port, bool reuse_port);
+bool run_worker(int sockfd, int stopfd, const MappedFile& file,
+                const ServerConfig& config, FastOpen& fast_open,
+                WorkerStats& stats);
+void on_signal(int);
+void on_toggle_trace(int);
+void arm_timer(int timerfd, Dispatcher::time_point deadline);
 
 /*
  * Implementations
  */
 int main(int argc, char** argv)
 {
-    if (argc != 3)
+    ServerConfig config;
+    // event loop threads, each with its own socket
+    unsigned workers = 1;
+    Trace::Level trace_level = Trace::ALL;
+    const char* trace_file = "server.trace";
+    // where to serve metrics snapshots, and write the last one on exit
+    const char* metrics_socket = nullptr;
+    const char* metrics_file = nullptr;
+    int opt;
+    bool usage = false;
+    while ((opt = getopt(argc, argv, "M:c:gj:l:m:n:o:tw:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'M':
+                config.max_mss = std::min(std::max(
+                        std::strtoul(optarg, nullptr, 10),
+                        (unsigned long)Packet::MIN_MSS), (unsigned long)Packet::MAX_MSS);
+                break;
+            case 'c':
+                config.cc = optarg;
+                break;
+            case 'g':
+                config.gso = true;
+                break;
+            case 'j':
+                metrics_file = optarg;
+                break;
+            case 'l':
+                usage = usage || !Trace::parse_level(optarg, trace_level);
+                break;
+            case 'm':
+                metrics_socket = optarg;
+                break;
+            case 'n':
+                config.max_streams = std::min(std::max(
+                        std::strtoul(optarg, nullptr, 10), 1ul), 255ul);
+                break;
+            case 'o':
+                trace_file = optarg;
+                break;
+            case 't':
+                config.txtime = true;
+                break;
+            case 'w':
+                workers = std::max(std::strtoul(optarg, nullptr, 10), 1ul);
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    if (usage || argc - optind != 2 || !CongestionControl::create(config.cc))
     {
-        std::cout << "Usage: " << argv[0] << " port-number file-name\n";
+        std::cout << "Usage: " << argv[0]
+                  << " [-M max-segment-bytes] [-c reno|cubic|bbr] [-g] [-j metrics-file]"
+                  << " [-l off|loss|all] [-m metrics-socket] [-n max-streams]"
+                  << " [-o trace-file] [-t] [-w workers] port-number file-name\n";
         return 1;
     }
-    char* port = argv[1];
-    char* filename = argv[2];
-    int sockfd = -1;
-
-    // Make the socket and bind
-    addrinfo hints, *res;
-    hints.ai_protocol = IPPROTO_UDP;
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_DGRAM;
-    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
-    int ret = getaddrinfo(nullptr, port, &hints, &res);
-    if (ret < 0)
+    char* port = argv[optind];
+    char* filename = argv[optind + 1];
+    // Every connection sends straight out of this one mapping of the file
+    std::unique_ptr<MappedFile> file;
+    try
     {
-        std::cerr << "getaddrinfo(): " << gai_strerror(ret) << std::endl;
+        file.reset(new MappedFile(filename));
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << filename << ": " << e.what() << std::endl;
         return 1;
     }
-    auto ptr = res;
-    for (; ptr != nullptr; ptr = ptr->ai_next)
+    // Each worker has its own socket on the port; the kernel spreads the
+    // clients' flows across them by address
+    std::vector<int> sockfds;
+    for (unsigned i = 0; i < workers; i++)
     {
-        sockfd = socket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol);
+        int sockfd = bind_socket(port, workers > 1);
         if (sockfd < 0)
         {
-            std::cerr << "socket(): " << std::strerror(errno) << std::endl;
-            continue;
-        }
-        if (bind(sockfd, ptr->ai_addr, ptr->ai_addrlen) < 0)
-        {
-            close(sockfd);
-            std::cerr << "bind(): " << std::strerror(errno) << std::endl;
-            continue;
+            return 1;
         }
-        break;
+        sockfds.push_back(sockfd);
     }
-    if (ptr == nullptr)
+    if (!Trace::open(trace_file, trace_level) ||
+            (metrics_socket != nullptr && !Metrics::serve(metrics_socket)))
     {
-        std::cerr << "Failed to bind to any addresses\n";
         return 1;
     }
-    freeaddrinfo(res);
-    uint32_t seq = 0;
-    establish_connection(sockfd, seq) && send_file(sockfd, filename, seq);
-    close(sockfd);
-}
 
-bool establish_connection(int sockfd, uint32_t& seq_out)
-{
-    sockaddr_storage client_storage;
-    sockaddr* client = (sockaddr*)&client_storage;
-    socklen_t client_len = sizeof(client_storage);
-    Packet in;
-    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
-    ssize_t bytes_read = recvfrom(sockfd, (void*)&in, sizeof(in), 0, client, &client_len);
-    in.to_host();
-    if (bytes_read < 0)
+    struct sigaction sa;
+    std::memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal; // no SA_RESTART, so epoll_wait returns EINTR
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    // SIGUSR1 pauses and resumes the trace
+    sa.sa_handler = on_toggle_trace;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, nullptr);
+
+    // The first worker runs on this thread and is the only one signals
+    // interrupt; once it stops, stopfd wakes the others up to stop too
+    int stopfd = eventfd(0, EFD_NONBLOCK);
+    if (stopfd < 0)
     {
-        if (errno == EINTR)
-        {
-            return false;
-        }
-        std::cerr << "recvfrom(): " << std::strerror(errno) << std::endl;
-        return false;
+        std::cerr << "eventfd(): " << std::strerror(errno) << std::endl;
+        return 1;
     }
-    else if (!in.headers.syn)
+    // Tickets work whichever worker a client's flow lands on
+    FastOpen fast_open;
+    std::vector<WorkerStats> stats(workers);
+    std::vector<std::thread> threads;
+    sigset_t signals, old_mask;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_mask);
+    for (unsigned i = 1; i < workers; i++)
     {
-        return false;
+        threads.emplace_back(run_worker, sockfds[i], stopfd, std::cref(*file),
+                             std::cref(config), std::ref(fast_open),
+                             std::ref(stats[i]));
     }
-    else if (bytes_read < (ssize_t)Packet::HEADER_SZ)
+    pthread_sigmask(SIG_SETMASK, &old_mask, nullptr);
+    bool ok = run_worker(sockfds[0], stopfd, *file, config, fast_open, stats[0]);
+    uint64_t one = 1;
+    if (write(stopfd, &one, sizeof(one)) < 0)
     {
-        return false;
+        std::cerr << "write(): " << std::strerror(errno) << std::endl;
     }
-    if (connect(sockfd, client, client_len) < 0)
+    for (auto& t : threads)
     {
-        std::cerr << "connect(): " << std::strerror(errno) << std::endl;
-        return false;
+        t.join();
     }
-    Packet out;
-    out.headers.ack = out.headers.syn = true;
-    out.headers.ack_number = add_seq(in.headers.seq_number, 1);
-    out.headers.seq_number = get_isn();
-    while (true)
+    close(stopfd);
+    for (int sockfd : sockfds)
     {
-        out.to_network();
-        int ret = send(sockfd, (void*)&out, out.HEADER_SZ, 0);
-        out.to_host();
-        if (ret < 0)
-        {
-            std::cerr << "send(): " << std::strerror(errno) << std::endl;
-            continue;
-        }
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout,
-                sizeof(rcv_timeout));
-        bytes_read = recv(sockfd, (void*)&in, sizeof(in), 0);
-        if (bytes_read < 0 && errno != EAGAIN)
-        {
-            std::cerr << "recv(): " << std::strerror(errno) << std::endl;
-            return false;
-        }
-        if (bytes_read < 0)
-        {
-            continue;
-        }
-        in.to_host();
-        if (!in.headers.ack ||
-                in.headers.ack_number != add_seq(out.headers.seq_number, 1))
-        {
-            continue;
-        }
-        seq_out = in.headers.ack_number;
-        break;
+        close(sockfd);
     }
-    return true;
+    Trace::close();
+    Metrics::stop();
+    WorkerStats total;
+    for (auto& w : stats)
+    {
+        total.sent.calls += w.sent.calls;
+        total.sent.datagrams += w.sent.datagrams;
+        total.received.calls += w.received.calls;
+        total.received.datagrams += w.received.datagrams;
+    }
+    std::cerr << "sendmmsg(): " << total.sent << '\n'
+              << "recvmmsg(): " << total.received << std::endl;
+    if (metrics_file != nullptr)
+    {
+        Metrics::dump(metrics_file);
+    }
+    return ok ? 0 : 1;
 }
 
-bool send_file(int sockfd, const char* filename, uint32_t seq)
+/**
+ * One worker's event loop: serves every connection that arrives on sockfd
+ * until the process is signalled to stop or stopfd becomes readable
+ *
+ * @return false if the loop couldn't be set up
+ */
+bool run_worker(int sockfd, int stopfd, const MappedFile& file,
+                const ServerConfig& config, FastOpen& fast_open,
+                WorkerStats& stats)
 {
-    Mode current_mode = Mode::SS;
-    std::chrono::milliseconds timeout(500);
-    std::ifstream infile(filename, std::ifstream::binary);
-    if (!infile)
+    // One epoll instance watches the socket and a timerfd that is always
+    // armed for the earliest connection deadline
+    int epfd = epoll_create1(0);
+    int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (epfd < 0 || timerfd < 0)
     {
-        throw std::runtime_error("invalid file");
+        std::cerr << "epoll/timerfd: " << std::strerror(errno) << std::endl;
+        return false;
     }
-    uint32_t cwnd = 1024;
-    uint32_t cwnd_used = 0;
-    uint32_t ssthresh = 30720;
-    uint32_t duplicate_acks = 0;
-    std::list<PacketWrapper> window;
-    timeval cur_timeout = { .tv_sec = 0, .tv_usec = 0 };
-    uint32_t last_seq = seq;
-    while (true)
+    epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = sockfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = timerfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = stopfd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, stopfd, &ev);
+
+    SendBatch batch(BATCH_SZ);
+    RecvBatch rbatch(BATCH_SZ);
+    UdpSocket sock(sockfd);
+    Dispatcher dispatcher(sock, file, config, &fast_open, batch, rbatch);
+    if (config.txtime && !batch.enable_txtime(sock))
     {
-        while (cwnd_used < cwnd && infile)
-        {
-            Packet p;
-            p.headers.seq_number = add_seq(seq, infile.tellg());
-            infile.read(p.data, std::min((size_t)Packet::DATA_SZ,
-                                         (size_t)(cwnd - cwnd_used)));
-            p.headers.data_len = (ssize_t)infile.gcount();
-            if (p.headers.data_len == 0)
-            {
-                break;
-            }
-            window.emplace_back(std::move(p));
-            cwnd_used += p.headers.data_len;
-        }
-        if (window.empty())
-        {
-            assert(cwnd_used == 0); // TODO: delete me
-            return close_connection(sockfd, last_seq);
-        }
-        uint32_t bytes_sent = 0;
-        for (auto begin_it = window.begin(); begin_it != window.end(); begin_it++)
+        std::cerr << "SO_TXTIME: " << std::strerror(errno)
+                  << "; pacing with timers instead" << std::endl;
+    }
+    if (config.gso && !batch.enable_gso(sock))
+    {
+        std::cerr << "UDP_SEGMENT: " << std::strerror(errno)
+                  << "; sending one datagram at a time" << std::endl;
+    }
+    bool want_write = false;
+    bool stopping = false;
+    epoll_event events[3];
+    while (running && !stopping)
+    {
+        int n = epoll_wait(epfd, events, 3, -1);
+        if (n < 0)
         {
-            auto& p = *begin_it;
-            bytes_sent += p.packet.headers.data_len;
-            if (p.sent)
+            if (errno == EINTR)
             {
-                if (now() - p.send_time > timeout)
-                {
-                    p.sent = false;
-                    p.retransmit = true;
-                    ssthresh = std::max(1024u, cwnd / 2);
-                    cwnd = Packet::DATA_SZ;
-                    current_mode = Mode::SS;
-                }
-                else
-                {
-                    continue;
-                }
-            }
-            if (bytes_sent > cwnd)
                 continue;
-            size_t bytes_to_send = Packet::HEADER_SZ + p.packet.headers.data_len;
-            p.packet.to_network();
-            int ret = send(sockfd, (void*)&p.packet, bytes_to_send, 0);
-            p.packet.to_host();
-            if (ret < 0)
-            {
-                std::cerr << "send(): " << std::strerror(errno) << std::endl;
-                return false;
             }
-            p.sent = true;
-            p.send_time = now();
-            std::cout << "Sending data packet " << std::setw(6)
-                      << p.packet.headers.seq_number << ' ' << std::setw(5)
-                      << cwnd << ' ' << std::setw(5) << ssthresh
-                      << (p.retransmit ? " Retransmission" : "") << std::endl;
-        }
-        cur_timeout = to_timeval(timeout - (now() - window.front().send_time));
-        Packet in;
-        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &cur_timeout, sizeof(cur_timeout)) < 0)
-        {
-            std::cerr << "setsockopt(): " << std::strerror(errno) << std::endl;
+            std::cerr << "epoll_wait(): " << std::strerror(errno) << std::endl;
+            break;
         }
-        ssize_t bytes_read = recv(sockfd, (void*)&in, sizeof(in), 0);
-        in.to_host();
-        if (bytes_read < 0 && errno != EAGAIN)
+        for (int i = 0; i < n; i++)
         {
-            std::cerr << "recv(): " << std::strerror(errno) << std::endl;
-            return false;
-        }
-        else if (bytes_read < 0)
-        {
-            window.front().sent = false;
-            window.front().retransmit = true;
-            ssthresh = std::max(1024u, cwnd / 2);
-            cwnd = Packet::DATA_SZ;
-            current_mode = Mode::SS;
-            continue;
-        }
-        std::cout << "Receiving ack packet " << std::setw(5)
-                  << in.headers.ack_number << std::endl;
-        auto it = std::find_if(window.begin(), window.end(),
-                [&in](const PacketWrapper& elem) -> bool {
-                    return add_seq(elem.packet.headers.seq_number,
-                            elem.packet.headers.data_len) ==
-                            in.headers.ack_number;
-                });
-        if (it == window.end())
-        {
-            if (current_mode == Mode::FR)
-            {
-                cwnd += Packet::DATA_SZ;
-                window.front().sent = false;
-                window.front().retransmit = true;
-            }
-            else if (++duplicate_acks == 3)
-            {
-                duplicate_acks = 0;
-                window.front().sent = false;
-                window.front().retransmit = true;
-                ssthresh = std::max(1024u, cwnd / 2);
-                cwnd = ssthresh + 3 * Packet::DATA_SZ;
-                current_mode = Mode::FR;
-            }
-            else if (current_mode == Mode::SS)
-            {
-                cwnd += Packet::DATA_SZ;
-            }
-            else if (current_mode == Mode::CA)
+            if (events[i].data.fd == stopfd)
             {
-                cwnd += std::max(1,
-                        (int)std::round(Packet::DATA_SZ * (double)Packet::DATA_SZ / cwnd));
+                stopping = true;
+                continue;
             }
-            cwnd = std::min((uint32_t)Packet::SEQ_MAX / 2, cwnd);
-            cwnd = std::min((uint32_t)in.headers.window_sz, cwnd);
-            cwnd = std::max(cwnd, 1024u);
-            continue;
-        }
-        last_seq = in.headers.ack_number;
-        switch(current_mode)
-        {
-            case Mode::SS:
+            if (events[i].data.fd == timerfd)
             {
-                cwnd += Packet::DATA_SZ;
-                break;
+                uint64_t expirations;
+                if (read(timerfd, &expirations, sizeof(expirations)) < 0 &&
+                        errno != EAGAIN)
+                {
+                    std::cerr << "read(): " << std::strerror(errno) << std::endl;
+                }
+                dispatcher.handle_timers();
+                continue;
             }
-            case Mode::CA:
+            if (events[i].events & EPOLLOUT)
             {
-                cwnd += std::max(1,
-                        (int)std::round(Packet::DATA_SZ * (double)Packet::DATA_SZ / cwnd));
-                break;
+                dispatcher.handle_writable();
             }
-            case Mode::FR:
+            if (events[i].events & EPOLLIN)
             {
-                cwnd = ssthresh;
-                duplicate_acks = 0;
-                current_mode = Mode::CA;
-                break;
+                dispatcher.handle_datagrams();
             }
         }
-        cwnd = std::min((uint32_t)Packet::SEQ_MAX / 2, cwnd);
-        cwnd = std::min((uint32_t)in.headers.window_sz, cwnd);
-        cwnd = std::max(cwnd, 1024u);
-        if (cwnd >= ssthresh)
+        // Only ask for EPOLLOUT while some connection is stuck on a full
+        // socket buffer, otherwise we'd spin
+        bool any_blocked = dispatcher.blocked();
+        if (any_blocked != want_write)
         {
-            current_mode = Mode::CA;
-        }
-        duplicate_acks = 0;
-        for (auto begin = window.begin(), end = std::next(it); begin != end; )
-        {
-            cwnd_used -= begin->packet.headers.data_len;
-            begin = window.erase(begin);
+            want_write = any_blocked;
+            ev.events = want_write ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+            ev.data.fd = sockfd;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &ev);
         }
+        arm_timer(timerfd, dispatcher.deadline());
     }
+    close(timerfd);
+    close(epfd);
+    stats.sent = batch.stats();
+    stats.received = rbatch.stats();
+    return true;
 }
 
-bool close_connection(int sockfd, uint32_t seq)
+/**
+ * Opens a non-blocking UDP socket bound to port, which other sockets may
+ * share if reuse_port is set
+ *
+ * @return the socket, or -1 on failure
+ */
+int bind_socket(const char* port, bool reuse_port)
 {
-    Packet in, out;
-    out.headers.fin = true;
-    out.headers.seq_number = seq;
-    while (true)
+    int sockfd = -1;
+    addrinfo hints, *res;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_protocol = IPPROTO_UDP;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+    int ret = getaddrinfo(nullptr, port, &hints, &res);
+    if (ret != 0)
+    {
+        std::cerr << "getaddrinfo(): " << gai_strerror(ret) << std::endl;
+        return -1;
+    }
+    auto ptr = res;
+    for (; ptr != nullptr; ptr = ptr->ai_next)
     {
-        out.to_network();
-        if (send(sockfd, (void*)&out, out.HEADER_SZ, 0) < 0)
+        sockfd = socket(ptr->ai_family, ptr->ai_socktype | SOCK_NONBLOCK,
+                        ptr->ai_protocol);
+        if (sockfd < 0)
         {
-            std::cerr << "send(): " << std::strerror(errno) << std::endl;
-            return false;
+            std::cerr << "socket(): " << std::strerror(errno) << std::endl;
+            continue;
         }
-        out.to_host();
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &rcv_timeout, sizeof(rcv_timeout));
-        ssize_t bytes_read = recv(sockfd, (void*)&in, sizeof(in), 0);
-        in.to_host();
-        if (bytes_read < 0 && errno != EAGAIN)
+        int on = 1;
+        if (reuse_port &&
+                setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
         {
-            std::cerr << "recv(): " << std::strerror(errno) << std::endl;
-            return false;
+            close(sockfd);
+            std::cerr << "SO_REUSEPORT: " << std::strerror(errno) << std::endl;
+            continue;
         }
-        else if (bytes_read < 0)
+        // Nothing we send is fragmented, whatever the kernel thinks the path
+        // MTU is: connections find out what fits by probing
+        int pmtu = IP_PMTUDISC_PROBE;
+        if (setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu)) < 0)
         {
-            continue;
+            std::cerr << "IP_MTU_DISCOVER: " << std::strerror(errno) << std::endl;
         }
-        else if (!in.headers.ack || !in.headers.fin || in.headers.ack_number != add_seq(seq, 1))
+        if (bind(sockfd, ptr->ai_addr, ptr->ai_addrlen) < 0)
         {
+            close(sockfd);
+            std::cerr << "bind(): " << std::strerror(errno) << std::endl;
             continue;
         }
         break;
     }
-    out.clear();
-    seq = out.headers.seq_number = in.headers.ack_number;
-    out.headers.ack = true;
-    out.headers.ack_number = add_seq(in.headers.seq_number, 1);
-    while (true)
+    freeaddrinfo(res);
+    if (ptr == nullptr)
     {
-        out.to_network();
-        if (send(sockfd, (void*)&out, out.HEADER_SZ, 0) < 0)
-        {
-            std::cerr << "send(): " << std::strerror(errno) << std::endl;
-            return false;
-        }
-        out.to_host();
-        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &close_timeout, sizeof(close_timeout));
-        ssize_t bytes_read = recv(sockfd, (void*)&in, sizeof(in), 0);
-        in.to_host();
-        if (bytes_read < 0)
-        {
-            if (errno == EAGAIN || errno == ECONNREFUSED) // Client got ack and went away
-            {
-                return true;
-            }
-            else
-            {
-                std::cerr << "recv(): " << std::strerror(errno) << std::endl;
-                return false;
-            }
-        }
-        if (in.headers.fin && in.headers.ack)
-        {
-            continue;
-        }
-        return true;
+        std::cerr << "Failed to bind to any addresses\n";
+        return -1;
     }
-    return true;
+    return sockfd;
+}
+
+void on_signal(int)
+{
+    running = 0;
+}
+
+void on_toggle_trace(int)
+{
+    Trace::toggle();
+}
+
+/**
+ * Arms timerfd to go off at deadline, or disarms it if there is none
+ */
+void arm_timer(int timerfd, Dispatcher::time_point deadline)
+{
+    using namespace std::chrono;
+    itimerspec spec;
+    std::memset(&spec, 0, sizeof(spec));
+    if (deadline != Dispatcher::time_point::max())
+    {
+        auto delay = duration_cast<nanoseconds>(deadline - now());
+        // A zero it_value would disarm the timer, so fire "immediately"
+        // instead for deadlines that have already passed
+        long long ns = std::max((long long)delay.count(), 1ll);
+        spec.it_value.tv_sec = ns / 1000000000ll;
+        spec.it_value.tv_nsec = ns % 1000000000ll;
+    }
+    timerfd_settime(timerfd, 0, &spec, nullptr);
 }
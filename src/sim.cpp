@@ -0,0 +1,905 @@
+#include "Batch.h"                      // for SendBatch, RecvBatch
+#include "ClientTransfer.h"             // for Client, ClientOptions
+#include "CongestionControl.h"          // for CongestionControl
+#include "Fec.h"                        // for FecDecoder
+#include "Dispatcher.h"                 // for Dispatcher, ServerConfig
+#include "FastOpen.h"                   // for FastOpen
+#include "Impairment.h"                 // for Impairment, ImpairedLink
+#include "MappedFile.h"                 // for MappedFile
+#include "Pacer.h"                      // for pacing_quantum
+#include "Packet.h"                     // for Packet, Clock, seed_random
+#include "Socket.h"                     // for Socket
+
+#include <algorithm>                    // for min, max, sort
+#include <cerrno>                       // for errno, EAGAIN, ETIMEDOUT
+#include <chrono>                       // for duration, duration_cast
+#include <cmath>                        // for exp, log, ceil
+#include <cstdint>                      // for uint64_t
+#include <cstdlib>                      // for strtod, strtoul, strtoull
+#include <cstring>                      // for memcpy, memset, strerror
+#include <deque>                        // for deque
+#include <iomanip>                      // for setw, setprecision
+#include <iostream>                     // for cout, cerr
+#include <memory>                       // for unique_ptr
+#include <queue>                        // for priority_queue
+#include <random>                       // for mt19937_64, uniform_real_distribution
+#include <sstream>                      // for istringstream
+#include <stdexcept>                    // for runtime_error
+#include <string>                       // for string, getline
+#include <vector>                       // for vector
+
+#include <getopt.h>                     // for getopt, optarg, optind
+#include <netinet/in.h>                 // for sockaddr_in, htons, htonl
+#include <sys/socket.h>                 // for mmsghdr, SO_RCVTIMEO
+#include <sys/time.h>                   // for timeval
+#include <unistd.h>                     // for write, close, unlink
+
+/*
+ * Types
+ */
+using time_point = PacketWrapper::time_point;
+using duration = time_point::duration;
+
+// The path one transfer runs over, drawn from the ranges on the command line;
+// both directions get the same one
+struct Path
+{
+    double rate;        // bottleneck bandwidth in bytes per second
+    duration rtt;       // round trip propagation delay
+    double loss;        // fraction of datagrams dropped
+    double reorder;     // fraction held back so later ones overtake them
+    size_t limit;       // datagrams the bottleneck queue holds
+    size_t mtu;         // longer datagrams (with IP and UDP headers) are dropped
+};
+
+// A range of values to draw from, uniformly or (for the ones spanning orders
+// of magnitude) uniformly in log space
+struct Range
+{
+    double lo;
+    double hi;
+};
+
+// How one transfer went
+struct Result
+{
+    bool ok;            // the client got the whole file
+    double seconds;     // until the client had the last byte
+    double utilization; // goodput as a fraction of the bottleneck bandwidth
+    double retransmit;  // fraction of data segments sent that were resends
+    bool fast;          // the connection was opened fast, with a ticket
+    uint64_t flight;    // data segments sent before the first ack came back
+    uint64_t burst;     // the most of them sent at the same instant
+};
+
+// Time only moves when the simulation says so
+class VirtualClock : public Clock
+{
+public:
+    time_point now() const override { return now_; }
+    void advance(time_point t) { now_ = std::max(now_, t); }
+
+private:
+    // not the epoch, so timestamp() never starts at 0
+    time_point now_ = time_point() + std::chrono::seconds(1000);
+};
+
+class Simulation;
+
+/**
+ * One end of the simulated path. Sends put datagrams on the link; a recv
+ * that would block runs the simulation instead, until something arrives or
+ * SO_RCVTIMEO passes.
+ */
+class SimSocket : public Socket
+{
+public:
+    SimSocket(Simulation& sim, bool to_server, const sockaddr_in& peer) :
+        sim_(sim), to_server_(to_server), peer_(peer), timeout_(0) {}
+
+    void deliver(std::string data) { inbox_.push_back(std::move(data)); }
+    bool empty() const { return inbox_.empty(); }
+
+    ssize_t send(const void* buf, size_t len, int flags) override;
+    ssize_t sendto(const void* buf, size_t len, int flags,
+                   const sockaddr* addr, socklen_t addr_len) override;
+    ssize_t recv(void* buf, size_t len, int flags) override;
+    int sendmmsg(mmsghdr* msgs, unsigned int n, int flags) override;
+    int recvmmsg(mmsghdr* msgs, unsigned int n, int flags) override;
+    int setsockopt(int level, int name, const void* value,
+                   socklen_t len) override;
+
+private:
+    bool wait(int flags);
+
+    Simulation& sim_;
+    bool to_server_;    // which way what we send goes
+    sockaddr_in peer_;  // who recvmmsg() says sent what we receive
+    duration timeout_;  // SO_RCVTIMEO, or 0 to wait as long as it takes
+    std::deque<std::string> inbox_;
+};
+
+/**
+ * One transfer: the server's real Dispatcher and the Client talking over
+ * a simulated path, impaired as impair would, on a VirtualClock. The client
+ * runs as usual and its blocking calls drive everything else: arrivals at
+ * either end and the server's timers are events, run in time order, and the clock jumps straight from
+ * one to the next. Everything random comes from the seed, so a transfer
+ * always goes the same way.
+ */
+class Simulation
+{
+public:
+    Simulation(const MappedFile& file, const Path& path, const std::string& cc,
+               const ClientOptions& options, uint64_t seed);
+    ~Simulation();
+
+    Simulation(const Simulation&) = delete;
+    Simulation& operator=(const Simulation&) = delete;
+
+    Result run();
+
+    // Called by the SimSockets
+    void transmit(bool to_server, std::string data);
+    bool wait(SimSocket& sock, duration timeout);
+    bool expired() const { return clock_.now() >= limit_; }
+
+private:
+    // A datagram on its way
+    struct Arrival
+    {
+        time_point at;
+        uint64_t order; // breaks ties, so equal arrivals keep their order
+        bool to_server;
+        std::string data;
+        bool operator>(const Arrival& o) const
+        {
+            return at != o.at ? at > o.at : order > o.order;
+        }
+    };
+
+    void step();
+    void check_done();
+
+    const MappedFile& file_;
+    Path path_;
+    ServerConfig config_;
+    ClientOptions options_;
+    std::mt19937_64 rng_;
+    VirtualClock clock_;
+    time_point start_;
+    time_point limit_;  // give up on the transfer at this point
+    time_point done_;   // when the client had the whole file
+    bool finished_;
+    std::priority_queue<Arrival, std::vector<Arrival>,
+                        std::greater<Arrival>> arrivals_;
+    uint64_t next_order_;
+    ImpairedLink uplink_;   // towards the server
+    ImpairedLink downlink_; // towards the client
+    SimSocket server_sock_;
+    SimSocket client_sock_;
+    SendBatch batch_;
+    RecvBatch rbatch_;
+    FastOpen fast_open_;
+    std::unique_ptr<Dispatcher> server_;
+    std::unique_ptr<Client> client_;
+    uint64_t data_sent_; // data segments the server sent, resends included
+    // The server's first flight of data: how long it is, the most of it
+    // sent at one instant, and when the last of it was sent
+    uint64_t flight_;
+    bool flight_over_;
+    uint64_t burst_;
+    uint64_t max_burst_;
+    time_point last_data_;
+};
+
+/*
+ * Static Variables
+ */
+// most datagrams sent or received per system call, as in the server
+static const size_t BATCH_SZ = 64;
+// blocking calls return this much after their timeout, like Linux's default
+// timer slack
+static const std::chrono::microseconds timer_slack(50);
+// a transfer that hasn't finished after this much simulated time failed
+static const std::chrono::seconds time_limit(600);
+// the bottleneck queue never holds fewer datagrams than this
+static const size_t MIN_LIMIT = 4;
+// With -t, a first flight at least this long, on a path with a round trip at
+// least PACED_RTT_QUANTA pacing quanta long, has room to be spread out; if
+// more than half of it went at one instant, it wasn't paced
+static const uint64_t MIN_PACED_FLIGHT = 8;
+static const int PACED_RTT_QUANTA = 10;
+
+/*
+ * Function Declarations
+ */
+bool parse_range(const char* s, Range& out);
+double draw(std::mt19937_64& rng, const Range& range, bool log_scale);
+double percentile(std::vector<double> values, double q);
+Impairment impairment(const Path& path);
+std::string make_file(uint64_t size);
+sockaddr_in client_address();
+
+/*
+ * Implementations
+ */
+
+/**
+ * Runs many transfers through simulated paths with bandwidths, RTTs, loss
+ * and reordering drawn from the given ranges, using the real server
+ * Connection and Client code on a virtual clock, and summarizes how each
+ * congestion control did. The same seed gives the same results.
+ */
+int main(int argc, char** argv)
+{
+    uint64_t transfers = 1000;
+    uint64_t seed = 1;
+    uint64_t size = 256 * 1024;
+    std::string ccs = "reno";
+    Range mbit = { 1, 100 };
+    Range rtt_ms = { 2, 200 };
+    Range loss = { 0, 0.02 };
+    Range reorder = { 0, 0.02 };
+    double bdps = 1;
+    size_t mtu = 1500;
+    ClientOptions options;
+    options.output = "/dev/null";
+    bool verbose = false;
+    // run only this transfer, showing what the transport prints
+    long only = -1;
+    int opt;
+    bool usage = false;
+    while ((opt = getopt(argc, argv, "b:c:e:f:i:l:m:n:o:pq:r:s:tvz")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b':
+                usage = usage || !parse_range(optarg, mbit) || mbit.lo <= 0;
+                break;
+            case 'c':
+                ccs = optarg;
+                break;
+            case 'e':
+                options.fec = std::min(std::max(std::strtoul(optarg, nullptr, 10),
+                        (unsigned long)FecDecoder::MIN_BLOCK),
+                        (unsigned long)FecDecoder::MAX_BLOCK);
+                break;
+            case 'f':
+                size = std::max(std::strtoull(optarg, nullptr, 10), 1ull);
+                break;
+            case 'i':
+                only = std::strtol(optarg, nullptr, 10);
+                break;
+            case 'l':
+                usage = usage || !parse_range(optarg, loss) || loss.hi >= 1;
+                break;
+            case 'm':
+                mtu = std::strtoul(optarg, nullptr, 10);
+                usage = usage || Packet::mss_for_mtu(mtu) < Packet::MIN_MSS;
+                break;
+            case 'n':
+                transfers = std::strtoull(optarg, nullptr, 10);
+                break;
+            case 'o':
+                usage = usage || !parse_range(optarg, reorder) || reorder.hi > 1;
+                break;
+            case 'p':
+                options.positional = true;
+                break;
+            case 'q':
+                bdps = std::strtod(optarg, nullptr);
+                break;
+            case 'r':
+                usage = usage || !parse_range(optarg, rtt_ms) || rtt_ms.lo <= 0;
+                break;
+            case 's':
+                seed = std::strtoull(optarg, nullptr, 10);
+                break;
+            case 't':
+                options.fast_open = true;
+                break;
+            case 'v':
+                verbose = true;
+                break;
+            case 'z':
+                options.compress = true;
+                break;
+            default:
+                usage = true;
+                break;
+        }
+    }
+    std::vector<std::string> names;
+    std::istringstream ss(ccs);
+    for (std::string name; std::getline(ss, name, ',');)
+    {
+        usage = usage || !CongestionControl::create(name);
+        names.push_back(name);
+    }
+    if (usage || argc != optind || names.empty())
+    {
+        std::cout << "Usage: " << argv[0]
+                  << " [-b mbit/s[:mbit/s]] [-c cc[,cc...]] [-e fec-block]"
+                  << " [-f file-bytes]"
+                  << " [-i transfer] [-l loss[:loss]] [-m mtu] [-n transfers]"
+                  << " [-o reorder[:reorder]] [-p] [-q queue-bdps]"
+                  << " [-r rtt-ms[:rtt-ms]] [-s seed] [-t] [-v] [-z]\n";
+        return 1;
+    }
+    // As in the client, only an uncompressed -p transfer gets the wide window
+    if (options.positional && !options.compress)
+    {
+        options.window = 64 * 1024 * 1024;
+    }
+
+    std::unique_ptr<MappedFile> file;
+    try
+    {
+        std::string filename = make_file(size);
+        file.reset(new MappedFile(filename.c_str()));
+        unlink(filename.c_str());
+        // A PositionalWriter, or the inflater's pwrite()s, need a real file
+        // they can size
+        if (options.positional || options.compress)
+        {
+            options.output = make_file(0);
+        }
+    }
+    catch (const std::runtime_error& e)
+    {
+        std::cerr << "sim: " << e.what() << std::endl;
+        return 1;
+    }
+
+    // Every congestion control gets the same paths
+    std::vector<Path> paths;
+    std::mt19937_64 rng(seed);
+    for (uint64_t i = 0; i < transfers; i++)
+    {
+        Path p;
+        p.rate = draw(rng, mbit, true) * 1e6 / 8;
+        p.rtt = std::chrono::duration_cast<duration>(
+                std::chrono::duration<double, std::milli>(draw(rng, rtt_ms, true)));
+        p.loss = draw(rng, loss, false);
+        p.reorder = draw(rng, reorder, false);
+        double bdp = p.rate * std::chrono::duration<double>(p.rtt).count();
+        p.mtu = mtu;
+        p.limit = std::max((size_t)(bdps * bdp / mtu), MIN_LIMIT);
+        paths.push_back(p);
+    }
+
+    std::cout << transfers << " transfers of " << size << " bytes; "
+              << mbit.lo << "-" << mbit.hi << " Mbit/s, rtt "
+              << rtt_ms.lo << "-" << rtt_ms.hi << " ms, loss "
+              << loss.lo * 100 << "-" << loss.hi * 100 << "%, reorder "
+              << reorder.lo * 100 << "-" << reorder.hi * 100 << "%, queue "
+              << bdps << " BDP, mtu " << mtu << "; seed " << seed << "\n\n";
+    std::cout << std::fixed << std::setprecision(2);
+    if (!verbose && only < 0)
+    {
+        std::cout << std::left << std::setw(6) << "cc" << std::right
+                  << std::setw(7) << "failed"
+                  << std::setw(10) << "time p50" << std::setw(10) << "time p90"
+                  << std::setw(10) << "util p10" << std::setw(10) << "util p50"
+                  << std::setw(10) << "util p90" << std::setw(10) << "rtx% p50"
+                  << std::setw(10) << "rtx% p90" << '\n';
+    }
+
+    auto wall_start = std::chrono::steady_clock::now();
+    double simulated = 0;
+    uint64_t failures = 0;
+    for (auto& name : names)
+    {
+        std::vector<double> times, utils, rtxs;
+        uint64_t failed = 0;
+        uint64_t opened_fast = 0;
+        uint64_t unpaced_flights = 0;
+        for (uint64_t i = 0; i < transfers; i++)
+        {
+            if (only >= 0 && (uint64_t)only != i)
+            {
+                continue;
+            }
+            // The transport's own messages would drown the summary
+            std::streambuf* err = std::cerr.rdbuf();
+            if (only < 0)
+            {
+                std::cerr.rdbuf(nullptr);
+            }
+            Result r;
+            {
+                Simulation sim(*file, paths[i], name, options, seed * 1000003 + i);
+                r = sim.run();
+            }
+            std::cerr.rdbuf(err);
+            std::cerr.clear();
+
+            simulated += r.seconds;
+            // Opened fast, the server starts from the window the last
+            // connection left it, so its first flight has to be paced
+            bool unpaced = r.fast && r.flight >= MIN_PACED_FLIGHT &&
+                    paths[i].rtt >= PACED_RTT_QUANTA * pacing_quantum &&
+                    r.burst * 2 > r.flight;
+            opened_fast += r.fast;
+            unpaced_flights += unpaced;
+            if (!r.ok || unpaced)
+            {
+                failed++;
+            }
+            if (r.ok)
+            {
+                times.push_back(r.seconds);
+                utils.push_back(r.utilization);
+                rtxs.push_back(r.retransmit * 100);
+            }
+            if (verbose || only >= 0)
+            {
+                const Path& p = paths[i];
+                std::cout << std::left << std::setw(6) << i << std::setw(6) << name
+                          << std::right
+                          << std::setw(8) << p.rate * 8 / 1e6 << " Mbit/s"
+                          << std::setw(8) << std::chrono::duration<double,
+                                 std::milli>(p.rtt).count() << " ms"
+                          << std::setw(6) << p.loss * 100 << "% loss"
+                          << std::setw(6) << p.reorder * 100 << "% reorder"
+                          << std::setw(6) << p.limit << " queue: ";
+                if (r.ok)
+                {
+                    std::cout << r.seconds << " s, " << r.utilization * 100
+                              << "% util, " << r.retransmit * 100 << "% rtx";
+                }
+                else
+                {
+                    std::cout << "FAILED";
+                }
+                if (r.fast)
+                {
+                    std::cout << ", first flight " << r.flight << " ("
+                              << r.burst << " at once)";
+                }
+                std::cout << (unpaced ? ", UNPACED\n" : "\n");
+            }
+        }
+        failures += failed;
+        if (!verbose && only < 0)
+        {
+            std::cout << std::left << std::setw(6) << name << std::right
+                      << std::setw(7) << failed
+                      << std::setw(10) << percentile(times, 0.5)
+                      << std::setw(10) << percentile(times, 0.9)
+                      << std::setw(10) << percentile(utils, 0.1)
+                      << std::setw(10) << percentile(utils, 0.5)
+                      << std::setw(10) << percentile(utils, 0.9)
+                      << std::setw(10) << percentile(rtxs, 0.5)
+                      << std::setw(10) << percentile(rtxs, 0.9) << '\n';
+        }
+        if (options.fast_open)
+        {
+            std::cout << std::left << std::setw(6) << name << std::right
+                      << opened_fast << " opened fast, " << unpaced_flights
+                      << " first flights unpaced\n";
+        }
+    }
+    double wall = std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - wall_start).count();
+    std::cout << '\n' << simulated << " s of transfers simulated in " << wall
+              << " s\n";
+    if (options.positional || options.compress)
+    {
+        unlink(options.output.c_str());
+    }
+    return failures > 0 ? 1 : 0;
+}
+
+/**
+ * Parses "lo:hi", or a single value for both
+ *
+ * @return false if s isn't either
+ */
+bool parse_range(const char* s, Range& out)
+{
+    char* end;
+    out.lo = std::strtod(s, &end);
+    out.hi = out.lo;
+    if (*end == ':')
+    {
+        out.hi = std::strtod(end + 1, &end);
+    }
+    return end != s && *end == '\0' && out.lo >= 0 && out.lo <= out.hi;
+}
+
+/**
+ * Draws a value from range
+ */
+double draw(std::mt19937_64& rng, const Range& range, bool log_scale)
+{
+    if (range.lo == range.hi)
+    {
+        return range.lo;
+    }
+    if (log_scale)
+    {
+        return std::exp(std::uniform_real_distribution<double>(
+                std::log(range.lo), std::log(range.hi))(rng));
+    }
+    return std::uniform_real_distribution<double>(range.lo, range.hi)(rng);
+}
+
+/**
+ * The q-th quantile of values, nearest rank, or 0 if there are none
+ */
+double percentile(std::vector<double> values, double q)
+{
+    if (values.empty())
+    {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    size_t rank = (size_t)std::ceil(q * values.size());
+    return values[std::max(rank, (size_t)1) - 1];
+}
+
+/**
+ * Writes a temporary file of size bytes for the server to send
+ *
+ * @return its name
+ */
+std::string make_file(uint64_t size)
+{
+    char name[] = "/tmp/sim.XXXXXX";
+    int fd = mkstemp(name);
+    if (fd < 0)
+    {
+        throw std::runtime_error(std::string("mkstemp(): ") + std::strerror(errno));
+    }
+    std::vector<char> buf(64 * 1024);
+    for (size_t i = 0; i < buf.size(); i++)
+    {
+        buf[i] = (char)(i * 31 + i / 251);
+    }
+    for (uint64_t left = size; left > 0;)
+    {
+        ssize_t n = write(fd, buf.data(), std::min(left, (uint64_t)buf.size()));
+        if (n < 0)
+        {
+            close(fd);
+            unlink(name);
+            throw std::runtime_error(std::string("write(): ") + std::strerror(errno));
+        }
+        left -= n;
+    }
+    close(fd);
+    return name;
+}
+
+/**
+ * Where the server sees the client's datagrams come from. Addresses only
+ * matter to the server, which replies to them, so the client's socket
+ * reports an empty one.
+ */
+sockaddr_in client_address()
+{
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(0x0a000002); // 10.0.0.2
+    addr.sin_port = htons(40000);
+    return addr;
+}
+
+/**
+ * What path does to each direction, in impair's terms: losses are
+ * independent, and reordered datagrams take the delay twice
+ */
+Impairment impairment(const Path& path)
+{
+    Impairment imp;
+    imp.loss = path.loss;
+    imp.delay = path.rtt / 2;
+    imp.reorder = path.reorder;
+    imp.rate = path.rate;
+    imp.limit = path.limit;
+    return imp;
+}
+
+ssize_t SimSocket::send(const void* buf, size_t len, int flags)
+{
+    return sendto(buf, len, flags, nullptr, 0);
+}
+
+ssize_t SimSocket::sendto(const void* buf, size_t len, int,
+                          const sockaddr*, socklen_t)
+{
+    sim_.transmit(to_server_, std::string((const char*)buf, len));
+    return len;
+}
+
+ssize_t SimSocket::recv(void* buf, size_t len, int flags)
+{
+    if (!wait(flags))
+    {
+        return -1;
+    }
+    std::string& data = inbox_.front();
+    size_t n = std::min(len, data.size());
+    std::memcpy(buf, data.data(), n);
+    // As with a real socket, MSG_TRUNC says how long the datagram was
+    if (flags & MSG_TRUNC)
+    {
+        n = data.size();
+    }
+    inbox_.pop_front();
+    return n;
+}
+
+int SimSocket::sendmmsg(mmsghdr* msgs, unsigned int n, int)
+{
+    for (unsigned int i = 0; i < n; i++)
+    {
+        std::string data;
+        const msghdr& hdr = msgs[i].msg_hdr;
+        for (size_t j = 0; j < hdr.msg_iovlen; j++)
+        {
+            data.append((const char*)hdr.msg_iov[j].iov_base,
+                        hdr.msg_iov[j].iov_len);
+        }
+        msgs[i].msg_len = data.size();
+        sim_.transmit(to_server_, std::move(data));
+    }
+    return n;
+}
+
+int SimSocket::recvmmsg(mmsghdr* msgs, unsigned int n, int flags)
+{
+    if (!wait(flags))
+    {
+        return -1;
+    }
+    unsigned int i = 0;
+    for (; i < n && !inbox_.empty(); i++)
+    {
+        const std::string& data = inbox_.front();
+        msghdr& hdr = msgs[i].msg_hdr;
+        size_t copied = 0;
+        for (size_t j = 0; j < hdr.msg_iovlen && copied < data.size(); j++)
+        {
+            size_t len = std::min(hdr.msg_iov[j].iov_len, data.size() - copied);
+            std::memcpy(hdr.msg_iov[j].iov_base, data.data() + copied, len);
+            copied += len;
+        }
+        msgs[i].msg_len = copied;
+        if (hdr.msg_name != nullptr && hdr.msg_namelen >= sizeof(peer_))
+        {
+            std::memcpy(hdr.msg_name, &peer_, sizeof(peer_));
+            hdr.msg_namelen = sizeof(peer_);
+        }
+        hdr.msg_controllen = 0;
+        hdr.msg_flags = 0;
+        inbox_.pop_front();
+    }
+    return i;
+}
+
+int SimSocket::setsockopt(int level, int name, const void* value, socklen_t len)
+{
+    if (level == SOL_SOCKET && name == SO_RCVTIMEO && len >= sizeof(timeval))
+    {
+        const timeval* tv = (const timeval*)value;
+        timeout_ = std::chrono::seconds(tv->tv_sec) +
+                   std::chrono::microseconds(tv->tv_usec);
+        return 0;
+    }
+    errno = ENOPROTOOPT;
+    return -1;
+}
+
+/**
+ * Makes sure there is something to receive, unless flags has MSG_DONTWAIT,
+ * by running the simulation until there is
+ *
+ * @return false, with errno set, if nothing came
+ */
+bool SimSocket::wait(int flags)
+{
+    if (inbox_.empty() && !(flags & MSG_DONTWAIT) && !sim_.wait(*this, timeout_))
+    {
+        errno = sim_.expired() ? ETIMEDOUT : EAGAIN;
+        return false;
+    }
+    if (inbox_.empty())
+    {
+        errno = EAGAIN;
+        return false;
+    }
+    return true;
+}
+
+Simulation::Simulation(const MappedFile& file, const Path& path,
+                       const std::string& cc, const ClientOptions& options,
+                       uint64_t seed) :
+    file_(file), path_(path), options_(options), rng_(seed),
+    finished_(false), next_order_(0),
+    uplink_(impairment(path), rng_), downlink_(impairment(path), rng_),
+    server_sock_(*this, false, client_address()),
+    client_sock_(*this, true, sockaddr_in()),
+    batch_(BATCH_SZ), rbatch_(BATCH_SZ), data_sent_(0), flight_(0),
+    flight_over_(false), burst_(0), max_burst_(0)
+{
+    config_.cc = cc;
+    config_.max_streams = 1;
+    server_.reset(new Dispatcher(server_sock_, file_, config_, &fast_open_,
+                                 batch_, rbatch_));
+    options_.congestion = cc;
+    start_ = clock_.now();
+    limit_ = start_ + time_limit;
+    seed_random((uint32_t)seed);
+    Clock::current() = &clock_;
+}
+
+Simulation::~Simulation()
+{
+    // The connections go before the clock they read
+    server_.reset();
+    client_.reset();
+    Clock::current() = nullptr;
+}
+
+/**
+ * Runs the client until it's done
+ */
+Result Simulation::run()
+{
+    // With fast open, a first transfer gets the ticket and leaves the
+    // server a path to remember; only the second, opened with the ticket,
+    // is measured
+    if (options_.fast_open)
+    {
+        Client first(client_sock_, options_);
+        if (first.run() && first.ticket_ok())
+        {
+            options_.have_ticket = true;
+            options_.ticket = first.ticket();
+            options_.srtt = first.rtt().srtt();
+        }
+        start_ = clock_.now();
+        limit_ = start_ + time_limit;
+        data_sent_ = flight_ = max_burst_ = 0;
+        flight_over_ = false;
+    }
+    client_.reset(new Client(client_sock_, options_));
+    bool ok = client_->run();
+    check_done();
+    Result r;
+    r.ok = ok && finished_;
+    r.fast = client_->opened_fast();
+    r.flight = flight_;
+    r.burst = max_burst_;
+    auto end = finished_ ? done_ : clock_.now();
+    r.seconds = std::chrono::duration<double>(end - start_).count();
+    r.utilization = r.seconds > 0 ? file_.size() / r.seconds / path_.rate : 0;
+    uint64_t segments = (file_.size() + client_->mss() - 1) / client_->mss();
+    r.retransmit = data_sent_ > segments ?
+            (double)(data_sent_ - segments) / data_sent_ : 0;
+    return r;
+}
+
+/**
+ * Puts a datagram on the link towards the server or the client
+ */
+void Simulation::transmit(bool to_server, std::string data)
+{
+    if (!to_server)
+    {
+        // Parity segments aren't data
+        Packet p;
+        std::memcpy(&p, data.data(), std::min(data.size(), sizeof(Packet)));
+        uint8_t count;
+        uint16_t lengths;
+        if (p.valid(data.size()) && !p.headers.syn &&
+                data.size() > Packet::HEADER_SZ + p.headers.opt_len &&
+                !p.get_parity(count, lengths))
+        {
+            data_sent_++;
+            if (!flight_over_)
+            {
+                auto t = clock_.now();
+                burst_ = flight_ > 0 && t == last_data_ ? burst_ + 1 : 1;
+                max_burst_ = std::max(max_burst_, burst_);
+                last_data_ = t;
+                flight_++;
+            }
+        }
+    }
+    else
+    {
+        check_done();
+    }
+    if (data.size() + Packet::IP_UDP_SZ > path_.mtu)
+    {
+        return;
+    }
+    ImpairedLink& link = to_server ? uplink_ : downlink_;
+    time_point departures[2];
+    size_t n = link.schedule(clock_.now(), data, departures);
+    for (size_t i = 0; i < n; i++)
+    {
+        arrivals_.push({ departures[i], next_order_++, to_server, data });
+    }
+}
+
+/**
+ * Runs events until sock has something to receive or timeout (if it isn't
+ * 0) has passed
+ *
+ * @return false if nothing came
+ */
+bool Simulation::wait(SimSocket& sock, duration timeout)
+{
+    check_done();
+    time_point until = limit_;
+    if (timeout.count() > 0)
+    {
+        until = std::min(until, clock_.now() + timeout + timer_slack);
+    }
+    while (sock.empty())
+    {
+        time_point next = server_->deadline();
+        if (!arrivals_.empty())
+        {
+            next = std::min(next, arrivals_.top().at);
+        }
+        if (next > until)
+        {
+            clock_.advance(until);
+            return false;
+        }
+        clock_.advance(next);
+        step();
+    }
+    // Take everything else that arrives at the same time too, the way the
+    // kernel would have it queued by the time we woke up
+    while (!arrivals_.empty() && arrivals_.top().at <= clock_.now())
+    {
+        step();
+    }
+    return true;
+}
+
+/**
+ * Runs every event due by now: delivers arrivals, then lets the server
+ * handle them and its timers, as its event loop would
+ */
+void Simulation::step()
+{
+    auto t = clock_.now();
+    while (!arrivals_.empty() && arrivals_.top().at <= t)
+    {
+        // top() is const, but we're about to pop it anyway
+        Arrival& a = const_cast<Arrival&>(arrivals_.top());
+        // The first flight is what the server sends before it hears back
+        flight_over_ = flight_over_ || (a.to_server && flight_ > 0);
+        (a.to_server ? server_sock_ : client_sock_).deliver(std::move(a.data));
+        arrivals_.pop();
+    }
+    if (!server_sock_.empty())
+    {
+        server_->handle_datagrams();
+    }
+    if (server_->deadline() <= t)
+    {
+        server_->handle_timers();
+    }
+}
+
+/**
+ * Notes when the client first had the whole file
+ */
+void Simulation::check_done()
+{
+    if (!finished_ && client_ && client_->bytes_received() >= file_.size())
+    {
+        finished_ = true;
+        done_ = clock_.now();
+    }
+}
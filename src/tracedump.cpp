@@ -0,0 +1,110 @@
+#include "Trace.h"                      // for TraceRecord, TraceHeader
+
+#include <cerrno>                       // for errno
+#include <cstdint>                      // for uint64_t
+#include <cstring>                      // for memcmp, strerror
+#include <fstream>                      // for ifstream
+#include <iomanip>                      // for setw, setfill
+#include <iostream>                     // for cout, cerr
+
+#include <getopt.h>                     // for getopt, optind
+
+/*
+ * Function Declarations
+ */
+void print_record(const TraceRecord& r, bool times);
+
+/*
+ * Implementations
+ */
+
+/**
+ * Prints a trace file written by the server or client in the text format
+ * they used to print as they went, one line per record
+ */
+int main(int argc, char** argv)
+{
+    int opt;
+    // prefix each line with its time
+    bool times = false;
+    while ((opt = getopt(argc, argv, "t")) != -1)
+    {
+        switch (opt)
+        {
+            case 't':
+                times = true;
+                break;
+            default:
+                optind = argc + 1; // force the usage message
+                break;
+        }
+    }
+    if (argc - optind != 1)
+    {
+        std::cout << "Usage: " << argv[0] << " [-t] trace-file\n";
+        return 1;
+    }
+    const char* filename = argv[optind];
+    std::ifstream in(filename, std::ifstream::binary);
+    if (!in)
+    {
+        std::cerr << filename << ": " << std::strerror(errno) << std::endl;
+        return 1;
+    }
+    TraceHeader header;
+    if (!in.read((char*)&header, sizeof(header)) ||
+            std::memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0)
+    {
+        std::cerr << filename << ": not a trace file" << std::endl;
+        return 1;
+    }
+    if (header.version != TRACE_VERSION || header.record_size != sizeof(TraceRecord))
+    {
+        std::cerr << filename << ": unsupported trace version " << header.version
+                  << std::endl;
+        return 1;
+    }
+    TraceRecord r;
+    while (in.read((char*)&r, sizeof(r)))
+    {
+        print_record(r, times);
+    }
+    if (in.gcount() != 0)
+    {
+        std::cerr << filename << ": truncated record at the end" << std::endl;
+        return 1;
+    }
+}
+
+void print_record(const TraceRecord& r, bool times)
+{
+    if (times)
+    {
+        std::cout << r.time / 1000000000 << '.' << std::setw(9)
+                  << std::setfill('0') << r.time % 1000000000
+                  << std::setfill(' ') << ' ';
+    }
+    bool retransmit = r.flags & TRACE_RETRANSMIT;
+    switch (r.type)
+    {
+        case TRACE_SEND_DATA:
+            std::cout << "Sending data packet " << std::setw(6) << r.seq << ' '
+                      << std::setw(5) << r.cwnd << ' ' << std::setw(5)
+                      << r.ssthresh << ' ' << std::setw(9) << r.rate
+                      << (retransmit ? " Retransmission" : "") << '\n';
+            break;
+        case TRACE_RECV_ACK:
+            std::cout << "Receiving ack packet " << std::setw(5) << r.seq << '\n';
+            break;
+        case TRACE_SEND_ACK:
+            std::cout << "Sending ACK packet " << std::setw(7) << r.seq
+                      << (retransmit ? " Retransmission" : "") << '\n';
+            break;
+        case TRACE_RECV_DATA:
+            std::cout << "Received data packet " << std::setw(5) << r.seq << '\n';
+            break;
+        default:
+            std::cout << "Unknown event " << (int)r.type << '\n';
+            break;
+    }
+}